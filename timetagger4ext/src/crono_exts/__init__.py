@@ -3,9 +3,34 @@ __version__ = '0.1'
 
 # Import submodules or functions to be available at package level
 # from .my_extension import my_function  # Example import
+import importlib
+import os
 
-# Define package-level functions or classes
-def initialize():
-    print("Package your_package initialized")
+# Backend of crono_exts.timetagger4, chosen by the CRONO_EXTS_BACKEND
+# environment variable: "driver" for the board, "sim" for the simulated board,
+# unset for the driver when it is installed and the simulator otherwise.
+_BACKENDS = {
+    'driver': 'timetagger4vector',
+    'sim': 'timetagger4sim',
+}
 
-initialize()
+def load_backend(name=None):
+    """Imports and returns the extension module of the backend name."""
+    if name is None:
+        name = os.environ.get('CRONO_EXTS_BACKEND')
+    if name is None:
+        try:
+            return importlib.import_module('.timetagger4vector', __name__)
+        except ImportError:
+            return importlib.import_module('.timetagger4sim', __name__)
+    if name not in _BACKENDS:
+        raise ValueError('unknown backend %r, expected one of %s' % (name, ', '.join(_BACKENDS)))
+    return importlib.import_module('.' + _BACKENDS[name], __name__)
+
+def __getattr__(name):
+    # "from crono_exts import timetagger4" loads the backend on first use
+    if name == 'timetagger4':
+        module = load_backend()
+        globals()['timetagger4'] = module
+        return module
+    raise AttributeError('module %r has no attribute %r' % (__name__, name))
@@ -0,0 +1,74 @@
+// Bookkeeping for explicit acknowledgement of read packets
+//
+// timetagger4_acknowledge() frees the DMA buffer up to and including the given
+// packet, so the data of a read may only be acknowledged once every earlier
+// read still in use has been released as well. Reads are recorded oldest first
+// as regions, each ending at the last packet of the read.
+
+#ifndef TIMETAGGER4_ACK_H
+#define TIMETAGGER4_ACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include "TimeTagger4_interface.h"
+
+class ack_ledger {
+public:
+	ack_ledger() : next_id(1) {}
+
+	// A read whose data is still in use, e.g. by zero-copy views.
+	// Returns the id to pass to release().
+	uint64_t hold(volatile crono_packet* last) {
+		region r = { next_id++, last, false };
+		regions.push_back(r);
+		return r.id;
+	}
+
+	// A read whose data is no longer needed.
+	// Returns the packet to acknowledge, NULL if earlier reads are still held.
+	volatile crono_packet* done(volatile crono_packet* last) {
+		if (regions.empty())
+			return last;
+		region r = { next_id++, last, true };
+		regions.push_back(r);
+		return NULL;
+	}
+
+	// Releases a held read, unknown ids are ignored.
+	// Returns the packet to acknowledge, NULL if nothing can be acknowledged yet.
+	volatile crono_packet* release(uint64_t id) {
+		for (size_t i = 0; i < regions.size(); i++) {
+			if (regions[i].id == id) {
+				regions[i].released = true;
+				break;
+			}
+		}
+		volatile crono_packet* ack = NULL;
+		while (!regions.empty() && regions.front().released) {
+			ack = regions.front().last;
+			regions.pop_front();
+		}
+		return ack;
+	}
+
+	size_t outstanding() const {
+		return regions.size();
+	}
+
+	// Forgets all regions, used when the device is closed
+	void clear() {
+		regions.clear();
+	}
+
+private:
+	struct region {
+		uint64_t id;
+		volatile crono_packet* last;
+		bool released;
+	};
+	std::deque<region> regions;
+	uint64_t next_id;
+};
+
+#endif
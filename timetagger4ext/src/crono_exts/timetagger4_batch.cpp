@@ -0,0 +1,282 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "timetagger4_batch.h"
+#include "timetagger4_decode.h"
+#include "timetagger4_pool.h"
+#include "timetagger4_stats.h"
+
+int packet_hit_count(volatile crono_packet* p) {
+	int hit_count = 2 * crono_packet_data_length(p);
+	// Two hits fit into every 64 bit word. The second in the last word might be empty
+	// This flag  tells us, whether the number of hits in the packet is odd
+	if ((p->flags & TIMETAGGER4_PACKET_FLAG_ODD_HITS) != 0)
+		hit_count -= 1;
+	return hit_count;
+}
+
+void batch_init(hit_batch* batch, int mode) {
+	memset(batch, 0, sizeof(*batch));
+	batch->mode = mode;
+	batch->last_timestamp = -1;
+}
+
+void batch_free(hit_batch* batch) {
+	pool_free(batch->values);
+	pool_free(batch->channels);
+	pool_free(batch->offsets);
+	pool_free(batch->meta);
+	batch_init(batch, batch->mode);
+}
+
+// new capacity for at least count elements, at least doubling the old one
+static size_t grown_capacity(size_t capacity, size_t count) {
+	size_t new_capacity = capacity * 2 > count ? capacity * 2 : count;
+	return new_capacity > 0 ? new_capacity : 1;
+}
+
+static bool reserve_hits(hit_batch* batch, size_t count) {
+	if (batch->values && count <= batch->hit_capacity)
+		return true;
+	size_t capacity = grown_capacity(batch->hit_capacity, count);
+	int64_t* values = (int64_t*)pool_realloc(batch->values, capacity * sizeof(int64_t));
+	if (!values)
+		return false;
+	batch->values = values;
+	uint8_t* channels = (uint8_t*)pool_realloc(batch->channels, capacity);
+	if (!channels)
+		return false;
+	batch->channels = channels;
+	batch->hit_capacity = capacity;
+	return true;
+}
+
+static bool reserve_packets(hit_batch* batch, size_t count) {
+	if (batch->meta && count <= batch->packet_capacity)
+		return true;
+	size_t capacity = grown_capacity(batch->packet_capacity, count);
+	int64_t* offsets = (int64_t*)pool_realloc(batch->offsets, (capacity + 1) * sizeof(int64_t));
+	if (!offsets)
+		return false;
+	batch->offsets = offsets;
+	batch_meta* meta = (batch_meta*)pool_realloc(batch->meta, capacity * sizeof(batch_meta));
+	if (!meta)
+		return false;
+	batch->meta = meta;
+	batch->packet_capacity = capacity;
+	return true;
+}
+
+bool batch_reserve(hit_batch* batch, size_t packet_count, size_t hit_count) {
+	if (!reserve_hits(batch, hit_count) || !reserve_packets(batch, packet_count))
+		return false;
+	if (batch->packet_count == 0)
+		batch->offsets[0] = 0;
+	return true;
+}
+
+// Convert TDC bins to ns in place, an int64 and a double slot have the same size
+static void bins_to_ns(int64_t* values, size_t count, double binsize) {
+	for (size_t i = 0; i < count; i++) {
+		double ns = values[i] * binsize / 1000.0;
+		memcpy(&values[i], &ns, sizeof(ns));
+	}
+}
+
+// Moves the hits of one group from TDC bins relative to the group start
+// onto the absolute ps timeline, in place
+static void bins_to_ps(int64_t* values, size_t count, int64_t group_ps, double binsize) {
+	int64_t whole_ps = (int64_t)binsize;
+	double fraction_ps = binsize - whole_ps;
+	if (fraction_ps == 0) {
+		for (size_t i = 0; i < count; i++)
+			values[i] = group_ps + values[i] * whole_ps;
+	}
+	else {
+		for (size_t i = 0; i < count; i++)
+			values[i] = group_ps + to_ps(values[i], whole_ps, fraction_ps);
+	}
+}
+
+// Moves the group start and the hits of one group onto the reference timeline, in place.
+// Each hit is corrected at its own time, a continuous mode group can last a millisecond.
+static void correct_clock(int64_t* values, size_t count, int64_t* group_ps, const clock_correction* clock) {
+	double group_shift = clock->offset + clock->drift * (double)(*group_ps - clock->pivot);
+	for (size_t i = 0; i < count; i++)
+		values[i] += llround(group_shift + clock->drift * (double)(values[i] - *group_ps));
+	*group_ps += llround(group_shift);
+}
+
+// decodes one packet into room the batch already has, OUTPUT_NS values stay in bins
+static void append_packet(hit_batch* batch, volatile crono_packet* p, const batch_scale* scale) {
+	int64_t* values = batch->values + batch->hit_count;
+	uint8_t* channels = batch->channels ? batch->channels + batch->hit_count : NULL;
+	size_t written = decode_hits((const uint32_t*)(p->data), packet_hit_count(p), scale->rollover_period, values, channels);
+	batch_shed* shed = batch->shed;
+	uint32_t shed_hits = 0;
+	if (shed && shed->active) {
+		// the shed hits are decoded too, so they are counted exactly like the kept ones
+		if (shed->policy == SHED_DROP_GROUPS || (shed->policy == SHED_EVERY_NTH && shed->sequence++ % shed->n != 0)) {
+			shed->groups++;
+			shed->hits += written;
+			shed->pending_groups++;
+			// a shed group is no gap for the next packet
+			batch->last_timestamp = p->timestamp;
+			return;
+		}
+		if (shed->policy == SHED_FIRST_HITS && written > shed->n) {
+			shed_hits = (uint32_t)(written - shed->n);
+			shed->hits += shed_hits;
+			written = shed->n;
+		}
+	}
+	// the channel bytes of the packet are still in cache from the decode
+	if (batch->count_channels && channels) {
+		for (size_t k = 0; k < written; k++) {
+			if (channels[k] < TIMETAGGER4_TDC_CHANNEL_COUNT)
+				batch->channel_hits[channels[k]]++;
+		}
+	}
+	batch->hit_count += written;
+	batch_meta* meta = &batch->meta[batch->packet_count];
+	if (batch->mode == OUTPUT_NS)
+		meta->timestamp_ns = p->timestamp * scale->packet_binsize / 1000.0;
+	else if (batch->mode == OUTPUT_PS) {
+		// the group offset differs per packet, so this is converted while the hits are hot
+		int64_t whole_ps = (int64_t)scale->packet_binsize;
+		meta->timestamp_ps = to_ps(p->timestamp, whole_ps, scale->packet_binsize - whole_ps);
+		bins_to_ps(values, written, meta->timestamp_ps, scale->binsize);
+		if (scale->clock.offset != 0 || scale->clock.drift != 0)
+			correct_clock(values, written, &meta->timestamp_ps, &scale->clock);
+	}
+	else
+		meta->timestamp_bins = p->timestamp;
+	meta->flags = p->flags;
+	meta->card = p->card;
+	meta->channel = p->channel;
+	meta->hit_count = (uint32_t)written;
+	meta->gap = inferred_gap(batch->last_timestamp, p->timestamp, scale->group_period);
+	meta->shed_groups = shed ? shed->pending_groups : 0;
+	meta->shed_hits = shed_hits;
+	if (shed)
+		shed->pending_groups = 0;
+	batch->last_timestamp = p->timestamp;
+	batch->packet_count++;
+	batch->offsets[batch->packet_count] = (int64_t)batch->hit_count;
+}
+
+bool batch_append(hit_batch* batch, volatile crono_packet* first, volatile crono_packet* last, const batch_scale* scale) {
+	// size the output from the packet headers, so that one read costs
+	// a fixed number of allocations regardless of the packet count
+	size_t packet_count = 0;
+	size_t max_hits = 0;
+	for (volatile crono_packet* p = first; p <= last; p = crono_next_packet(p)) {
+		packet_count++;
+		max_hits += packet_hit_count(p);
+	}
+
+	if (!batch_reserve(batch, batch->packet_count + packet_count, batch->hit_count + max_hits))
+		return false;
+
+	// the hot loop only unpacks integers, OUTPUT_NS is converted afterwards
+	size_t first_hit = batch->hit_count;
+	volatile crono_packet* p = first;
+	for (size_t n = 0; n < packet_count; n++, p = crono_next_packet(p))
+		append_packet(batch, p, scale);
+	if (batch->mode == OUTPUT_NS)
+		bins_to_ns(batch->values + first_hit, batch->hit_count - first_hit, scale->binsize);
+	return true;
+}
+
+volatile crono_packet* batch_fill(hit_batch* batch, volatile crono_packet* first, volatile crono_packet* last, const batch_scale* scale, volatile crono_packet** last_decoded) {
+	size_t first_hit = batch->hit_count;
+	volatile crono_packet* p = first;
+	*last_decoded = NULL;
+	while (p <= last) {
+		// the decoded hits never outnumber the hit words
+		if (batch->packet_count + 1 > batch->packet_capacity ||
+			batch->hit_count + packet_hit_count(p) > batch->hit_capacity)
+			break;
+		append_packet(batch, p, scale);
+		*last_decoded = p;
+		p = crono_next_packet(p);
+	}
+	if (batch->mode == OUTPUT_NS)
+		bins_to_ns(batch->values + first_hit, batch->hit_count - first_hit, scale->binsize);
+	return p <= last ? p : NULL;
+}
+
+bool batch_extend(hit_batch* batch, const hit_batch* other) {
+	if (!batch_reserve(batch, batch->packet_count + other->packet_count, batch->hit_count + other->hit_count))
+		return false;
+	memcpy(batch->values + batch->hit_count, other->values, other->hit_count * sizeof(int64_t));
+	memcpy(batch->channels + batch->hit_count, other->channels, other->hit_count);
+	memcpy(batch->meta + batch->packet_count, other->meta, other->packet_count * sizeof(batch_meta));
+	for (size_t i = 1; i <= other->packet_count; i++)
+		batch->offsets[batch->packet_count + i] = (int64_t)batch->hit_count + other->offsets[i];
+	for (int c = 0; c < TIMETAGGER4_TDC_CHANNEL_COUNT; c++)
+		batch->channel_hits[c] += other->channel_hits[c];
+	batch->hit_count += other->hit_count;
+	batch->packet_count += other->packet_count;
+	batch->last_timestamp = other->last_timestamp;
+	return true;
+}
+
+void channel_batch_free(channel_batch* batch) {
+	for (int c = 0; c < TIMETAGGER4_TDC_CHANNEL_COUNT; c++) {
+		pool_free(batch->values[c]);
+		batch->values[c] = NULL;
+		batch->hit_count[c] = 0;
+	}
+	pool_free(batch->offsets);
+	batch->offsets = NULL;
+	batch->channel_count = 0;
+	batch->packet_count = 0;
+}
+
+bool batch_demux(const hit_batch* batch, unsigned enabled_mask, channel_batch* out) {
+	memset(out, 0, sizeof(*out));
+	out->mode = batch->mode;
+	out->packet_count = batch->packet_count;
+	// row of every channel byte, -1 for the channels left out
+	int rows[256];
+	for (int c = 0; c < 256; c++)
+		rows[c] = -1;
+	for (int c = 0; c < TIMETAGGER4_TDC_CHANNEL_COUNT; c++) {
+		if (enabled_mask & (1u << c)) {
+			rows[c] = out->channel_count;
+			out->channels[out->channel_count++] = (uint8_t)c;
+		}
+	}
+	size_t row = batch->packet_count + 1;
+	out->offsets = (int64_t*)pool_alloc((out->channel_count > 0 ? out->channel_count : 1) * row * sizeof(int64_t));
+	if (!out->offsets)
+		return false;
+
+	// the arrays are sized by the counts of the decode, so one pass writes them
+	int64_t* cursors[TIMETAGGER4_TDC_CHANNEL_COUNT];
+	for (int r = 0; r < out->channel_count; r++) {
+		size_t count = batch->channel_hits[out->channels[r]];
+		// at least one slot, so that every channel has a buffer
+		out->values[r] = (int64_t*)pool_alloc((count > 0 ? count : 1) * sizeof(int64_t));
+		if (!out->values[r]) {
+			channel_batch_free(out);
+			return false;
+		}
+		out->hit_count[r] = count;
+		cursors[r] = out->values[r];
+		out->offsets[r * row] = 0;
+	}
+
+	// the value bits are copied as they are for double and int64 alike
+	for (size_t i = 0; i < batch->packet_count; i++) {
+		for (int64_t j = batch->offsets[i]; j < batch->offsets[i + 1]; j++) {
+			int r = rows[batch->channels[j]];
+			if (r >= 0)
+				*cursors[r]++ = batch->values[j];
+		}
+		for (int r = 0; r < out->channel_count; r++)
+			out->offsets[r * row + i + 1] = (int64_t)(cursors[r] - out->values[r]);
+	}
+	return true;
+}
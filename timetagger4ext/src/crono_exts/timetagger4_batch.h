@@ -0,0 +1,146 @@
+// Decoding of TimeTagger4 packets into flat batches owned by C++
+//
+// Nothing here touches Python objects, so all of it can run without the GIL.
+// The module turns a finished batch into numpy arrays without copying.
+
+#ifndef TIMETAGGER4_BATCH_H
+#define TIMETAGGER4_BATCH_H
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "TimeTagger4_interface.h"
+
+// Output modes of read_batch()
+#define OUTPUT_NS 0		// double ns relative to the group start, group timestamp in ns
+#define OUTPUT_BINS 1	// int64 TDC bins relative to the group start, group timestamp in packet bins
+#define OUTPUT_PS 2		// int64 ps on one timeline since the start of the capture, group timestamp in ps
+
+// Load shedding policies of batch_shed
+#define SHED_NONE 0			// keep everything
+#define SHED_DROP_GROUPS 1	// drop every group
+#define SHED_EVERY_NTH 2	// keep every nth group
+#define SHED_FIRST_HITS 3	// keep the first n hits of every group
+
+// Per-packet record of a batch, the layout matches the aligned numpy dtypes of the module
+struct batch_meta {
+	union {
+		double timestamp_ns;		// group start for OUTPUT_NS
+		int64_t timestamp_bins;		// group start for OUTPUT_BINS, in units of packet_binsize
+		int64_t timestamp_ps;		// group start for OUTPUT_PS
+	};
+	uint8_t flags;		// CRONO_PACKET_FLAG_* / TIMETAGGER4_PACKET_FLAG_* bits
+	uint8_t card;
+	uint8_t channel;
+	uint32_t hit_count;	// number of hits of the packet in the values array
+	uint32_t gap;		// groups dropped right before this packet, inferred from the timestamps
+	uint32_t shed_groups;	// groups shed right before this packet
+	uint32_t shed_hits;		// hits shed from this packet
+};
+
+// Load shedding while decoding. Groups are shed whole or cut short while
+// active, and every shed group and hit is counted, so that rates can be
+// reconstructed from what is kept.
+struct batch_shed {
+	int policy;			// SHED_*
+	uint32_t n;			// of SHED_EVERY_NTH and SHED_FIRST_HITS
+	bool active;
+	uint64_t sequence;	// groups seen while active, picks every nth
+	uint32_t pending_groups;	// shed since the last packet kept, go to its shed_groups
+	uint64_t groups;	// groups shed in total
+	uint64_t hits;		// hits shed in total, those of the shed groups included
+};
+
+// Maps the card's clock onto the reference timeline for OUTPUT_PS:
+// t + offset + drift * (t - pivot) in ps, all zero leaves the times unchanged
+struct clock_correction {
+	int64_t pivot;
+	double offset;
+	double drift;
+};
+
+// Scale factors of the configured board
+struct batch_scale {
+	int64_t rollover_period;	// TDC bins per rollover of the hit timestamp counter
+	double binsize;				// ps per TDC bin
+	double packet_binsize;		// ps per bin of the packet timestamp
+	int64_t group_period;		// packet bins between periodic starts, 0 if not periodic
+	clock_correction clock;		// applied to OUTPUT_PS only
+};
+
+// count bins of whole_ps + fraction_ps ps each. The integral part is scaled exactly,
+// so the timeline keeps ps resolution however long the capture runs.
+inline int64_t to_ps(int64_t count, int64_t whole_ps, double fraction_ps) {
+	int64_t ps = count * whole_ps;
+	if (fraction_ps != 0)
+		ps += llround(count * fraction_ps);
+	return ps;
+}
+
+// Hits of packet i are values[offsets[i]:offsets[i + 1]]
+struct hit_batch {
+	int mode;				// OUTPUT_*
+	int64_t* values;		// int64 bins or ps, or double ns for OUTPUT_NS
+	uint8_t* channels;		// TDC channel of every hit, NULL if not decoded
+	size_t hit_count;
+	size_t hit_capacity;
+	int64_t* offsets;		// packet_count + 1 entries
+	batch_meta* meta;
+	size_t packet_count;
+	size_t packet_capacity;
+	int64_t last_timestamp;	// of the packet decoded before, -1 if unknown; gives the gap of the next one
+	batch_shed* shed;		// load shedding applied by append, NULL for none
+	bool count_channels;	// count the hits kept per TDC channel into channel_hits while decoding
+	size_t channel_hits[TIMETAGGER4_TDC_CHANNEL_COUNT];
+};
+
+// Hits of a batch split by enabled TDC channel, row r holds channel channels[r].
+// Hits of row r in packet i are values[r][offsets[r * (packet_count + 1) + i] .. offsets[r * (packet_count + 1) + i + 1]]
+struct channel_batch {
+	int mode;
+	int channel_count;		// rows, one per enabled channel
+	uint8_t channels[TIMETAGGER4_TDC_CHANNEL_COUNT];
+	int64_t* values[TIMETAGGER4_TDC_CHANNEL_COUNT];
+	size_t hit_count[TIMETAGGER4_TDC_CHANNEL_COUNT];
+	int64_t* offsets;		// channel_count rows of packet_count + 1 entries
+	size_t packet_count;
+};
+
+// number of hit words in a packet
+int packet_hit_count(volatile crono_packet* p);
+
+// Empty batch, last_timestamp is unknown
+void batch_init(hit_batch* batch, int mode);
+
+// Frees the buffers still owned by the batch
+void batch_free(hit_batch* batch);
+
+// Makes room for at least the given number of packets and hits in total,
+// buffers are always allocated afterwards even for an empty batch.
+// Returns false if the buffers could not be grown.
+bool batch_reserve(hit_batch* batch, size_t packet_count, size_t hit_count);
+
+// Decodes the packets first..last and appends them to the batch.
+// Returns false if the buffers could not be grown, the batch is unchanged then.
+bool batch_append(hit_batch* batch, volatile crono_packet* first, volatile crono_packet* last, const batch_scale* scale);
+
+// Decodes the packets first..last into the capacity the batch has, without growing
+// it, e.g. into buffers provided by the caller. Stops at the first packet that does
+// not fit. Returns that packet, NULL if all packets were decoded.
+// last_decoded is set to the last packet decoded, NULL if none fit.
+volatile crono_packet* batch_fill(hit_batch* batch, volatile crono_packet* first, volatile crono_packet* last, const batch_scale* scale, volatile crono_packet** last_decoded);
+
+// Appends the packets of another batch decoded in the same mode, e.g. by another
+// thread. Returns false if the buffers could not be grown, the batch is unchanged then.
+bool batch_extend(hit_batch* batch, const hit_batch* other);
+
+// Splits the hits of a batch decoded with count_channels into one array per TDC
+// channel set in enabled_mask, in a single pass: channel_hits sizes the arrays and
+// every hit goes through the write cursor of its channel. Hits of other channels
+// are dropped. Returns false if out of memory, out holds no buffers then.
+bool batch_demux(const hit_batch* batch, unsigned enabled_mask, channel_batch* out);
+
+// Frees the buffers still owned by the channel batch
+void channel_batch_free(channel_batch* batch);
+
+#endif
@@ -0,0 +1,178 @@
+#include <math.h>
+#include <algorithm>
+#include "timetagger4_clock.h"
+
+void clock_events::record(volatile crono_packet* first, volatile crono_packet* last, const batch_scale& scale) {
+	if (source == CLOCK_EVENTS_OFF)
+		return;
+	int64_t packet_whole_ps = (int64_t)scale.packet_binsize;
+	double packet_fraction_ps = scale.packet_binsize - packet_whole_ps;
+	int64_t whole_ps = (int64_t)scale.binsize;
+	double fraction_ps = scale.binsize - whole_ps;
+	for (volatile crono_packet* p = first; p <= last; p = crono_next_packet(p)) {
+		int64_t group_ps = to_ps(p->timestamp, packet_whole_ps, packet_fraction_ps);
+		if (source == CLOCK_EVENTS_GROUP_START) {
+			events.push_back(group_ps);
+			continue;
+		}
+		// only the hits of the reference channel, overflow markers count the rollovers
+		const uint32_t* words = (const uint32_t*)(p->data);
+		int count = packet_hit_count(p);
+		int64_t rollover_offset = 0;
+		for (int i = 0; i < count; i++) {
+			uint32_t hit = words[i];
+			if ((hit >> 4) & TIMETAGGER4_HIT_FLAG_TIME_OVERFLOW)
+				rollover_offset += scale.rollover_period;
+			else if ((int)(hit & 0xf) == source)
+				events.push_back(group_ps + to_ps((hit >> 8) + rollover_offset, whole_ps, fraction_ps));
+		}
+	}
+	if (events.size() > CLOCK_MAX_EVENTS) {
+		size_t excess = events.size() - CLOCK_MAX_EVENTS;
+		events.erase(events.begin(), events.begin() + excess);
+		dropped += excess;
+	}
+}
+
+clock_fit::clock_fit(double half_life) :
+	pairs(0), decay(pow(0.5, 1.0 / half_life)), pivot(0), weight(0),
+	mean_x(0), mean_y(0), cxx(0), cxy(0), cyy(0) {
+}
+
+void clock_fit::add(int64_t local, int64_t reference) {
+	if (pairs == 0)
+		pivot = local;
+	// weighted incremental means and co-moments, numerically stable over long runs
+	double x = (double)(local - pivot);
+	double y = (double)(reference - local);
+	weight = weight * decay + 1.0;
+	cxx *= decay;
+	cxy *= decay;
+	cyy *= decay;
+	double dx = x - mean_x;
+	double dy = y - mean_y;
+	mean_x += dx / weight;
+	mean_y += dy / weight;
+	cxx += dx * (x - mean_x);
+	cxy += dx * (y - mean_y);
+	cyy += dy * (y - mean_y);
+	pairs++;
+}
+
+clock_correction clock_fit::correction() const {
+	clock_correction c = { 0, 0.0, 0.0 };
+	if (pairs == 0)
+		return c;
+	// a single pair or pairs at one time give the offset only
+	double drift = cxx > 0 ? cxy / cxx : 0.0;
+	int64_t center = (int64_t)llround(mean_x);
+	c.pivot = pivot + center;
+	c.offset = mean_y + drift * (center - mean_x);
+	c.drift = drift;
+	return c;
+}
+
+double clock_fit::rms() const {
+	if (pairs < 2 || weight <= 0)
+		return 0.0;
+	double residual = cxx > 0 ? cyy - cxy * cxy / cxx : cyy;
+	return residual > 0 ? sqrt(residual / weight) : 0.0;
+}
+
+clock_sync::clock_sync(size_t card_count, int64_t tolerance, double half_life) :
+	has_first_reference(false), first_reference(0), tolerance(tolerance) {
+	for (size_t i = 0; i < card_count; i++)
+		cards.push_back(card(half_life));
+}
+
+void clock_sync::add_reference(const std::vector<int64_t>& events) {
+	if (events.empty())
+		return;
+	if (!has_first_reference) {
+		has_first_reference = true;
+		first_reference = events.front();
+	}
+	reference.insert(reference.end(), events.begin(), events.end());
+	if (reference.size() > CLOCK_MAX_EVENTS)
+		reference.erase(reference.begin(), reference.end() - CLOCK_MAX_EVENTS);
+	for (size_t i = 0; i < cards.size(); i++)
+		match(cards[i]);
+}
+
+void clock_sync::add_local(size_t card_index, const std::vector<int64_t>& events) {
+	card& c = cards[card_index];
+	c.pending.insert(c.pending.end(), events.begin(), events.end());
+	if (c.pending.size() > CLOCK_MAX_EVENTS) {
+		size_t excess = c.pending.size() - CLOCK_MAX_EVENTS;
+		c.pending.erase(c.pending.begin(), c.pending.begin() + excess);
+		c.unmatched += excess;
+	}
+	match(c);
+}
+
+void clock_sync::set_initial_offset(size_t card_index, int64_t offset) {
+	cards[card_index].has_offset = true;
+	cards[card_index].initial_offset = offset;
+}
+
+// reference time the current fit expects for a local event
+int64_t clock_sync::expected(const card& c, int64_t local) const {
+	if (c.fit.pairs == 0)
+		return local + c.initial_offset;
+	clock_correction k = c.fit.correction();
+	return local + llround(k.offset + k.drift * (double)(local - k.pivot));
+}
+
+void clock_sync::match(card& c) {
+	if (c.pending.empty() || !has_first_reference)
+		return;
+	// without a given offset the first events of both cards are taken as the same pulse
+	if (!c.has_offset) {
+		c.has_offset = true;
+		c.initial_offset = first_reference - c.pending.front();
+	}
+	size_t used = 0;
+	for (; used < c.pending.size(); used++) {
+		int64_t local = c.pending[used];
+		int64_t want = expected(c, local);
+		// the reference card has not seen this pulse yet
+		if (want > reference.back() + tolerance)
+			break;
+		c.next_expected = want;
+		std::vector<int64_t>::iterator next = std::lower_bound(reference.begin(), reference.end(), want);
+		int64_t best = INT64_MAX;
+		if (next != reference.end())
+			best = *next;
+		if (next != reference.begin() && (best == INT64_MAX || want - *(next - 1) < best - want))
+			best = *(next - 1);
+		if (best != INT64_MAX && llabs(best - want) <= tolerance)
+			c.fit.add(local, best);
+		else
+			c.unmatched++;
+	}
+	c.pending.erase(c.pending.begin(), c.pending.begin() + used);
+	// later events of the card are paired at or after this time
+	if (!c.pending.empty())
+		c.next_expected = expected(c, c.pending.front());
+}
+
+void clock_sync::trim() {
+	// the oldest pulse any card still waits for, less the tolerance
+	int64_t oldest = INT64_MAX;
+	// card 0 is the reference card, it pairs nothing
+	for (size_t i = 1; i < cards.size(); i++) {
+		const card& c = cards[i];
+		// a card without events yet may still need any of them
+		if (c.next_expected == INT64_MAX)
+			return;
+		if (c.next_expected < oldest)
+			oldest = c.next_expected;
+	}
+	if (reference.empty())
+		return;
+	std::vector<int64_t>::iterator keep = std::lower_bound(reference.begin(), reference.end(), oldest - tolerance);
+	// the last event stays, it tells how far the reference card got
+	if (keep == reference.end())
+		keep--;
+	reference.erase(reference.begin(), keep);
+}
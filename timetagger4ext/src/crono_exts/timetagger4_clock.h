@@ -0,0 +1,110 @@
+// Offset and drift of the clocks of several cards against a reference card
+//
+// A shared reference signal, e.g. a TiGeR output wired to the start input of
+// every card, is seen by each card on its own clock. Every read records the raw
+// ps times of the reference events, either the group starts or the hits of one
+// TDC channel. clock_sync pairs the events of each card with those of the
+// reference card and fits reference = local + offset + drift * (local - pivot)
+// by least squares, with older pairs fading out so the fit follows slow drift.
+// The resulting clock_correction is applied when decoding to OUTPUT_PS.
+
+#ifndef TIMETAGGER4_CLOCK_H
+#define TIMETAGGER4_CLOCK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "TimeTagger4_interface.h"
+#include "timetagger4_batch.h"
+
+// reference event sources of clock_events
+#define CLOCK_EVENTS_OFF -2
+#define CLOCK_EVENTS_GROUP_START -1		// 0..3 select the hits of a TDC channel
+
+// upper bound of the events kept between two clock_sync updates, the oldest go first
+#define CLOCK_MAX_EVENTS (1 << 20)
+
+// Raw ps times of the reference events of one card, guarded by the device mutex
+class clock_events {
+public:
+	clock_events() : source(CLOCK_EVENTS_OFF), dropped(0) {}
+
+	// Records the reference events of the packets first..last, raw on the card's own clock
+	void record(volatile crono_packet* first, volatile crono_packet* last, const batch_scale& scale);
+
+	int source;		// CLOCK_EVENTS_*, or a TDC channel
+	std::vector<int64_t> events;
+	uint64_t dropped;	// events dropped because nobody took them
+};
+
+// Least squares line through (local, reference - local) pairs with exponential forgetting
+class clock_fit {
+public:
+	// half_life is the number of pairs after which the weight of a pair has halved
+	explicit clock_fit(double half_life);
+
+	void add(int64_t local, int64_t reference);
+
+	// Correction mapping local times onto the reference, the identity before the first pair
+	clock_correction correction() const;
+
+	// rms of the residuals of the fit in ps
+	double rms() const;
+
+	uint64_t pairs;
+
+private:
+	double decay;
+	int64_t pivot;	// local time of the first pair, keeps the sums small
+	double weight;
+	double mean_x, mean_y;
+	double cxx, cxy, cyy;
+};
+
+// Pairs the reference events of several cards with those of the reference card
+class clock_sync {
+public:
+	// tolerance is how far in ps an event may be from where the current fit expects
+	// its reference event, it has to be below half the period of the reference signal
+	clock_sync(size_t card_count, int64_t tolerance, double half_life);
+
+	// Adds events of the reference card, ascending
+	void add_reference(const std::vector<int64_t>& events);
+
+	// Adds events of a card, ascending, and fits all that can be paired by now
+	void add_local(size_t card, const std::vector<int64_t>& events);
+
+	// Sets the offset of a card before its first pair, instead of taking the
+	// difference of the first events of the card and the reference card
+	void set_initial_offset(size_t card, int64_t offset);
+
+	clock_correction correction(size_t card) const { return cards[card].fit.correction(); }
+	double rms(size_t card) const { return cards[card].fit.rms(); }
+	uint64_t pairs(size_t card) const { return cards[card].fit.pairs; }
+	uint64_t unmatched(size_t card) const { return cards[card].unmatched; }
+
+	// Drops reference events no card can pair any more
+	void trim();
+
+private:
+	struct card {
+		card(double half_life) : fit(half_life), has_offset(false), initial_offset(0), next_expected(INT64_MAX), unmatched(0) {}
+		clock_fit fit;
+		std::vector<int64_t> pending;	// events waiting for the reference to catch up
+		bool has_offset;
+		int64_t initial_offset;
+		int64_t next_expected;			// reference time of the next event to pair, INT64_MAX before any
+		uint64_t unmatched;
+	};
+
+	void match(card& c);
+	int64_t expected(const card& c, int64_t local) const;
+
+	std::vector<card> cards;
+	std::vector<int64_t> reference;
+	bool has_first_reference;
+	int64_t first_reference;
+	int64_t tolerance;
+};
+
+#endif
@@ -0,0 +1,247 @@
+#include <string.h>
+#include "timetagger4_codec.h"
+
+// The packed words are little endian like the packets of the board, so they are
+// copied as they are on the x86 hosts the driver runs on.
+
+static void put_u64(std::vector<uint8_t>* out, uint64_t value) {
+	uint8_t bytes[8];
+	memcpy(bytes, &value, sizeof(bytes));
+	out->insert(out->end(), bytes, bytes + sizeof(bytes));
+}
+
+static uint64_t get_u64(const uint8_t* data) {
+	uint64_t value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+static int bit_width(uint64_t value) {
+	int width = 0;
+	while (value) {
+		width++;
+		value >>= 1;
+	}
+	return width;
+}
+
+// Packs count values of width bits each, all below 2^width, into ceil(count * width / 8) bytes.
+// Every value stores the whole word and moves on by a word only when it is full, which
+// keeps the loop free of branches that depend on the data.
+static void pack(const uint64_t* values, size_t count, int width, std::vector<uint8_t>* out) {
+	if (width == 0)
+		return;
+	size_t start = out->size();
+	size_t bytes = (count * width + 7) / 8;
+	// room for the last whole word stored
+	out->resize(start + bytes + sizeof(uint64_t));
+	uint8_t* p = out->data() + start;
+	uint64_t word = 0;
+	int bits = 0;
+	for (size_t i = 0; i < count; i++) {
+		uint64_t value = values[i];
+		word |= value << bits;
+		memcpy(p, &word, sizeof(word));
+		int full = (bits + width) >> 6;
+		p += full * sizeof(word);
+		// the bits of the value that did not fit start the next word, none if bits is 0
+		uint64_t carry = (value >> 1) >> (63 - bits);
+		word = full ? carry : word;
+		bits = (bits + width) & 63;
+	}
+	memcpy(p, &word, sizeof(word));
+	out->resize(start + bytes);
+}
+
+// Unpacks count values of width bits each from size bytes
+static void unpack(const uint8_t* data, size_t size, size_t count, int width, uint64_t* values) {
+	if (width == 0) {
+		memset(values, 0, count * sizeof(uint64_t));
+		return;
+	}
+	uint64_t mask = width == 64 ? ~0ULL : (1ULL << width) - 1;
+	for (size_t i = 0; i < count; i++) {
+		size_t bit = i * (size_t)width;
+		size_t byte = bit / 8;
+		int shift = (int)(bit % 8);
+		uint64_t word;
+		uint8_t next = 0;
+		if (byte + 9 <= size) {
+			word = get_u64(data + byte);
+			next = data[byte + 8];
+		}
+		else {
+			// the last bytes of the block, read without going past them
+			uint8_t tail[9] = { 0 };
+			memcpy(tail, data + byte, size - byte);
+			word = get_u64(tail);
+			next = tail[8];
+		}
+		uint64_t value = word >> shift;
+		if (shift > 0 && shift + width > 64)
+			value |= (uint64_t)next << (64 - shift);
+		values[i] = value & mask;
+	}
+}
+
+void codec_encode(const int64_t* values, size_t count, bool delta, std::vector<uint8_t>* out) {
+	uint64_t block[CODEC_BLOCK];
+	int64_t previous = 0;
+	for (size_t first = 0; first < count; first += CODEC_BLOCK) {
+		size_t n = count - first < CODEC_BLOCK ? count - first : CODEC_BLOCK;
+		// differences wrap around like the times would, the decoder wraps them back
+		for (size_t i = 0; i < n; i++) {
+			int64_t value = values[first + i];
+			block[i] = delta ? (uint64_t)value - (uint64_t)previous : (uint64_t)value;
+			previous = value;
+		}
+		int64_t min = (int64_t)block[0];
+		int64_t max = min;
+		for (size_t i = 1; i < n; i++) {
+			int64_t v = (int64_t)block[i];
+			min = v < min ? v : min;
+			max = v > max ? v : max;
+		}
+		int width = bit_width((uint64_t)max - (uint64_t)min);
+		for (size_t i = 0; i < n; i++)
+			block[i] -= (uint64_t)min;
+		put_u64(out, (uint64_t)min);
+		out->push_back((uint8_t)width);
+		pack(block, n, width, out);
+	}
+}
+
+const uint8_t* codec_decode(const uint8_t* data, const uint8_t* end, size_t count, bool delta, int64_t* values) {
+	uint64_t block[CODEC_BLOCK];
+	uint64_t previous = 0;
+	for (size_t first = 0; first < count; first += CODEC_BLOCK) {
+		size_t n = count - first < CODEC_BLOCK ? count - first : CODEC_BLOCK;
+		if (end - data < 9)
+			return NULL;
+		uint64_t min = get_u64(data);
+		int width = data[8];
+		data += 9;
+		size_t bytes = (n * width + 7) / 8;
+		if (width > 64 || (size_t)(end - data) < bytes)
+			return NULL;
+		unpack(data, bytes, n, width, block);
+		data += bytes;
+		for (size_t i = 0; i < n; i++) {
+			uint64_t value = block[i] + min;
+			if (delta)
+				value += previous;
+			previous = value;
+			values[first + i] = (int64_t)value;
+		}
+	}
+	return data;
+}
+
+// Fixed part of a compressed batch, the encoded columns follow
+struct codec_header {
+	char magic[4];		// CODEC_MAGIC
+	uint32_t version;	// CODEC_VERSION
+	uint64_t packet_count;
+	uint64_t hit_count;
+};
+
+// number of meta columns besides the timestamp
+#define CODEC_META_COLUMNS 6
+
+void codec_compress_batch(const int64_t* values, const uint8_t* channels, const int64_t* offsets,
+	const batch_meta* meta, size_t packet_count, std::vector<uint8_t>* out) {
+	size_t hit_count = (size_t)offsets[packet_count];
+	codec_header header;
+	memcpy(header.magic, CODEC_MAGIC, sizeof(header.magic));
+	header.version = CODEC_VERSION;
+	header.packet_count = packet_count;
+	header.hit_count = hit_count;
+	out->insert(out->end(), (const uint8_t*)&header, (const uint8_t*)&header + sizeof(header));
+
+	codec_encode(values, hit_count, true, out);
+	std::vector<int64_t> column(hit_count > packet_count ? hit_count : packet_count);
+	for (size_t i = 0; i < hit_count; i++)
+		column[i] = channels[i];
+	codec_encode(column.data(), hit_count, false, out);
+	// the offsets as hits per packet, the meta hit_count is the same
+	for (size_t i = 0; i < packet_count; i++)
+		column[i] = offsets[i + 1] - offsets[i];
+	codec_encode(column.data(), packet_count, false, out);
+	for (size_t i = 0; i < packet_count; i++)
+		column[i] = meta[i].timestamp_bins;
+	codec_encode(column.data(), packet_count, true, out);
+	for (int c = 0; c < CODEC_META_COLUMNS; c++) {
+		for (size_t i = 0; i < packet_count; i++) {
+			const batch_meta& m = meta[i];
+			int64_t fields[CODEC_META_COLUMNS] = { m.flags, m.card, m.channel, m.gap, m.shed_groups, m.shed_hits };
+			column[i] = fields[c];
+		}
+		codec_encode(column.data(), packet_count, false, out);
+	}
+}
+
+const char* codec_decompress_batch(const uint8_t* data, size_t size, hit_batch* batch) {
+	const uint8_t* end = data + size;
+	codec_header header;
+	if (size < sizeof(header))
+		return "the data is too short";
+	memcpy(&header, data, sizeof(header));
+	data += sizeof(header);
+	if (memcmp(header.magic, CODEC_MAGIC, sizeof(header.magic)) != 0)
+		return "the data was not compressed by compress()";
+	if (header.version != CODEC_VERSION)
+		return "unsupported version of the compressed data";
+	// every value takes at least a bit, beyond that the counts are corrupt
+	if (header.hit_count > (uint64_t)size * 8 + CODEC_BLOCK || header.packet_count > (uint64_t)size * 8 + CODEC_BLOCK)
+		return "the compressed data is corrupt";
+	size_t packet_count = (size_t)header.packet_count;
+	size_t hit_count = (size_t)header.hit_count;
+	if (!batch_reserve(batch, packet_count, hit_count))
+		return "out of memory";
+	std::vector<int64_t> column(hit_count > packet_count ? hit_count : packet_count);
+	std::vector<int64_t> timestamps(packet_count);
+	const char* corrupt = "the compressed data is corrupt";
+
+	data = codec_decode(data, end, hit_count, true, batch->values);
+	if (data)
+		data = codec_decode(data, end, hit_count, false, column.data());
+	if (!data)
+		return corrupt;
+	for (size_t i = 0; i < hit_count; i++)
+		batch->channels[i] = (uint8_t)column[i];
+	data = codec_decode(data, end, packet_count, false, column.data());
+	if (data)
+		data = codec_decode(data, end, packet_count, true, timestamps.data());
+	if (!data)
+		return corrupt;
+	batch->offsets[0] = 0;
+	for (size_t i = 0; i < packet_count; i++) {
+		if (column[i] < 0 || batch->offsets[i] + column[i] > (int64_t)hit_count)
+			return corrupt;
+		batch->offsets[i + 1] = batch->offsets[i] + column[i];
+		memset(&batch->meta[i], 0, sizeof(batch_meta));
+		batch->meta[i].timestamp_bins = timestamps[i];
+		batch->meta[i].hit_count = (uint32_t)column[i];
+	}
+	if (batch->offsets[packet_count] != (int64_t)hit_count)
+		return corrupt;
+	for (int c = 0; c < CODEC_META_COLUMNS; c++) {
+		data = codec_decode(data, end, packet_count, false, column.data());
+		if (!data)
+			return corrupt;
+		for (size_t i = 0; i < packet_count; i++) {
+			batch_meta& m = batch->meta[i];
+			switch (c) {
+			case 0: m.flags = (uint8_t)column[i]; break;
+			case 1: m.card = (uint8_t)column[i]; break;
+			case 2: m.channel = (uint8_t)column[i]; break;
+			case 3: m.gap = (uint32_t)column[i]; break;
+			case 4: m.shed_groups = (uint32_t)column[i]; break;
+			default: m.shed_hits = (uint32_t)column[i]; break;
+			}
+		}
+	}
+	batch->packet_count = packet_count;
+	batch->hit_count = hit_count;
+	return NULL;
+}
@@ -0,0 +1,37 @@
+// Delta and frame-of-reference compression of integer columns
+//
+// Hit times grow by small steps, so a column is stored as the differences of
+// neighbouring values. Every block of CODEC_BLOCK differences keeps its
+// minimum as the reference and packs the offsets from it with the bit width
+// of the largest one. Columns without an order, like the channels, skip the
+// delta step and only get packed. A block costs 9 bytes of header, the times
+// of hits from one card take 2 to 3 bytes per hit instead of 8.
+
+#ifndef TIMETAGGER4_CODEC_H
+#define TIMETAGGER4_CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "timetagger4_batch.h"
+
+#define CODEC_BLOCK 128
+#define CODEC_MAGIC "TT4Z"
+#define CODEC_VERSION 1
+
+// Appends count values to out, as differences if delta
+void codec_encode(const int64_t* values, size_t count, bool delta, std::vector<uint8_t>* out);
+
+// Decodes count values from data..end, returns the end of what was read or NULL
+// if the data is malformed
+const uint8_t* codec_decode(const uint8_t* data, const uint8_t* end, size_t count, bool delta, int64_t* values);
+
+// Compresses the columns of a batch with int64 values into out
+void codec_compress_batch(const int64_t* values, const uint8_t* channels, const int64_t* offsets,
+	const batch_meta* meta, size_t packet_count, std::vector<uint8_t>* out);
+
+// Restores a batch from codec_compress_batch() into an empty batch of int64 values.
+// Returns NULL or the error, the batch holds no hits then but may hold buffers.
+const char* codec_decompress_batch(const uint8_t* data, size_t size, hit_batch* batch);
+
+#endif
@@ -0,0 +1,186 @@
+#include "timetagger4_config.h"
+
+const config_field config_scalars[] = {
+	{"tdc_mode", CONFIG_INT, offsetof(timetagger4_configuration, tdc_mode)},
+	{"auto_trigger_period", CONFIG_UINT32, offsetof(timetagger4_configuration, auto_trigger_period)},
+	{"auto_trigger_random_exponent", CONFIG_UINT32, offsetof(timetagger4_configuration, auto_trigger_random_exponent)},
+	{"ignore_empty_packets", CONFIG_BOOL, offsetof(timetagger4_configuration, ignore_empty_packets)},
+	{NULL, CONFIG_INT, 0}
+};
+
+static const config_field value_double[] = {
+	{NULL, CONFIG_DOUBLE, 0}
+};
+
+static const config_field channel_fields[] = {
+	{"enabled", CONFIG_BOOL, offsetof(timetagger4_channel, enabled)},
+	{"rising", CONFIG_BOOL, offsetof(timetagger4_channel, rising)},
+	{"cc_enable", CONFIG_BOOL, offsetof(timetagger4_channel, cc_enable)},
+	{"cc_same_edge", CONFIG_BOOL, offsetof(timetagger4_channel, cc_same_edge)},
+	{"ths788_disable", CONFIG_BOOL, offsetof(timetagger4_channel, ths788_disable)},
+	{"start", CONFIG_UINT32, offsetof(timetagger4_channel, start)},
+	{"stop", CONFIG_UINT32, offsetof(timetagger4_channel, stop)},
+	{NULL, CONFIG_INT, 0}
+};
+
+static const config_field trigger_fields[] = {
+	{"falling", CONFIG_BOOL, offsetof(timetagger4_trigger, falling)},
+	{"rising", CONFIG_BOOL, offsetof(timetagger4_trigger, rising)},
+	{NULL, CONFIG_INT, 0}
+};
+
+static const config_field tiger_fields[] = {
+	{"enable", CONFIG_BOOL, offsetof(timetagger4_tiger_block, enable)},
+	{"negate", CONFIG_BOOL, offsetof(timetagger4_tiger_block, negate)},
+	{"retrigger", CONFIG_BOOL, offsetof(timetagger4_tiger_block, retrigger)},
+	{"extend", CONFIG_BOOL, offsetof(timetagger4_tiger_block, extend)},
+	{"enable_lemo_output", CONFIG_BOOL, offsetof(timetagger4_tiger_block, enable_lemo_output)},
+	{"start", CONFIG_UINT32, offsetof(timetagger4_tiger_block, start)},
+	{"stop", CONFIG_UINT32, offsetof(timetagger4_tiger_block, stop)},
+	{"sources", CONFIG_INT, offsetof(timetagger4_tiger_block, sources)},
+	{NULL, CONFIG_INT, 0}
+};
+
+static const config_field delay_fields[] = {
+	{"delay", CONFIG_UINT32, offsetof(timetagger4_delay_config, delay)},
+	{NULL, CONFIG_INT, 0}
+};
+
+const config_array config_arrays[] = {
+	{"dc_offset", offsetof(timetagger4_configuration, dc_offset), TIMETAGGER4_TDC_CHANNEL_COUNT + 1, sizeof(double), value_double},
+	{"trigger", offsetof(timetagger4_configuration, trigger), TIMETAGGER4_TRIGGER_COUNT, sizeof(timetagger4_trigger), trigger_fields},
+	{"tiger_block", offsetof(timetagger4_configuration, tiger_block), TIMETAGGER4_TIGER_COUNT, sizeof(timetagger4_tiger_block), tiger_fields},
+	{"channel", offsetof(timetagger4_configuration, channel), TIMETAGGER4_TDC_CHANNEL_COUNT, sizeof(timetagger4_channel), channel_fields},
+	{"delay_config", offsetof(timetagger4_configuration, delay_config), TIMETAGGER4_TDC_CHANNEL_COUNT + 1, sizeof(timetagger4_delay_config), delay_fields},
+	{NULL, 0, 0, 0, NULL}
+};
+
+void config_example(timetagger4_configuration* config, const timetagger4_static_info* si,
+	int tdc_mode, bool tiger_start, bool tiger_stops) {
+	// set config of the 4 TDC channels
+	for (int i = 0; i < TIMETAGGER4_TDC_CHANNEL_COUNT; i++)
+	{
+		// enable recording hits on TDC channel
+		config->channel[i].enabled = true;
+
+		// define range of the group
+		config->channel[i].start = 0;	// range begins right after start pulse
+
+		config->channel[i].stop = 30000;	// recording window stops after ~15 us
+
+
+		// measure only rising edge for tiger (positive) pulse or falling for user (negative) pulse
+		config->trigger[TIMETAGGER4_TRIGGER_A + i].falling = tiger_stops ? 0 : 1;
+		config->trigger[TIMETAGGER4_TRIGGER_A + i].rising = tiger_stops ? 1 : 0;
+	}
+
+	// generate an internal 25 kHz trigger, used for tiger and continuous mode
+	config->auto_trigger_period = (int)(si->auto_trigger_ref_clock / 1000);
+	config->auto_trigger_random_exponent = 0;
+
+	if (tdc_mode == TIMETAGGER4_TDC_MODE_CONTINUOUS) {
+		// the auto trigger starts every packet, each channel records the whole period
+		config->tdc_mode = TIMETAGGER4_TDC_MODE_CONTINUOUS;
+		if (config->auto_trigger_period < TIMETAGGER4_MIN_CONT_AUTO_TRIGGER_PERIOD)
+			config->auto_trigger_period = TIMETAGGER4_MIN_CONT_AUTO_TRIGGER_PERIOD;
+		if (config->auto_trigger_period > TIMETAGGER4_MAX_CONT_AUTO_TRIGGER_PERIOD)
+			config->auto_trigger_period = TIMETAGGER4_MAX_CONT_AUTO_TRIGGER_PERIOD;
+		for (int i = 0; i < TIMETAGGER4_TDC_CHANNEL_COUNT; i++)
+			config->channel[i].stop = 0xFFFFFFFF;
+	}
+
+	// setup TiGeR
+	// sending a signal to the LEMO outputs (and to the TDC on the same channel)
+	// requires proper 50 Ohm termination on the LEMO output to work reliably
+
+	// width of the 12ns pulse in the auto_trigger clock periods
+	int pulse_width = (int)(12e-9 * si->auto_trigger_ref_clock);
+
+
+	// use 200 kHz auto trigger to generate
+
+	// generate above configured auto trigger to generate a 
+	// signal with 12 ns pulse width on LEMO output Start
+	config->tiger_block[0].enable = tiger_start ? 1 : 0;
+	config->tiger_block[0].start = 0;
+	config->tiger_block[0].stop = config->tiger_block[0].start + pulse_width;
+	config->tiger_block[0].negate = 0;
+	config->tiger_block[0].retrigger = 0;
+	config->tiger_block[0].extend = 0;
+	config->tiger_block[0].enable_lemo_output = 1;
+	config->tiger_block[0].sources = TIMETAGGER4_TRIGGER_SOURCE_AUTO;
+	// if TiGeR is used for triggering with positive pulses
+	if (tiger_start)
+		config->dc_offset[0] = TIMETAGGER4_DC_OFFSET_P_LVCMOS_18;
+	else // user input expect NIM signal
+		config->dc_offset[0] = TIMETAGGER4_DC_OFFSET_N_NIM;
+
+	// start group on falling edges on the start channel 0
+	config->trigger[TIMETAGGER4_TRIGGER_S].falling = tiger_start ? 0 : 1;
+	config->trigger[TIMETAGGER4_TRIGGER_S].rising = tiger_start ? 1 : 0;
+
+
+	for (int i = 1; i < TDC4_TIGER_COUNT; i++) {
+		config->tiger_block[i].enable = tiger_stops ? 1 : 0;
+		config->tiger_block[i].start = i * 100;
+		config->tiger_block[i].stop = config->tiger_block[i].start + pulse_width;
+		config->tiger_block[i].negate = 0;
+		config->tiger_block[i].retrigger = 0;
+		config->tiger_block[i].extend = 0;
+		config->tiger_block[i].enable_lemo_output = tiger_stops ? 1 : 0;
+		config->tiger_block[i].sources = TIMETAGGER4_TRIGGER_SOURCE_AUTO;
+
+
+		if (tiger_stops)
+			config->dc_offset[i] = TIMETAGGER4_DC_OFFSET_P_LVCMOS_18;
+		else // user input expect NIM signal
+			config->dc_offset[i] = TIMETAGGER4_DC_OFFSET_N_NIM;
+
+		// this is not related to the tigers, but uses the same indexing (0 is start)
+		// optionally increase input delay by 10 * 200 ps for each channel on new TT		
+		// config->delay_config[i].delay = i * 10;
+	}
+}
+
+const char* config_check(const timetagger4_configuration* config) {
+	if (config->tdc_mode != TIMETAGGER4_TDC_MODE_GROUPED && config->tdc_mode != TIMETAGGER4_TDC_MODE_CONTINUOUS)
+		return "tdc_mode must be TDC_MODE_GROUPED or TDC_MODE_CONTINUOUS";
+	if (config->tdc_mode == TIMETAGGER4_TDC_MODE_CONTINUOUS) {
+		if (config->auto_trigger_period < TIMETAGGER4_MIN_CONT_AUTO_TRIGGER_PERIOD ||
+			config->auto_trigger_period > TIMETAGGER4_MAX_CONT_AUTO_TRIGGER_PERIOD)
+			return "auto_trigger_period must be within MIN_CONT_AUTO_TRIGGER_PERIOD..MAX_CONT_AUTO_TRIGGER_PERIOD in TDC_MODE_CONTINUOUS";
+	}
+	// T = M + [1...2^N] - 1 clock cycles with 10 <= M < 2^31 and 0 <= N < 32
+	else if (config->auto_trigger_period < 10 || config->auto_trigger_period >= 0x80000000u) {
+		return "auto_trigger_period must be within 10..2**31 - 1";
+	}
+	if (config->auto_trigger_random_exponent >= 32)
+		return "auto_trigger_random_exponent must be below 32";
+	for (int i = 0; i < TIMETAGGER4_TDC_CHANNEL_COUNT + 1; i++) {
+		if (!(config->dc_offset[i] >= -1.32 && config->dc_offset[i] <= 1.18))
+			return "dc_offset must be within -1.32..1.18 V";
+		if (config->delay_config[i].delay > 1023)
+			return "delay_config delay must be within 0..1023 bins";
+	}
+	for (int i = 0; i < TIMETAGGER4_TDC_CHANNEL_COUNT; i++) {
+		if (config->channel[i].start > config->channel[i].stop)
+			return "channel start must not be after stop";
+	}
+	for (int i = 0; i < TIMETAGGER4_TIGER_COUNT; i++) {
+		if (config->tiger_block[i].start > config->tiger_block[i].stop)
+			return "tiger_block start must not be after stop";
+	}
+	return NULL;
+}
+
+int64_t config_group_period(const timetagger4_configuration* config, const timetagger4_static_info* si,
+	const timetagger4_param_info* pi) {
+	// groups start at the auto trigger in continuous mode, in grouped mode when
+	// the TiGeR on Start is driven by the auto trigger alone
+	bool periodic = config->tdc_mode == TIMETAGGER4_TDC_MODE_CONTINUOUS ||
+		(config->tiger_block[0].enable && config->tiger_block[0].sources == TIMETAGGER4_TRIGGER_SOURCE_AUTO);
+	if (!periodic || config->auto_trigger_random_exponent != 0 ||
+		si->auto_trigger_ref_clock <= 0 || pi->packet_binsize <= 0)
+		return 0;
+	return (int64_t)(config->auto_trigger_period / si->auto_trigger_ref_clock * 1e12 / pi->packet_binsize + 0.5);
+}
@@ -0,0 +1,58 @@
+// Configuration of the board as named fields
+//
+// The tables below name the members of timetagger4_configuration, so the
+// extension converts a configuration from and to Python dicts without a
+// function per field. Members marked "not applicable" for the TimeTagger4 in
+// the driver header are left out.
+
+#ifndef TIMETAGGER4_CONFIG_H
+#define TIMETAGGER4_CONFIG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "TimeTagger4_interface.h"
+
+enum config_type {
+	CONFIG_BOOL,	// crono_bool_t
+	CONFIG_INT,		// int
+	CONFIG_UINT32,	// uint32_t
+	CONFIG_DOUBLE	// double
+};
+
+// One member of a struct, the tables end with a NULL name
+struct config_field {
+	const char* name;
+	config_type type;
+	size_t offset;
+};
+
+// An array member of timetagger4_configuration, the tables end with a NULL name.
+// Each element is a struct with fields, or a plain value if fields has a NULL name.
+struct config_array {
+	const char* name;
+	size_t offset;
+	size_t count;
+	size_t stride;
+	const config_field* fields;
+};
+
+extern const config_field config_scalars[];
+extern const config_array config_arrays[];
+
+// The setup of the examples: all channels enabled with a window of ~15 us, the
+// auto trigger driving TiGeR pulses on Start (tiger_start) and on A-D
+// (tiger_stops). In TDC_MODE_CONTINUOUS the auto trigger starts each packet and
+// the channels record the whole period. config holds the driver defaults before.
+void config_example(timetagger4_configuration* config, const timetagger4_static_info* si,
+	int tdc_mode, bool tiger_start, bool tiger_stops);
+
+// Checks ranges the driver documents, returns NULL if config is valid or else
+// what is wrong with it
+const char* config_check(const timetagger4_configuration* config);
+
+// Packet timestamp bins between two groups if the auto trigger starts them at a
+// fixed period, 0 otherwise
+int64_t config_group_period(const timetagger4_configuration* config, const timetagger4_static_info* si,
+	const timetagger4_param_info* pi);
+
+#endif
@@ -0,0 +1,259 @@
+#include <string.h>
+#include "TimeTagger4_interface.h"
+#include "timetagger4_decode.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define DECODE_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define DECODE_TARGET(isa)
+#define DECODE_POPCOUNT(x) __popcnt(x)
+#else
+#define DECODE_TARGET(isa) __attribute__((target(isa)))
+#define DECODE_POPCOUNT(x) __builtin_popcount(x)
+#endif
+#endif
+
+// bit of the TIMETAGGER4_HIT_FLAG_TIME_OVERFLOW flag in the hit word
+const uint32_t OVERFLOW_BIT = TIMETAGGER4_HIT_FLAG_TIME_OVERFLOW << 4;
+const uint32_t CHANNEL_MASK = 0xf;
+
+// Branch-free scalar loop over words[i..count), continuing at the given state.
+// An overflow marker is written like a hit but the cursor does not advance,
+// so the next hit overwrites it. The vector kernels finish with it as well.
+static inline size_t decode_tail(const uint32_t* words, size_t i, size_t count, int64_t rollover_period,
+	int64_t rollover_offset, int64_t* out, uint8_t* channels, size_t written) {
+	if (channels) {
+		for (; i < count; i++) {
+			uint32_t hit = words[i];
+			uint32_t overflow = (hit & OVERFLOW_BIT) != 0;
+			rollover_offset += overflow * rollover_period;
+			out[written] = (hit >> 8) + rollover_offset;
+			channels[written] = (uint8_t)(hit & CHANNEL_MASK);
+			written += overflow ^ 1;
+		}
+	}
+	else {
+		for (; i < count; i++) {
+			uint32_t hit = words[i];
+			uint32_t overflow = (hit & OVERFLOW_BIT) != 0;
+			rollover_offset += overflow * rollover_period;
+			out[written] = (hit >> 8) + rollover_offset;
+			written += overflow ^ 1;
+		}
+	}
+	return written;
+}
+
+// reference kernel
+static size_t decode_hits_scalar(const uint32_t* words, size_t count, int64_t rollover_period, int64_t* out, uint8_t* channels) {
+	return decode_tail(words, 0, count, rollover_period, 0, out, channels, 0);
+}
+
+#ifdef DECODE_X86
+// Lookup tables indexed by an 8 bit lane mask:
+// prefix_lut[m][j] = number of set bits of m in lanes 0..j, the rollover count of lane j
+// compact_lut[m] = indices of the set lanes of m, moved to the front
+static uint8_t prefix_lut[256][8];
+static uint8_t compact_lut[256][8];
+
+static void init_luts() {
+	for (int m = 0; m < 256; m++) {
+		int set = 0;
+		int k = 0;
+		for (int j = 0; j < 8; j++) {
+			if (m & (1 << j)) {
+				set++;
+				compact_lut[m][k++] = (uint8_t)j;
+			}
+			prefix_lut[m][j] = (uint8_t)set;
+		}
+		while (k < 8)
+			compact_lut[m][k++] = 0;
+	}
+}
+
+// 8 hits per iteration. Rollover counts come from a prefix sum over the
+// overflow mask, hits are compacted with a permutation so no lane branches.
+DECODE_TARGET("avx2")
+static size_t decode_hits_avx2(const uint32_t* words, size_t count, int64_t rollover_period, int64_t* out, uint8_t* channels) {
+	const __m256i overflow_bit = _mm256_set1_epi32((int)OVERFLOW_BIT);
+	const __m256i channel_mask = _mm256_set1_epi32((int)CHANNEL_MASK);
+	// low byte of every 32 bit lane to the front of its 128 bit half, then both halves together
+	const __m256i byte_shuffle = _mm256_setr_epi8(
+		0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+	const __m256i join_halves = _mm256_setr_epi32(0, 4, 1, 1, 1, 1, 1, 1);
+	const __m256i period = _mm256_set1_epi64x(rollover_period);
+	int64_t rollover_offset = 0;
+	size_t written = 0;
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256i w = _mm256_loadu_si256((const __m256i*)(words + i));
+		__m256i is_overflow = _mm256_cmpeq_epi32(_mm256_and_si256(w, overflow_bit), overflow_bit);
+		unsigned overflow_mask = (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(is_overflow));
+		unsigned keep_mask = ~overflow_mask & 0xff;
+
+		__m256i ts = _mm256_srli_epi32(w, 8);
+		__m256i rollovers = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)prefix_lut[overflow_mask]));
+		__m256i perm = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)compact_lut[keep_mask]));
+		ts = _mm256_permutevar8x32_epi32(ts, perm);
+		rollovers = _mm256_permutevar8x32_epi32(rollovers, perm);
+
+		__m256i base = _mm256_set1_epi64x(rollover_offset);
+		__m256i ts_lo = _mm256_cvtepu32_epi64(_mm256_castsi256_si128(ts));
+		__m256i ts_hi = _mm256_cvtepu32_epi64(_mm256_extracti128_si256(ts, 1));
+		__m256i rc_lo = _mm256_cvtepu32_epi64(_mm256_castsi256_si128(rollovers));
+		__m256i rc_hi = _mm256_cvtepu32_epi64(_mm256_extracti128_si256(rollovers, 1));
+		__m256i v_lo = _mm256_add_epi64(_mm256_add_epi64(ts_lo, base), _mm256_mul_epu32(rc_lo, period));
+		__m256i v_hi = _mm256_add_epi64(_mm256_add_epi64(ts_hi, base), _mm256_mul_epu32(rc_hi, period));
+		// the cursor never passes i, so full stores stay inside out[0..count)
+		_mm256_storeu_si256((__m256i*)(out + written), v_lo);
+		_mm256_storeu_si256((__m256i*)(out + written + 4), v_hi);
+		if (channels) {
+			__m256i ch = _mm256_permutevar8x32_epi32(_mm256_and_si256(w, channel_mask), perm);
+			ch = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(ch, byte_shuffle), join_halves);
+			_mm_storel_epi64((__m128i*)(channels + written), _mm256_castsi256_si128(ch));
+		}
+
+		written += DECODE_POPCOUNT(keep_mask);
+		rollover_offset += DECODE_POPCOUNT(overflow_mask) * rollover_period;
+	}
+	return decode_tail(words, i, count, rollover_period, rollover_offset, out, channels, written);
+}
+
+// 16 hits per iteration, prefix sums of both mask halves from the same table
+// and compaction with vpcompressq, channels with vpcompressd. The zero-masked
+// forms with every lane set stand in for the plain intrinsics, whose undefined
+// source vector -Wmaybe-uninitialized reports with GCC.
+DECODE_TARGET("avx512f")
+static size_t decode_hits_avx512(const uint32_t* words, size_t count, int64_t rollover_period, int64_t* out, uint8_t* channels) {
+	const __m512i overflow_bit = _mm512_set1_epi32((int)OVERFLOW_BIT);
+	const __m512i channel_mask = _mm512_set1_epi32((int)CHANNEL_MASK);
+	const __m512i period = _mm512_set1_epi64(rollover_period);
+	int64_t rollover_offset = 0;
+	size_t written = 0;
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m512i w = _mm512_loadu_si512((const void*)(words + i));
+		unsigned overflow_mask = (unsigned)_mm512_test_epi32_mask(w, overflow_bit);
+		unsigned overflow_lo = overflow_mask & 0xff;
+		unsigned overflow_hi = overflow_mask >> 8;
+		__mmask8 keep_lo = (__mmask8)(~overflow_lo & 0xff);
+		__mmask8 keep_hi = (__mmask8)(~overflow_hi & 0xff);
+
+		__m512i ts = _mm512_maskz_srli_epi32(0xffff, w, 8);
+		__m128i prefix = _mm_unpacklo_epi64(
+			_mm_loadl_epi64((const __m128i*)prefix_lut[overflow_lo]),
+			_mm_loadl_epi64((const __m128i*)prefix_lut[overflow_hi]));
+		__m512i rollovers = _mm512_maskz_cvtepu8_epi32(0xffff, prefix);
+		// lanes 8..15 also count the overflows of lanes 0..7
+		rollovers = _mm512_mask_add_epi32(rollovers, 0xff00, rollovers, _mm512_set1_epi32((int)DECODE_POPCOUNT(overflow_lo)));
+
+		__m512i base = _mm512_set1_epi64(rollover_offset);
+		__m512i ts_lo = _mm512_maskz_cvtepu32_epi64(0xff, _mm512_maskz_extracti64x4_epi64(0xf, ts, 0));
+		__m512i ts_hi = _mm512_maskz_cvtepu32_epi64(0xff, _mm512_maskz_extracti64x4_epi64(0xf, ts, 1));
+		__m512i rc_lo = _mm512_maskz_cvtepu32_epi64(0xff, _mm512_maskz_extracti64x4_epi64(0xf, rollovers, 0));
+		__m512i rc_hi = _mm512_maskz_cvtepu32_epi64(0xff, _mm512_maskz_extracti64x4_epi64(0xf, rollovers, 1));
+		__m512i v_lo = _mm512_add_epi64(_mm512_add_epi64(ts_lo, base), _mm512_maskz_mul_epu32(0xff, rc_lo, period));
+		__m512i v_hi = _mm512_add_epi64(_mm512_add_epi64(ts_hi, base), _mm512_maskz_mul_epu32(0xff, rc_hi, period));
+		if (channels) {
+			__m512i ch = _mm512_maskz_compress_epi32((__mmask16)(~overflow_mask & 0xffff), _mm512_and_si512(w, channel_mask));
+			_mm_storeu_si128((__m128i*)(channels + written), _mm512_maskz_cvtepi32_epi8(0xffff, ch));
+		}
+		_mm512_storeu_si512((void*)(out + written), _mm512_maskz_compress_epi64(keep_lo, v_lo));
+		written += DECODE_POPCOUNT(keep_lo);
+		_mm512_storeu_si512((void*)(out + written), _mm512_maskz_compress_epi64(keep_hi, v_hi));
+		written += DECODE_POPCOUNT(keep_hi);
+
+		rollover_offset += DECODE_POPCOUNT(overflow_mask) * rollover_period;
+	}
+	return decode_tail(words, i, count, rollover_period, rollover_offset, out, channels, written);
+}
+
+static bool cpu_supports(const char* isa) {
+#ifdef _MSC_VER
+	int regs[4];
+	__cpuid(regs, 0);
+	if (regs[0] < 7)
+		return false;
+	__cpuid(regs, 1);
+	// OSXSAVE and AVX, then ask the OS which register states it saves
+	if ((regs[2] & (1 << 27)) == 0 || (regs[2] & (1 << 28)) == 0)
+		return false;
+	unsigned long long xcr0 = _xgetbv(0);
+	__cpuidex(regs, 7, 0);
+	if (strcmp(isa, "avx2") == 0)
+		return (xcr0 & 0x6) == 0x6 && (regs[1] & (1 << 5)) != 0;
+	if (strcmp(isa, "avx512f") == 0)
+		return (xcr0 & 0xe6) == 0xe6 && (regs[1] & (1 << 16)) != 0;
+	return false;
+#else
+	__builtin_cpu_init();
+	if (strcmp(isa, "avx2") == 0)
+		return __builtin_cpu_supports("avx2");
+	if (strcmp(isa, "avx512f") == 0)
+		return __builtin_cpu_supports("avx512f");
+	return false;
+#endif
+}
+#endif
+
+struct decode_kernel {
+	const char* name;
+	const char* isa;	// NULL if always available
+	decode_hits_fn fn;
+};
+
+// fastest first
+static const decode_kernel kernels[] = {
+#ifdef DECODE_X86
+	{"avx512", "avx512f", decode_hits_avx512},
+	{"avx2", "avx2", decode_hits_avx2},
+#endif
+	{"scalar", NULL, decode_hits_scalar},
+};
+static const size_t kernel_count = sizeof(kernels) / sizeof(kernels[0]);
+
+decode_hits_fn decode_hits_kernel = decode_hits_scalar;
+static const char* current_kernel = "scalar";
+
+static bool kernel_supported(const decode_kernel& kernel) {
+#ifdef DECODE_X86
+	return kernel.isa == NULL || cpu_supports(kernel.isa);
+#else
+	return kernel.isa == NULL;
+#endif
+}
+
+const char* decode_init() {
+#ifdef DECODE_X86
+	init_luts();
+#endif
+	for (size_t k = 0; k < kernel_count; k++) {
+		if (kernel_supported(kernels[k])) {
+			decode_hits_kernel = kernels[k].fn;
+			current_kernel = kernels[k].name;
+			break;
+		}
+	}
+	return current_kernel;
+}
+
+bool decode_use_kernel(const char* name) {
+	for (size_t k = 0; k < kernel_count; k++) {
+		if (strcmp(kernels[k].name, name) == 0) {
+			if (!kernel_supported(kernels[k]))
+				return false;
+			decode_hits_kernel = kernels[k].fn;
+			current_kernel = kernels[k].name;
+			return true;
+		}
+	}
+	return false;
+}
+
+const char* decode_kernel_name() {
+	return current_kernel;
+}
@@ -0,0 +1,38 @@
+// Hit word decoding kernels for TimeTagger4 TDC packets
+//
+// A hit is a 32 bit word: channel in bits 0..3, hit flags in bits 4..7 and
+// the timestamp in bits 8..31. Words with TIMETAGGER4_HIT_FLAG_TIME_OVERFLOW
+// mark a rollover of the timestamp counter and carry no hit.
+
+#ifndef TIMETAGGER4_DECODE_H
+#define TIMETAGGER4_DECODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Unpacks count hit words into TDC bins relative to the group start, overflow
+// markers are consumed and not stored. out must have room for count values.
+// If channels is not NULL it receives the channel of every hit and must have
+// room for count values as well.
+// Returns the number of hits written.
+typedef size_t (*decode_hits_fn)(const uint32_t* words, size_t count, int64_t rollover_period, int64_t* out, uint8_t* channels);
+
+// Kernel used by decode_hits(), selected once by decode_init()
+extern decode_hits_fn decode_hits_kernel;
+
+// Picks the fastest kernel the CPU supports ("avx512", "avx2" or "scalar")
+// and returns its name.
+const char* decode_init();
+
+// Switches to the kernel with the given name.
+// Returns false if the kernel is unknown or not supported by the CPU.
+bool decode_use_kernel(const char* name);
+
+// Name of the current kernel
+const char* decode_kernel_name();
+
+inline size_t decode_hits(const uint32_t* words, size_t count, int64_t rollover_period, int64_t* out, uint8_t* channels) {
+	return decode_hits_kernel(words, count, rollover_period, out, channels);
+}
+
+#endif
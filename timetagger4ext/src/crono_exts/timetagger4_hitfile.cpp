@@ -0,0 +1,370 @@
+#include <string.h>
+#include <new>
+#include "timetagger4_codec.h"
+#include "timetagger4_hitfile.h"
+#include "timetagger4_pool.h"
+
+static_assert(sizeof(hitfile_chunk) % 8 == 0, "hitfile_chunk keeps the columns after it aligned");
+
+static int seek64(FILE* file, uint64_t offset, int whence) {
+#ifdef _WIN32
+	return _fseeki64(file, (__int64)offset, whence);
+#else
+	return fseeko(file, (off_t)offset, whence);
+#endif
+}
+
+static uint64_t tell64(FILE* file) {
+#ifdef _WIN32
+	return (uint64_t)_ftelli64(file);
+#else
+	return (uint64_t)ftello(file);
+#endif
+}
+
+void hitfile_hits_free(hitfile_hits* hits) {
+	pool_free(hits->times);
+	pool_free(hits->channels);
+	pool_free(hits->cards);
+	pool_free(hits->flags);
+	memset(hits, 0, sizeof(*hits));
+}
+
+// Room for at least count hits in total, buffers are allocated afterwards even if empty
+static bool reserve_hits(hitfile_hits* hits, size_t count) {
+	if (hits->times && count <= hits->capacity)
+		return true;
+	size_t capacity = hits->capacity * 2 > count ? hits->capacity * 2 : count;
+	if (capacity == 0)
+		capacity = 1;
+	int64_t* times = (int64_t*)pool_realloc(hits->times, capacity * sizeof(int64_t));
+	if (!times)
+		return false;
+	hits->times = times;
+	uint8_t** columns[3] = { &hits->channels, &hits->cards, &hits->flags };
+	for (int i = 0; i < 3; i++) {
+		uint8_t* column = (uint8_t*)pool_realloc(*columns[i], capacity);
+		if (!column)
+			return false;
+		*columns[i] = column;
+	}
+	hits->capacity = capacity;
+	return true;
+}
+
+hit_writer::hit_writer() : hit_count(0), file(NULL), offset(0), chunk_hits(HITFILE_DEFAULT_CHUNK_HITS), encoding(HITFILE_PLAIN) {
+}
+
+hit_writer::~hit_writer() {
+	try {
+		close();
+	}
+	catch (const std::bad_alloc&) {
+		// the last chunk and the index are lost, the chunks written before load by scanning
+		if (file)
+			fclose(file);
+	}
+}
+
+bool hit_writer::write(const void* data, size_t size) {
+	if (size > 0 && fwrite(data, 1, size, file) != size)
+		return false;
+	offset += size;
+	return true;
+}
+
+const char* hit_writer::open(const char* path, size_t chunk_hits, uint32_t encoding) {
+	close();
+	if (encoding != HITFILE_PLAIN && encoding != HITFILE_DELTA)
+		return "unknown encoding";
+	file = fopen(path, "wb");
+	if (!file)
+		return "cannot create the file";
+	this->chunk_hits = chunk_hits > 0 ? chunk_hits : 1;
+	this->encoding = encoding;
+	hit_count = 0;
+	offset = 0;
+	chunks.clear();
+	hitfile_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, HITFILE_MAGIC, sizeof(header.magic));
+	header.version = HITFILE_VERSION;
+	header.header_size = sizeof(header);
+	if (!write(&header, sizeof(header))) {
+		fclose(file);
+		file = NULL;
+		return "cannot write the file";
+	}
+	return NULL;
+}
+
+const char* hit_writer::write_chunk() {
+	size_t count = times.size();
+	if (count == 0)
+		return NULL;
+	hitfile_chunk chunk;
+	memset(&chunk, 0, sizeof(chunk));
+	memcpy(chunk.magic, HITFILE_CHUNK_MAGIC, sizeof(chunk.magic));
+	chunk.hit_count = (uint32_t)count;
+	chunk.offset = offset;
+	chunk.min_time = times[0];
+	chunk.max_time = times[0];
+	for (size_t i = 0; i < count; i++) {
+		if (times[i] < chunk.min_time)
+			chunk.min_time = times[i];
+		if (times[i] > chunk.max_time)
+			chunk.max_time = times[i];
+		chunk.channel_counts[channels[i] & (HITFILE_CHANNELS - 1)]++;
+	}
+	const void* time_column = times.data();
+	chunk.encoding = encoding;
+	chunk.time_bytes = (uint32_t)(count * sizeof(int64_t));
+	if (encoding == HITFILE_DELTA) {
+		encoded.clear();
+		codec_encode(times.data(), count, true, &encoded);
+		time_column = encoded.data();
+		chunk.time_bytes = (uint32_t)encoded.size();
+	}
+	if (!write(&chunk, sizeof(chunk)) || !write(time_column, chunk.time_bytes) ||
+		!write(channels.data(), count) || !write(cards.data(), count) || !write(flags.data(), count))
+		return "cannot write the file";
+	chunks.push_back(chunk);
+	hit_count += count;
+	times.clear();
+	channels.clear();
+	cards.clear();
+	flags.clear();
+	return NULL;
+}
+
+const char* hit_writer::append(const int64_t* times, const uint8_t* channels, const uint8_t* cards, const uint8_t* flags, size_t count) {
+	if (!file)
+		return "the file is closed";
+	while (count > 0) {
+		size_t room = chunk_hits - this->times.size();
+		size_t n = count < room ? count : room;
+		this->times.insert(this->times.end(), times, times + n);
+		this->channels.insert(this->channels.end(), channels, channels + n);
+		if (cards)
+			this->cards.insert(this->cards.end(), cards, cards + n);
+		else
+			this->cards.resize(this->cards.size() + n, 0);
+		if (flags)
+			this->flags.insert(this->flags.end(), flags, flags + n);
+		else
+			this->flags.resize(this->flags.size() + n, 0);
+		times += n;
+		channels += n;
+		cards = cards ? cards + n : NULL;
+		flags = flags ? flags + n : NULL;
+		count -= n;
+		if (this->times.size() == chunk_hits) {
+			const char* error = write_chunk();
+			if (error)
+				return error;
+		}
+	}
+	return NULL;
+}
+
+const char* hit_writer::append_batch(const int64_t* values, const uint8_t* channels, const int64_t* offsets,
+	const batch_meta* meta, size_t packet_count) {
+	if (!file)
+		return "the file is closed";
+	for (size_t i = 0; i < packet_count; i++) {
+		size_t first = (size_t)offsets[i];
+		size_t count = (size_t)(offsets[i + 1] - offsets[i]);
+		while (count > 0) {
+			size_t room = chunk_hits - times.size();
+			size_t n = count < room ? count : room;
+			times.insert(times.end(), values + first, values + first + n);
+			this->channels.insert(this->channels.end(), channels + first, channels + first + n);
+			cards.resize(cards.size() + n, meta[i].card);
+			flags.resize(flags.size() + n, meta[i].flags);
+			first += n;
+			count -= n;
+			if (times.size() == chunk_hits) {
+				const char* error = write_chunk();
+				if (error)
+					return error;
+			}
+		}
+	}
+	return NULL;
+}
+
+const char* hit_writer::close() {
+	if (!file)
+		return NULL;
+	const char* error = write_chunk();
+	if (!error) {
+		hitfile_trailer trailer;
+		memset(&trailer, 0, sizeof(trailer));
+		trailer.index_offset = offset;
+		trailer.chunk_count = chunks.size();
+		trailer.hit_count = hit_count;
+		memcpy(trailer.magic, HITFILE_MAGIC, sizeof(trailer.magic));
+		if (!write(chunks.data(), chunks.size() * sizeof(hitfile_chunk)) || !write(&trailer, sizeof(trailer)))
+			error = "cannot write the index";
+	}
+	if (fclose(file) != 0 && !error)
+		error = "cannot write the file";
+	file = NULL;
+	times.clear();
+	channels.clear();
+	cards.clear();
+	flags.clear();
+	return error;
+}
+
+hit_reader::hit_reader() : indexed(false), chunks_read(0), file(NULL), size(0) {
+}
+
+hit_reader::~hit_reader() {
+	close();
+}
+
+void hit_reader::close() {
+	if (file)
+		fclose(file);
+	file = NULL;
+	chunks.clear();
+	size = 0;
+}
+
+bool hit_reader::read_at(uint64_t offset, void* data, size_t size) {
+	return seek64(file, offset, SEEK_SET) == 0 && fread(data, 1, size, file) == size;
+}
+
+static uint64_t chunk_bytes(const hitfile_chunk& chunk) {
+	return sizeof(hitfile_chunk) + chunk.time_bytes + 3 * (uint64_t)chunk.hit_count;
+}
+
+const char* hit_reader::open(const char* path) {
+	close();
+	file = fopen(path, "rb");
+	if (!file)
+		return "cannot open the file";
+	hitfile_header header;
+	if (seek64(file, 0, SEEK_END) != 0) {
+		close();
+		return "cannot get the size of the file";
+	}
+	size = tell64(file);
+	if (!read_at(0, &header, sizeof(header)) || memcmp(header.magic, HITFILE_MAGIC, sizeof(header.magic)) != 0) {
+		close();
+		return "the file is not a TimeTagger4 hit file";
+	}
+	if (header.version != HITFILE_VERSION || header.header_size < sizeof(header)) {
+		close();
+		return "unsupported version of the hit file";
+	}
+	hitfile_trailer trailer;
+	indexed = size >= header.header_size + sizeof(trailer) &&
+		read_at(size - sizeof(trailer), &trailer, sizeof(trailer)) &&
+		memcmp(trailer.magic, HITFILE_MAGIC, sizeof(trailer.magic)) == 0 &&
+		trailer.chunk_count <= size / sizeof(hitfile_chunk) && trailer.index_offset <= size &&
+		trailer.index_offset + trailer.chunk_count * sizeof(hitfile_chunk) + sizeof(trailer) == size;
+	if (indexed) {
+		chunks.resize((size_t)trailer.chunk_count);
+		if (!read_at(trailer.index_offset, chunks.data(), chunks.size() * sizeof(hitfile_chunk))) {
+			close();
+			return "cannot read the index of the hit file";
+		}
+		// load() sizes its buffers from the headers, they have to fit in the file
+		for (size_t c = 0; c < chunks.size(); c++) {
+			if (chunks[c].offset < header.header_size || chunks[c].offset > trailer.index_offset ||
+				chunk_bytes(chunks[c]) > trailer.index_offset - chunks[c].offset) {
+				close();
+				return "the index of the hit file is corrupt";
+			}
+		}
+		return NULL;
+	}
+	// not closed, e.g. the writer crashed: the complete chunks are still there
+	const char* error = scan_chunks(header.header_size, size);
+	if (error)
+		close();
+	return error;
+}
+
+const char* hit_reader::scan_chunks(uint32_t header_size, uint64_t end) {
+	uint64_t offset = header_size;
+	hitfile_chunk chunk;
+	while (offset + sizeof(chunk) <= end) {
+		if (!read_at(offset, &chunk, sizeof(chunk)))
+			return "cannot read the hit file";
+		if (memcmp(chunk.magic, HITFILE_CHUNK_MAGIC, sizeof(chunk.magic)) != 0 || chunk.offset != offset)
+			break;
+		if (offset + chunk_bytes(chunk) > end)
+			break;
+		chunks.push_back(chunk);
+		offset += chunk_bytes(chunk);
+	}
+	return NULL;
+}
+
+const char* hit_reader::load(int64_t t0, int64_t t1, uint32_t channel_mask, hitfile_hits* out) {
+	chunks_read = 0;
+	if (!file)
+		return "the file is closed";
+	if (!reserve_hits(out, out->count))
+		return "out of memory";
+	std::vector<int64_t> times;
+	std::vector<uint8_t> encoded;
+	std::vector<uint8_t> columns;
+	for (size_t c = 0; c < chunks.size(); c++) {
+		const hitfile_chunk& chunk = chunks[c];
+		if (chunk.hit_count == 0 || chunk.max_time < t0 || chunk.min_time >= t1)
+			continue;
+		uint32_t wanted = 0;
+		for (int channel = 0; channel < HITFILE_CHANNELS; channel++) {
+			if (channel_mask & (1u << channel))
+				wanted += chunk.channel_counts[channel];
+		}
+		if (wanted == 0)
+			continue;
+		size_t count = chunk.hit_count;
+		times.resize(count);
+		columns.resize(3 * count);
+		uint64_t columns_offset = chunk.offset + sizeof(hitfile_chunk) + chunk.time_bytes;
+		if (chunk.encoding == HITFILE_PLAIN) {
+			if (chunk.time_bytes != count * sizeof(int64_t))
+				return "a chunk of the hit file is corrupt";
+			if (!read_at(chunk.offset + sizeof(hitfile_chunk), times.data(), chunk.time_bytes))
+				return "cannot read a chunk of the hit file";
+		}
+		else if (chunk.encoding == HITFILE_DELTA) {
+			encoded.resize(chunk.time_bytes);
+			if (!read_at(chunk.offset + sizeof(hitfile_chunk), encoded.data(), encoded.size()))
+				return "cannot read a chunk of the hit file";
+			if (!codec_decode(encoded.data(), encoded.data() + encoded.size(), count, true, times.data()))
+				return "a chunk of the hit file is corrupt";
+		}
+		else
+			return "unknown encoding of a chunk";
+		if (!read_at(columns_offset, columns.data(), columns.size()))
+			return "cannot read a chunk of the hit file";
+		chunks_read++;
+		// the chunk holds at most wanted hits of the channels, fewer in the time range
+		size_t limit = out->count + wanted;
+		if (!reserve_hits(out, limit))
+			return "out of memory";
+		const uint8_t* channels = columns.data();
+		const uint8_t* cards = channels + count;
+		const uint8_t* flags = cards + count;
+		for (size_t i = 0; i < count; i++) {
+			if (times[i] < t0 || times[i] >= t1 || !(channel_mask & (1u << (channels[i] & (HITFILE_CHANNELS - 1)))))
+				continue;
+			// more hits of the channels than the header counts
+			if (out->count == limit)
+				return "a chunk of the hit file is corrupt";
+			size_t j = out->count++;
+			out->times[j] = times[i];
+			out->channels[j] = channels[i];
+			out->cards[j] = cards[i];
+			out->flags[j] = flags[i];
+		}
+	}
+	return NULL;
+}
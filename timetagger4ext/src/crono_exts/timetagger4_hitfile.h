@@ -0,0 +1,132 @@
+// Columnar file of decoded hits with an index for time-range loads
+//
+// The file holds chunks of up to a fixed number of hits. Every chunk starts
+// with a hitfile_chunk header giving the time range and the hits per channel,
+// followed by its columns: the ps times, as int64 or compressed with the
+// codec, then uint8 channels, cards and packet flags. close() appends the headers of all chunks as an index and a
+// trailer pointing at it, so that a load reads the index and only the chunks
+// that hold hits in the time range and channels asked for. A file that was
+// not closed has no index, its chunk headers are scanned instead.
+
+#ifndef TIMETAGGER4_HITFILE_H
+#define TIMETAGGER4_HITFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+#include "timetagger4_batch.h"
+
+#define HITFILE_MAGIC "TT4HITS\0"
+#define HITFILE_CHUNK_MAGIC "CHNK"
+#define HITFILE_VERSION 1
+#define HITFILE_CHANNELS 16			// the 4 bit channel field of a hit
+#define HITFILE_DEFAULT_CHUNK_HITS (1 << 20)
+
+// encodings of the time column
+#define HITFILE_PLAIN 0		// int64 ps
+#define HITFILE_DELTA 1		// codec_encode() of the differences
+
+struct hitfile_header {
+	char magic[8];			// HITFILE_MAGIC
+	uint32_t version;		// HITFILE_VERSION
+	uint32_t header_size;	// the first chunk starts there
+	uint64_t reserved[2];
+};
+
+struct hitfile_chunk {
+	char magic[4];			// HITFILE_CHUNK_MAGIC
+	uint32_t hit_count;
+	uint64_t offset;		// of this header in the file
+	int64_t min_time;		// ps
+	int64_t max_time;
+	uint32_t encoding;		// HITFILE_* of the time column
+	uint32_t time_bytes;	// size of the time column as stored
+	uint32_t channel_counts[HITFILE_CHANNELS];
+};
+
+struct hitfile_trailer {
+	uint64_t index_offset;	// of chunk_count hitfile_chunk entries
+	uint64_t chunk_count;
+	uint64_t hit_count;
+	char magic[8];			// HITFILE_MAGIC, last in the file
+};
+
+// Hits of a load, the buffers come from the pool
+struct hitfile_hits {
+	int64_t* times;
+	uint8_t* channels;
+	uint8_t* cards;
+	uint8_t* flags;
+	size_t count;
+	size_t capacity;
+};
+
+void hitfile_hits_free(hitfile_hits* hits);
+
+class hit_writer {
+public:
+	hit_writer();
+	~hit_writer();
+
+	// Creates the file with the time column in encoding HITFILE_*, returns NULL or the error
+	const char* open(const char* path, size_t chunk_hits, uint32_t encoding);
+
+	// Adds count hits, cards and flags may be NULL for zeros. Full chunks are
+	// written. Returns NULL or the error.
+	const char* append(const int64_t* times, const uint8_t* channels, const uint8_t* cards, const uint8_t* flags, size_t count);
+
+	// Adds the hits of a decoded OUTPUT_PS batch, cards and flags come from the meta
+	// of each packet. Returns NULL or the error.
+	const char* append_batch(const int64_t* values, const uint8_t* channels, const int64_t* offsets,
+		const batch_meta* meta, size_t packet_count);
+
+	// Writes the last chunk, the index and the trailer. Returns NULL or the error.
+	const char* close();
+
+	bool is_open() const { return file != NULL; }
+
+	uint64_t hit_count;
+	std::vector<hitfile_chunk> chunks;
+
+private:
+	const char* write_chunk();
+	bool write(const void* data, size_t size);
+
+	FILE* file;
+	uint64_t offset;
+	size_t chunk_hits;
+	uint32_t encoding;
+	std::vector<uint8_t> encoded;
+	std::vector<int64_t> times;
+	std::vector<uint8_t> channels;
+	std::vector<uint8_t> cards;
+	std::vector<uint8_t> flags;
+};
+
+class hit_reader {
+public:
+	hit_reader();
+	~hit_reader();
+
+	// Opens the file and reads its index, returns NULL or the error
+	const char* open(const char* path);
+	void close();
+
+	// Appends the hits with t0 <= time < t1 and a channel in channel_mask to out,
+	// reading only the chunks that can hold some. Returns NULL or the error.
+	const char* load(int64_t t0, int64_t t1, uint32_t channel_mask, hitfile_hits* out);
+
+	std::vector<hitfile_chunk> chunks;
+	bool indexed;			// the index was read, the chunks were not scanned
+	uint64_t chunks_read;	// by the last load
+
+private:
+	const char* scan_chunks(uint32_t header_size, uint64_t end);
+	bool read_at(uint64_t offset, void* data, size_t size);
+
+	FILE* file;
+	uint64_t size;
+};
+
+#endif
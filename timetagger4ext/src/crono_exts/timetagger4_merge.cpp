@@ -0,0 +1,164 @@
+#include <algorithm>
+#include <functional>
+#include <new>
+#include <utility>
+#include "timetagger4_merge.h"
+#include "timetagger4_pool.h"
+
+hit_merger::hit_merger(size_t source_count, int64_t window) :
+	sources(source_count), window(window), emitted_until(INT64_MIN), late(0) {
+	for (size_t i = 0; i < sources.size(); i++) {
+		sources[i].head = 0;
+		sources[i].horizon = INT64_MIN;
+		sources[i].finished = false;
+	}
+}
+
+bool hit_merger::hit_before(const hit& a, const hit& b) {
+	return a.time < b.time;
+}
+
+bool hit_merger::push(size_t source_index, const int64_t* values, const uint8_t* channels,
+	const int64_t* offsets, const batch_meta* meta, size_t packet_count) {
+	std::lock_guard<std::mutex> lock(mutex);
+	source& s = sources[source_index];
+	size_t start = s.hits.size();
+	int64_t horizon = s.horizon;
+	uint64_t late_count = 0;
+	try {
+		s.hits.reserve(start + (size_t)offsets[packet_count]);
+	}
+	catch (const std::bad_alloc&) {
+		return false;
+	}
+	for (size_t i = 0; i < packet_count; i++) {
+		// hits of later packets come after their group start, not after the hits of this one
+		if (meta[i].timestamp_ps > horizon)
+			horizon = meta[i].timestamp_ps;
+		for (int64_t j = offsets[i]; j < offsets[i + 1]; j++) {
+			// the merged stream is already past this time
+			if (values[j] < emitted_until) {
+				late_count++;
+				continue;
+			}
+			hit h = { values[j], meta[i].card, channels[j] };
+			s.hits.push_back(h);
+		}
+	}
+	// the hits of a batch are nearly sorted, only channels interleave within a group
+	std::vector<hit>::iterator first = s.hits.begin() + s.head;
+	std::vector<hit>::iterator middle = s.hits.begin() + start;
+	std::stable_sort(middle, s.hits.end(), hit_before);
+	if (middle != first && middle != s.hits.end() && hit_before(*middle, *(middle - 1)))
+		std::inplace_merge(first, middle, s.hits.end(), hit_before);
+	s.horizon = horizon;
+	late += late_count;
+	return true;
+}
+
+void hit_merger::finish(size_t source_index) {
+	std::lock_guard<std::mutex> lock(mutex);
+	sources[source_index].finished = true;
+}
+
+bool hit_merger::pop(merged_hits* out, bool flush) {
+	std::lock_guard<std::mutex> lock(mutex);
+	// the earliest time any source can still push, everything before it is final
+	int64_t watermark = INT64_MAX;
+	if (!flush) {
+		for (size_t i = 0; i < sources.size(); i++) {
+			const source& s = sources[i];
+			if (s.finished)
+				continue;
+			int64_t bound = s.horizon < INT64_MIN + window ? INT64_MIN : s.horizon - window;
+			if (bound < watermark)
+				watermark = bound;
+		}
+	}
+
+	// hits of every source up to the watermark, the runs are sorted
+	std::vector<size_t> ends(sources.size());
+	size_t count = 0;
+	for (size_t i = 0; i < sources.size(); i++) {
+		source& s = sources[i];
+		hit limit = { watermark, 0, 0 };
+		ends[i] = std::upper_bound(s.hits.begin() + s.head, s.hits.end(), limit, hit_before) - s.hits.begin();
+		count += ends[i] - s.head;
+	}
+	out->times = (int64_t*)pool_alloc(count * sizeof(int64_t));
+	out->cards = (uint8_t*)pool_alloc(count);
+	out->channels = (uint8_t*)pool_alloc(count);
+	out->count = 0;
+	if (!out->times || !out->cards || !out->channels) {
+		merged_hits_free(out);
+		return false;
+	}
+
+	// k-way merge, the heap holds the head time of every source with hits left,
+	// ties go to the lower source index so the order is deterministic
+	typedef std::pair<int64_t, size_t> head;
+	std::vector<head> heap;
+	for (size_t i = 0; i < sources.size(); i++) {
+		if (sources[i].head < ends[i])
+			heap.push_back(head(sources[i].hits[sources[i].head].time, i));
+	}
+	std::greater<head> later;
+	std::make_heap(heap.begin(), heap.end(), later);
+	while (!heap.empty()) {
+		std::pop_heap(heap.begin(), heap.end(), later);
+		size_t i = heap.back().second;
+		source& s = sources[i];
+		const hit& h = s.hits[s.head++];
+		out->times[out->count] = h.time;
+		out->cards[out->count] = h.card;
+		out->channels[out->count] = h.channel;
+		out->count++;
+		if (s.head < ends[i]) {
+			heap.back().first = s.hits[s.head].time;
+			std::push_heap(heap.begin(), heap.end(), later);
+		}
+		else {
+			heap.pop_back();
+		}
+	}
+
+	// drop what was handed out once it is the larger part of a source
+	for (size_t i = 0; i < sources.size(); i++) {
+		source& s = sources[i];
+		if (s.head > 0 && s.head * 2 >= s.hits.size()) {
+			s.hits.erase(s.hits.begin(), s.hits.begin() + s.head);
+			s.head = 0;
+		}
+	}
+	if (flush) {
+		if (count > 0 && out->times[count - 1] > emitted_until)
+			emitted_until = out->times[count - 1];
+	}
+	else if (watermark > emitted_until) {
+		emitted_until = watermark;
+	}
+	return true;
+}
+
+size_t hit_merger::pending() {
+	std::lock_guard<std::mutex> lock(mutex);
+	size_t count = 0;
+	for (size_t i = 0; i < sources.size(); i++)
+		count += sources[i].hits.size() - sources[i].head;
+	return count;
+}
+
+uint64_t hit_merger::late_hits() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return late;
+}
+
+void merged_hits_free(merged_hits* hits) {
+	pool_free(hits->times);
+	pool_free(hits->cards);
+	pool_free(hits->channels);
+	hits->times = NULL;
+	hits->cards = NULL;
+	hits->channels = NULL;
+	hits->count = 0;
+}
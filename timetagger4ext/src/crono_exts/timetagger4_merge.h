@@ -0,0 +1,76 @@
+// Time-ordered merge of the hit streams of several cards
+//
+// Every source, usually one card, pushes its decoded OUTPUT_PS batches. The
+// hits of a source are kept sorted, and a binary heap keyed on the head time of
+// each source merges them into one stream. A hit is handed out once no source
+// can push an earlier one any more. The horizon of a source is its latest group
+// start, later groups and their hits start no earlier than the horizon minus the
+// reorder window. Hits that still arrive behind what was handed out already are
+// counted as late and dropped.
+// All methods are thread safe and do not need the GIL.
+
+#ifndef TIMETAGGER4_MERGE_H
+#define TIMETAGGER4_MERGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <mutex>
+#include <vector>
+#include "timetagger4_batch.h"
+
+// Hits of all sources in time order, the buffers come from the pool
+struct merged_hits {
+	int64_t* times;		// ps on the OUTPUT_PS timeline
+	uint8_t* cards;		// card field of the packet of the hit
+	uint8_t* channels;	// TDC channel
+	size_t count;
+};
+
+class hit_merger {
+public:
+	// window is the reorder window in ps, how far a source may go back in time
+	hit_merger(size_t source_count, int64_t window);
+
+	// Adds the hits of one OUTPUT_PS batch of a source, tagged with the card of their
+	// packet. The latest packet timestamp becomes the horizon of the source.
+	// Returns false if out of memory, the source is unchanged then.
+	bool push(size_t source, const int64_t* values, const uint8_t* channels,
+		const int64_t* offsets, const batch_meta* meta, size_t packet_count);
+
+	// The source pushes no more hits and stops holding the others back
+	void finish(size_t source);
+
+	// Moves the hits no source can precede any more into out, all hits if flush.
+	// Returns false if out of memory, nothing is moved then.
+	bool pop(merged_hits* out, bool flush);
+
+	size_t source_count() const { return sources.size(); }
+	int64_t reorder_window() const { return window; }
+	size_t pending();
+	uint64_t late_hits();
+
+private:
+	struct hit {
+		int64_t time;
+		uint8_t card;
+		uint8_t channel;
+	};
+	struct source {
+		std::vector<hit> hits;	// sorted by time from head on
+		size_t head;			// first hit not handed out yet
+		int64_t horizon;		// latest group start pushed, INT64_MIN before the first push
+		bool finished;
+	};
+	static bool hit_before(const hit& a, const hit& b);
+
+	std::vector<source> sources;
+	int64_t window;
+	int64_t emitted_until;	// hits up to this time are handed out, INT64_MIN at first
+	uint64_t late;
+	std::mutex mutex;
+};
+
+// Frees the buffers of merged hits
+void merged_hits_free(merged_hits* hits);
+
+#endif
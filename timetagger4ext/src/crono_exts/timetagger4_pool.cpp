@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mutex>
+#include <vector>
+#include "timetagger4_pool.h"
+
+// smallest class is 256 bytes, class k holds buffers of 256 << k bytes
+#define POOL_MIN_SHIFT 8
+#define POOL_CLASS_COUNT 40
+
+// Every buffer starts with a header, 16 bytes keep the data as aligned as malloc
+struct pool_header {
+	uint32_t size_class;
+	uint32_t magic;
+	uint64_t reserved;
+};
+const uint32_t POOL_MAGIC = 0x54543450;		// "TT4P", in use
+const uint32_t POOL_FREE_MAGIC = 0x54543446;	// "TT4F", held for reuse
+
+static std::mutex pool_mutex;
+static std::vector<pool_header*> free_lists[POOL_CLASS_COUNT];
+static pool_stats stats = { 0, 0, 0, 0, 0, 64 * 1024 * 1024 };
+
+static size_t class_bytes(uint32_t size_class) {
+	return (size_t)1 << (size_class + POOL_MIN_SHIFT);
+}
+
+// smallest class holding bytes, POOL_CLASS_COUNT if none does
+static uint32_t size_class_of(size_t bytes) {
+	uint32_t size_class = 0;
+	while (size_class < POOL_CLASS_COUNT && class_bytes(size_class) < bytes)
+		size_class++;
+	return size_class;
+}
+
+// A buffer the pool did not hand out, or one freed twice, would corrupt the
+// free lists, so that stops the process right away
+static pool_header* header_of(void* buffer) {
+	pool_header* header = (pool_header*)buffer - 1;
+	if (header->magic != POOL_MAGIC || header->size_class >= POOL_CLASS_COUNT) {
+		fprintf(stderr, "buffer pool: %p was not allocated by the pool or was freed already\n", buffer);
+		abort();
+	}
+	return header;
+}
+
+// drops held buffers until bytes_held is within the limit, pool_mutex must be held
+static void trim_locked() {
+	for (int size_class = POOL_CLASS_COUNT - 1; size_class >= 0 && stats.bytes_held > stats.limit; size_class--) {
+		std::vector<pool_header*>& list = free_lists[size_class];
+		while (!list.empty() && stats.bytes_held > stats.limit) {
+			free(list.back());
+			list.pop_back();
+			stats.bytes_held -= class_bytes(size_class);
+			stats.buffers_held--;
+		}
+	}
+}
+
+void* pool_alloc(size_t bytes) {
+	uint32_t size_class = size_class_of(bytes);
+	if (size_class >= POOL_CLASS_COUNT)
+		return NULL;
+	size_t size = class_bytes(size_class);
+	{
+		std::lock_guard<std::mutex> lock(pool_mutex);
+		std::vector<pool_header*>& list = free_lists[size_class];
+		if (!list.empty()) {
+			pool_header* header = list.back();
+			list.pop_back();
+			stats.hits++;
+			stats.bytes_held -= size;
+			stats.buffers_held--;
+			stats.bytes_in_use += size;
+			header->magic = POOL_MAGIC;
+			return header + 1;
+		}
+		stats.misses++;
+	}
+	pool_header* header = (pool_header*)malloc(sizeof(pool_header) + size);
+	if (!header)
+		return NULL;
+	header->size_class = size_class;
+	header->magic = POOL_MAGIC;
+	std::lock_guard<std::mutex> lock(pool_mutex);
+	stats.bytes_in_use += size;
+	return header + 1;
+}
+
+void* pool_realloc(void* buffer, size_t bytes) {
+	if (!buffer)
+		return pool_alloc(bytes);
+	size_t size = class_bytes(header_of(buffer)->size_class);
+	if (bytes <= size)
+		return buffer;
+	void* grown = pool_alloc(bytes);
+	if (!grown)
+		return NULL;
+	memcpy(grown, buffer, size);
+	pool_free(buffer);
+	return grown;
+}
+
+void pool_free(void* buffer) {
+	if (!buffer)
+		return;
+	pool_header* header = header_of(buffer);
+	size_t size = class_bytes(header->size_class);
+	std::lock_guard<std::mutex> lock(pool_mutex);
+	stats.bytes_in_use -= size;
+	if (stats.bytes_held + size > stats.limit) {
+		free(header);
+		return;
+	}
+	// an allocation failure only costs the reuse of this buffer
+	try {
+		free_lists[header->size_class].push_back(header);
+	}
+	catch (...) {
+		free(header);
+		return;
+	}
+	header->magic = POOL_FREE_MAGIC;
+	stats.bytes_held += size;
+	stats.buffers_held++;
+}
+
+void pool_get_stats(pool_stats* out) {
+	std::lock_guard<std::mutex> lock(pool_mutex);
+	*out = stats;
+}
+
+void pool_set_limit(uint64_t bytes) {
+	std::lock_guard<std::mutex> lock(pool_mutex);
+	stats.limit = bytes;
+	trim_locked();
+}
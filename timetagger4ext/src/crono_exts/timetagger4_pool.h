@@ -0,0 +1,40 @@
+// Recycling pool for the buffers behind decoded batches
+//
+// Buffers are rounded up to power of two size classes. Freed buffers are kept
+// per class, up to a configurable number of bytes held, and handed out again
+// instead of going back to malloc. Long runs then reuse a stable set of
+// buffers instead of churning the heap with short-lived arrays.
+// All functions are thread safe and do not need the GIL.
+
+#ifndef TIMETAGGER4_POOL_H
+#define TIMETAGGER4_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct pool_stats {
+	uint64_t hits;			// allocations served from held buffers
+	uint64_t misses;		// allocations that went to malloc
+	uint64_t bytes_held;	// bytes of freed buffers kept for reuse
+	uint64_t buffers_held;
+	uint64_t bytes_in_use;	// bytes of buffers handed out and not freed yet
+	uint64_t limit;			// maximum of bytes_held
+};
+
+// Returns a buffer of at least bytes, NULL if out of memory
+void* pool_alloc(size_t bytes);
+
+// Grows or shrinks a buffer from pool_alloc() keeping its contents, like realloc.
+// buffer may be NULL. Returns NULL if out of memory, buffer is unchanged then.
+void* pool_realloc(void* buffer, size_t bytes);
+
+// Returns a buffer from pool_alloc() to the pool, buffer may be NULL. Aborts on a
+// buffer the pool did not hand out or one that is back in the pool already.
+void pool_free(void* buffer);
+
+void pool_get_stats(pool_stats* stats);
+
+// Sets the maximum number of bytes held and releases buffers above it
+void pool_set_limit(uint64_t bytes);
+
+#endif
@@ -0,0 +1,143 @@
+// Backpressure of the streaming thread on the board
+//
+// Without it a consumer that falls behind fills the batch queue, the thread
+// drops batches and the board later drops packets at random places of the run.
+// With it enabled the thread stops reading while the queue is full, so the
+// data backs up into the host buffer. Once the queue or the host buffer passes
+// its high watermark the board is paused. The thread then drains what the
+// board captured before the pause, and capture continues once the host buffer
+// is empty and the queue is below its low watermark. Each pause is logged with
+// the timestamps of the last packet before and the first packet after it, so
+// the gap in the data is known exactly.
+//
+// Where pausing the board is not acceptable, load shedding keeps the thread
+// ahead of the board instead: while the queue is above its high watermark
+// whole groups are shed, or all but every nth, or all hits past the first n of
+// a group, until the queue is back below its low watermark.
+// All members are guarded by the device mutex.
+
+#ifndef TIMETAGGER4_PRESSURE_H
+#define TIMETAGGER4_PRESSURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "timetagger4_batch.h"
+#include "timetagger4_stats.h"
+
+// upper bound of the pause log, the oldest entries go first
+#define PRESSURE_MAX_LOG 65536
+
+struct pause_interval {
+	double paused_at;		// host steady clock seconds
+	double resumed_at;		// 0 while paused
+	int64_t last_timestamp;	// raw timestamp of the last packet captured before the pause, -1 if none
+	int64_t first_timestamp;	// raw timestamp of the first packet after it, -1 until one arrives
+	uint32_t groups;		// groups the pause skipped with periodic starts, else 0
+};
+
+class backpressure {
+public:
+	backpressure() : enabled(false), queue_high(0.75), queue_low(0.25), buffer_high(0.5),
+		paused(false), drained(false), awaiting_first(false), pauses(0), log_dropped(0) {}
+
+	// queue_high and queue_low are fractions of the queue capacity, buffer_high of the host buffer
+	bool enabled;
+	double queue_high;
+	double queue_low;
+	double buffer_high;
+
+	// True if the board should be paused now
+	bool should_pause(size_t queued, size_t capacity, int64_t fill, int64_t buffer_bytes) const {
+		if (!enabled || paused)
+			return false;
+		if (capacity > 0 && (double)queued >= queue_high * (double)capacity)
+			return true;
+		return buffer_bytes > 0 && (double)fill >= buffer_high * (double)buffer_bytes;
+	}
+
+	// True if the paused board may continue, everything captured before the pause is read
+	bool should_continue(size_t queued, size_t capacity) const {
+		if (!paused)
+			return false;
+		if (!enabled)
+			return true;
+		return drained && (double)queued <= queue_low * (double)capacity;
+	}
+
+	// Entries of pauses that are over, the current one stays
+	size_t closed() const {
+		return log.size() - ((paused || awaiting_first) && !log.empty() ? 1 : 0);
+	}
+
+	void pause(double now) {
+		pause_interval p = { now, 0.0, -1, -1, 0 };
+		if (log.size() >= PRESSURE_MAX_LOG) {
+			log.erase(log.begin());
+			log_dropped++;
+		}
+		log.push_back(p);
+		paused = true;
+		drained = false;
+		pauses++;
+	}
+
+	// last_timestamp is the last packet read, the last one captured before the pause
+	void resume(double now, int64_t last_timestamp) {
+		paused = false;
+		awaiting_first = !log.empty();
+		if (log.empty())
+			return;
+		log.back().resumed_at = now;
+		log.back().last_timestamp = last_timestamp;
+	}
+
+	// A read after the pause, the first one closes the gap
+	void packets_read(int64_t first_timestamp, int64_t group_period) {
+		if (!awaiting_first || log.empty())
+			return;
+		awaiting_first = false;
+		pause_interval& p = log.back();
+		p.first_timestamp = first_timestamp;
+		p.groups = inferred_gap(p.last_timestamp, first_timestamp, group_period);
+	}
+
+	bool paused;
+	bool drained;		// a read came back empty during the pause
+	bool awaiting_first;	// the next packet is the first after a pause
+	uint64_t pauses;
+	uint64_t log_dropped;
+	std::vector<pause_interval> log;
+};
+
+class load_shedding {
+public:
+	load_shedding() : high(0.5), low(0.25), activations(0) {
+		memset(&state, 0, sizeof(state));
+	}
+
+	// high and low are fractions of the queue capacity
+	double high;
+	double low;
+
+	// Starts or stops shedding by the watermarks before a read is decoded
+	void update(size_t queued, size_t capacity) {
+		if (state.policy == SHED_NONE || capacity == 0) {
+			state.active = false;
+			return;
+		}
+		if (!state.active && (double)queued >= high * (double)capacity) {
+			state.active = true;
+			state.sequence = 0;
+			activations++;
+		}
+		else if (state.active && (double)queued <= low * (double)capacity)
+			state.active = false;
+	}
+
+	batch_shed state;
+	uint64_t activations;
+};
+
+#endif
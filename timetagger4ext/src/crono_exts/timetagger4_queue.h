@@ -0,0 +1,66 @@
+// Bounded lock-free single-producer/single-consumer queue
+//
+// One thread may push and one other thread may pop at the same time without
+// locking. Elements are copied in and out, so T should be small and trivially
+// copyable, e.g. a hit_batch whose buffers change owner with the copy.
+
+#ifndef TIMETAGGER4_QUEUE_H
+#define TIMETAGGER4_QUEUE_H
+
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+
+template <typename T>
+class spsc_queue {
+public:
+	spsc_queue() : head(0), tail(0) {}
+
+	// Not thread safe, the queue must be empty and unused by both threads
+	void resize(size_t capacity) {
+		// one slot stays free to tell a full queue from an empty one
+		slots.resize(capacity + 1);
+		head.store(0, std::memory_order_relaxed);
+		tail.store(0, std::memory_order_relaxed);
+	}
+
+	size_t capacity() const {
+		return slots.empty() ? 0 : slots.size() - 1;
+	}
+
+	// producer only, returns false if the queue is full
+	bool push(const T& value) {
+		size_t t = tail.load(std::memory_order_relaxed);
+		size_t next = t + 1 == slots.size() ? 0 : t + 1;
+		if (next == head.load(std::memory_order_acquire))
+			return false;
+		slots[t] = value;
+		tail.store(next, std::memory_order_release);
+		return true;
+	}
+
+	// consumer only, returns false if the queue is empty
+	bool pop(T& value) {
+		size_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire))
+			return false;
+		value = slots[h];
+		head.store(h + 1 == slots.size() ? 0 : h + 1, std::memory_order_release);
+		return true;
+	}
+
+	// approximate when called concurrently
+	size_t size() const {
+		size_t h = head.load(std::memory_order_acquire);
+		size_t t = tail.load(std::memory_order_acquire);
+		return t >= h ? t - h : t + slots.size() - h;
+	}
+
+private:
+	std::vector<T> slots;
+	// producer and consumer indices on separate cache lines
+	alignas(64) std::atomic<size_t> head;
+	alignas(64) std::atomic<size_t> tail;
+};
+
+#endif
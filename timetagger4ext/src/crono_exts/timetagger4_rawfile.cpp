@@ -0,0 +1,271 @@
+#include <string.h>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include "timetagger4_rawfile.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+raw_file::raw_file() :
+	size(0), position(0), packets(0), truncated(0), data(NULL), last_timestamp(-1), file(-1), mapping(-1) {
+}
+
+raw_file::~raw_file() {
+	close();
+}
+
+const char* raw_file::open(const char* path) {
+	close();
+#ifdef _WIN32
+	HANDLE h = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (h == INVALID_HANDLE_VALUE)
+		return "cannot open the file";
+	file = (intptr_t)h;
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(h, &file_size)) {
+		close();
+		return "cannot get the size of the file";
+	}
+	size = (uint64_t)file_size.QuadPart;
+	if (size >= RECORD_HEADER_SIZE) {
+		HANDLE m = CreateFileMappingA(h, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (!m) {
+			close();
+			return "cannot map the file";
+		}
+		mapping = (intptr_t)m;
+		data = (const uint8_t*)MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+	}
+#else
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0)
+		return "cannot open the file";
+	file = fd;
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close();
+		return "cannot get the size of the file";
+	}
+	size = (uint64_t)st.st_size;
+	if (size >= RECORD_HEADER_SIZE) {
+		void* p = mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, fd, 0);
+		if (p != MAP_FAILED) {
+			// the packets are walked front to back once, read-ahead keeps the disk busy
+			madvise(p, (size_t)size, MADV_SEQUENTIAL);
+			data = (const uint8_t*)p;
+		}
+	}
+#endif
+	if (size < RECORD_HEADER_SIZE) {
+		close();
+		return "the file is too short for a recording";
+	}
+	if (!data) {
+		close();
+		return "cannot map the file";
+	}
+	const record_header& h0 = header();
+	if (memcmp(h0.magic, RECORD_MAGIC, sizeof(h0.magic)) != 0) {
+		close();
+		return "the file is not a TimeTagger4 recording";
+	}
+	if (h0.version != RECORD_VERSION || h0.header_size < RECORD_HEADER_SIZE || h0.header_size > size) {
+		close();
+		return "unsupported version of the recording";
+	}
+	rewind();
+	return NULL;
+}
+
+void raw_file::close() {
+#ifdef _WIN32
+	if (data)
+		UnmapViewOfFile(data);
+	if (mapping != -1)
+		CloseHandle((HANDLE)mapping);
+	if (file >= 0)
+		CloseHandle((HANDLE)file);
+#else
+	if (data)
+		munmap((void*)data, (size_t)size);
+	if (file >= 0)
+		::close((int)file);
+#endif
+	data = NULL;
+	mapping = -1;
+	file = -1;
+	size = 0;
+	position = 0;
+	packets = 0;
+	truncated = 0;
+	last_timestamp = -1;
+}
+
+batch_scale raw_file::scale() const {
+	const record_header& h = header();
+	batch_scale scale;
+	scale.rollover_period = h.rollover_period;
+	scale.binsize = h.binsize;
+	scale.packet_binsize = h.packet_binsize;
+	scale.group_period = h.group_period;
+	memset(&scale.clock, 0, sizeof(scale.clock));
+	return scale;
+}
+
+void raw_file::rewind() {
+	position = data ? header().header_size : 0;
+	packets = 0;
+	truncated = 0;
+	last_timestamp = -1;
+}
+
+const uint8_t* raw_file::packet_end(const uint8_t* p) const {
+	const uint8_t* end = data + size;
+	// the two words of the header have to be there to know the length
+	if (end - p < (ptrdiff_t)(2 * sizeof(uint64_t)))
+		return NULL;
+	const uint8_t* next = (const uint8_t*)crono_next_packet((volatile crono_packet*)p);
+	return next <= end ? next : NULL;
+}
+
+const crono_packet* raw_file::next_packet() {
+	if (!data || position >= size)
+		return NULL;
+	const uint8_t* p = data + position;
+	const uint8_t* next = packet_end(p);
+	if (!next) {
+		truncated = size - position;
+		position = size;
+		return NULL;
+	}
+	position = (uint64_t)(next - data);
+	packets++;
+	last_timestamp = ((const crono_packet*)p)->timestamp;
+	return (const crono_packet*)p;
+}
+
+// Packets of one thread, decoded into a batch of its own
+struct raw_piece {
+	const uint8_t* first;
+	const uint8_t* last;
+	int64_t last_timestamp;
+	hit_batch batch;
+	bool ok;
+};
+
+// The batch is set up by the caller once all pieces are known
+static raw_piece make_piece(const uint8_t* first, const uint8_t* last, int64_t last_timestamp) {
+	raw_piece piece = raw_piece();
+	piece.first = first;
+	piece.last = last;
+	piece.last_timestamp = last_timestamp;
+	return piece;
+}
+
+static void decode_piece(raw_piece* piece, const batch_scale* scale) {
+	piece->batch.last_timestamp = piece->last_timestamp;
+	piece->ok = batch_append(&piece->batch, (volatile crono_packet*)piece->first, (volatile crono_packet*)piece->last, scale);
+}
+
+bool raw_file::read(hit_batch* batch, size_t max_bytes, int threads) {
+	if (!data || position >= size)
+		return batch_reserve(batch, 0, 0);
+	// walk the headers once, cutting the chunk into pieces of about equal size
+	if (max_bytes > size - position)
+		max_bytes = (size_t)(size - position);
+	const uint8_t* begin = data + position;
+	const uint8_t* limit = begin + max_bytes;
+	if (threads < 1)
+		threads = 1;
+	size_t piece_bytes = max_bytes / (size_t)threads;
+	if (piece_bytes < RAWFILE_MIN_PIECE)
+		piece_bytes = RAWFILE_MIN_PIECE;
+	std::vector<raw_piece> pieces;
+	const uint8_t* p = begin;
+	const uint8_t* piece_first = begin;
+	int64_t timestamp = last_timestamp;
+	int64_t piece_timestamp = last_timestamp;
+	const uint8_t* last = NULL;
+	size_t packet_count = 0;
+	while (p < limit || !last) {
+		const uint8_t* next = packet_end(p);
+		if (!next)
+			break;
+		last = p;
+		packet_count++;
+		timestamp = ((const crono_packet*)p)->timestamp;
+		p = next;
+		if ((size_t)(p - piece_first) >= piece_bytes) {
+			pieces.push_back(make_piece(piece_first, last, piece_timestamp));
+			piece_first = p;
+			piece_timestamp = timestamp;
+		}
+	}
+	if (!last) {
+		// nothing but an incomplete packet is left
+		truncated = size - position;
+		position = size;
+		return batch_reserve(batch, 0, 0);
+	}
+	if (piece_first < p) {
+		pieces.push_back(make_piece(piece_first, last, piece_timestamp));
+	}
+
+	batch_scale scale = this->scale();
+	for (size_t i = 0; i < pieces.size(); i++)
+		batch_init(&pieces[i].batch, batch->mode);
+	if (pieces.size() == 1)
+		decode_piece(&pieces[0], &scale);
+	else {
+		std::vector<std::thread> workers;
+		// no allocation once a thread runs, a failure then would leave it unjoined
+		workers.reserve(pieces.size());
+		for (size_t i = 1; i < pieces.size(); i++) {
+			try {
+				workers.push_back(std::thread(decode_piece, &pieces[i], &scale));
+			}
+			catch (const std::system_error&) {
+				// out of threads, this one decodes the piece itself
+				decode_piece(&pieces[i], &scale);
+			}
+		}
+		decode_piece(&pieces[0], &scale);
+		for (size_t i = 0; i < workers.size(); i++)
+			workers[i].join();
+	}
+
+	bool ok = true;
+	for (size_t i = 0; i < pieces.size(); i++)
+		ok = ok && pieces[i].ok;
+	if (ok && pieces.size() == 1) {
+		// the only piece becomes the batch
+		batch_free(batch);
+		*batch = pieces[0].batch;
+		batch_init(&pieces[0].batch, batch->mode);
+	}
+	else if (ok) {
+		ok = batch_reserve(batch, packet_count, 0);
+		for (size_t i = 0; ok && i < pieces.size(); i++)
+			ok = batch_extend(batch, &pieces[i].batch);
+	}
+	for (size_t i = 0; i < pieces.size(); i++)
+		batch_free(&pieces[i].batch);
+	if (!ok)
+		return false;
+	position = (uint64_t)(p - data);
+	packets += packet_count;
+	last_timestamp = timestamp;
+	if (position < size && !packet_end(p)) {
+		// an incomplete packet at the end, the next read returns the empty batch
+		truncated = size - position;
+	}
+	return true;
+}
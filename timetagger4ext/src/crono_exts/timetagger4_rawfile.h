@@ -0,0 +1,64 @@
+// Offline reading of the files written by record()
+//
+// The file is memory-mapped and walked packet by packet with
+// crono_next_packet() like the DMA buffer. Every read takes the next chunk of
+// packets, splits it at packet boundaries into pieces that are decoded by the
+// batch kernels on their own threads, and joins the pieces into one hit_batch
+// in file order, with the same gaps as when the packets were read live.
+
+#ifndef TIMETAGGER4_RAWFILE_H
+#define TIMETAGGER4_RAWFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "timetagger4_batch.h"
+#include "timetagger4_record.h"
+
+#define RAWFILE_DEFAULT_CHUNK (64 << 20)	// bytes of packets per read
+#define RAWFILE_MIN_PIECE (1 << 20)		// bytes of packets below which another thread does not pay
+
+class raw_file {
+public:
+	raw_file();
+	~raw_file();
+
+	// Maps the file and checks its header, returns NULL or the error
+	const char* open(const char* path);
+	void close();
+	bool is_open() const { return data != NULL; }
+
+	const record_header& header() const { return *(const record_header*)data; }
+
+	// Scale factors of the recording, without clock correction
+	batch_scale scale() const;
+
+	// Decodes the packets of the next max_bytes bytes, at least one packet, on up
+	// to threads threads into an empty batch. The batch stays empty at the end of
+	// the file. Returns false if out of memory, the position is unchanged then.
+	// Throws std::bad_alloc if the pieces cannot be allocated.
+	bool read(hit_batch* batch, size_t max_bytes, int threads);
+
+	// The packet at position and moves past it, without decoding. NULL at the
+	// end of the file or at an incomplete packet there.
+	const crono_packet* next_packet();
+
+	// Back to the first packet
+	void rewind();
+
+	uint64_t size;			// of the file in bytes
+	uint64_t position;		// of the next packet
+	uint64_t packets;		// packets read since the last rewind()
+	// bytes at the end that do not hold a whole packet, e.g. of a recording cut short
+	uint64_t truncated;
+
+private:
+	// end of the packet at p, NULL if it reaches beyond the file
+	const uint8_t* packet_end(const uint8_t* p) const;
+
+	const uint8_t* data;
+	int64_t last_timestamp;	// of the packet before position, -1 at the start
+	intptr_t file;
+	intptr_t mapping;
+};
+
+#endif
@@ -0,0 +1,330 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include "timetagger4_record.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static_assert(sizeof(record_header) == RECORD_HEADER_SIZE, "record_header must fill RECORD_HEADER_SIZE bytes");
+
+static uint8_t* aligned_alloc_block(size_t size) {
+#ifdef _WIN32
+	return (uint8_t*)_aligned_malloc(size, RECORD_ALIGNMENT);
+#else
+	void* p = NULL;
+	return posix_memalign(&p, RECORD_ALIGNMENT, size) == 0 ? (uint8_t*)p : NULL;
+#endif
+}
+
+static void aligned_free_block(uint8_t* p) {
+#ifdef _WIN32
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+static size_t align_up(size_t size) {
+	return (size + RECORD_ALIGNMENT - 1) / RECORD_ALIGNMENT * RECORD_ALIGNMENT;
+}
+
+static std::string last_error(const char* what) {
+	char message[128];
+#ifdef _WIN32
+	snprintf(message, sizeof(message), "%s failed with error %lu", what, (unsigned long)GetLastError());
+#else
+	snprintf(message, sizeof(message), "%s failed: %s", what, strerror(errno));
+#endif
+	return message;
+}
+
+// Opens a file for unbuffered writes, -1 if it cannot be created
+static intptr_t open_unbuffered(const std::string& path) {
+#ifdef _WIN32
+	HANDLE h = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	return h == INVALID_HANDLE_VALUE ? -1 : (intptr_t)h;
+#else
+	int fd = -1;
+#ifdef O_DIRECT
+	fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+	// file systems like tmpfs refuse O_DIRECT, those get buffered writes
+	if (fd < 0 && errno == EINVAL)
+#endif
+		fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	return fd;
+#endif
+}
+
+// Writes size bytes, a multiple of RECORD_ALIGNMENT from an aligned buffer
+static bool write_all(intptr_t file, const uint8_t* data, size_t size) {
+	while (size > 0) {
+#ifdef _WIN32
+		DWORD chunk = size > (1u << 30) ? (1u << 30) : (DWORD)size;
+		DWORD written = 0;
+		if (!WriteFile((HANDLE)file, data, chunk, &written, NULL) || written == 0)
+			return false;
+#else
+		ssize_t written = write((int)file, data, size);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return false;
+#endif
+		data += written;
+		size -= (size_t)written;
+	}
+	return true;
+}
+
+// Cuts the padding of the last block and closes the file
+static bool close_truncated(intptr_t file, uint64_t size) {
+#ifdef _WIN32
+	LARGE_INTEGER end;
+	end.QuadPart = (LONGLONG)size;
+	bool ok = SetFilePointerEx((HANDLE)file, end, NULL, FILE_BEGIN) && SetEndOfFile((HANDLE)file);
+	return CloseHandle((HANDLE)file) && ok;
+#else
+	bool ok = ftruncate((int)file, (off_t)size) == 0;
+	return close((int)file) == 0 && ok;
+#endif
+}
+
+// path with _<segment> before the extension, e.g. run.tt4 -> run_00003.tt4
+static std::string segment_path(const std::string& path, uint64_t segment_size, uint32_t segment) {
+	if (segment_size == 0)
+		return path;
+	size_t slash = path.find_last_of("/\\");
+	size_t dot = path.find_last_of('.');
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		dot = path.size();
+	char index[16];
+	snprintf(index, sizeof(index), "_%05u", segment);
+	return path.substr(0, dot) + index + path.substr(dot);
+}
+
+static double steady_seconds() {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+packet_recorder::packet_recorder() :
+	bytes_recorded(0), bytes_written(0), bytes_lost(0), segments(0), stalls(0), stall_seconds(0.0),
+	block_size(0), segment_size(0), filling(-1), segment(0), segment_bytes(0),
+	stopping(false), failed(false), file(-1), file_bytes(0) {
+	memset(&header, 0, sizeof(header));
+}
+
+packet_recorder::~packet_recorder() {
+	stop();
+}
+
+const char* packet_recorder::start(const char* path, const record_header& header, size_t block_size, uint64_t segment_size) {
+	stop();
+	this->path = path;
+	this->header = header;
+	this->block_size = align_up(block_size < RECORD_MIN_BLOCK_SIZE ? RECORD_MIN_BLOCK_SIZE : block_size);
+	this->segment_size = segment_size;
+	for (int i = 0; i < RECORD_BLOCKS; i++) {
+		block b = { aligned_alloc_block(this->block_size), 0, 0, false };
+		if (!b.data) {
+			stop();
+			return "out of memory for the recording blocks";
+		}
+		blocks.push_back(b);
+		free_blocks.push_back(i);
+	}
+	// the first file is opened here, so that a bad path fails the call
+	file = open_unbuffered(segment_path(this->path, segment_size, 0));
+	if (file < 0) {
+		fail(last_error("opening the recording"));
+		stop();
+		return error_message.c_str();
+	}
+	file_bytes = 0;
+	bytes_recorded = 0;
+	bytes_written = 0;
+	bytes_lost = 0;
+	segments = 1;
+	stalls = 0;
+	stall_seconds = 0.0;
+	segment = 0;
+	segment_bytes = 0;
+	filling = -1;
+	stopping = false;
+	failed = false;
+	error_message.clear();
+	thread = std::thread(&packet_recorder::run, this);
+	// every file starts with a header, even one without packets
+	this->header.segment = 0;
+	copy((const uint8_t*)&this->header, sizeof(this->header));
+	return NULL;
+}
+
+void packet_recorder::stop() {
+	if (thread.joinable()) {
+		// the last block closes the file, empty or not
+		if (segment_bytes > 0 && (filling >= 0 || take_block())) {
+			blocks[filling].segment_end = true;
+			submit();
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		full_ready.notify_one();
+		thread.join();
+	}
+	if (file >= 0)
+		close_truncated(file, file_bytes);
+	file = -1;
+	for (size_t i = 0; i < blocks.size(); i++)
+		aligned_free_block(blocks[i].data);
+	blocks.clear();
+	free_blocks.clear();
+	full.clear();
+	filling = -1;
+	segment_bytes = 0;
+}
+
+std::string packet_recorder::error() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return error_message;
+}
+
+void packet_recorder::fail(const std::string& message) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (error_message.empty())
+		error_message = message;
+	failed = true;
+}
+
+void packet_recorder::append(volatile crono_packet* first, volatile crono_packet* last) {
+	if (!thread.joinable())
+		return;
+	const uint8_t* begin = (const uint8_t*)first;
+	size_t size = (const uint8_t*)crono_next_packet(last) - begin;
+	bytes_recorded += size;
+	if (failed) {
+		bytes_lost += size;
+		return;
+	}
+	// rotate at the read boundary, a read larger than a segment gets one of its own
+	if (segment_size > 0 && segment_bytes > RECORD_HEADER_SIZE && segment_bytes + size > segment_size)
+		end_segment();
+	if (segment_bytes == 0) {
+		header.segment = segment;
+		copy((const uint8_t*)&header, sizeof(header));
+	}
+	copy(begin, size);
+}
+
+void packet_recorder::end_segment() {
+	if (filling >= 0 || take_block()) {
+		blocks[filling].segment_end = true;
+		submit();
+	}
+	segment++;
+	segment_bytes = 0;
+}
+
+void packet_recorder::copy(const uint8_t* data, size_t size) {
+	while (size > 0) {
+		if (filling < 0 && !take_block()) {
+			bytes_lost += size;
+			return;
+		}
+		block& b = blocks[filling];
+		size_t chunk = block_size - b.used < size ? block_size - b.used : size;
+		memcpy(b.data + b.used, data, chunk);
+		b.used += chunk;
+		segment_bytes += chunk;
+		data += chunk;
+		size -= chunk;
+		if (b.used == block_size)
+			submit();
+	}
+}
+
+// Takes a free block for the read path, waiting for the writer if there is none
+bool packet_recorder::take_block() {
+	std::unique_lock<std::mutex> lock(mutex);
+	if (free_blocks.empty()) {
+		double waited_from = steady_seconds();
+		stalls++;
+		free_ready.wait(lock, [this] { return !free_blocks.empty() || failed; });
+		stall_seconds = stall_seconds + (steady_seconds() - waited_from);
+		if (free_blocks.empty())
+			return false;
+	}
+	filling = free_blocks.back();
+	free_blocks.pop_back();
+	block& b = blocks[filling];
+	b.used = 0;
+	b.segment = segment;
+	b.segment_end = false;
+	return true;
+}
+
+void packet_recorder::submit() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		full.push_back(filling);
+	}
+	filling = -1;
+	full_ready.notify_one();
+}
+
+void packet_recorder::run() {
+	for (;;) {
+		int index;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			full_ready.wait(lock, [this] { return !full.empty() || stopping; });
+			if (full.empty())
+				return;
+			index = full.front();
+			full.pop_front();
+		}
+		if (!failed)
+			write_block(blocks[index]);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			free_blocks.push_back(index);
+		}
+		free_ready.notify_one();
+	}
+}
+
+void packet_recorder::write_block(block& b) {
+	if (file < 0) {
+		file = open_unbuffered(segment_path(path, segment_size, b.segment));
+		if (file < 0) {
+			fail(last_error("opening the next segment"));
+			return;
+		}
+		file_bytes = 0;
+		segments++;
+	}
+	// unbuffered writes need whole sectors, the padding is cut when the file is closed
+	size_t padded = align_up(b.used);
+	memset(b.data + b.used, 0, padded - b.used);
+	if (!write_all(file, b.data, padded)) {
+		fail(last_error("writing the recording"));
+		return;
+	}
+	file_bytes += b.used;
+	bytes_written += b.used;
+	if (b.segment_end) {
+		if (!close_truncated(file, file_bytes))
+			fail(last_error("closing the segment"));
+		file = -1;
+	}
+}
@@ -0,0 +1,124 @@
+// Recording of the raw packet stream to disk
+//
+// Every read of the board is copied, headers and 64 bit data words as they are
+// in the DMA buffer, into large aligned blocks. A writer thread writes full
+// blocks with unbuffered I/O (FILE_FLAG_NO_BUFFERING on Windows, O_DIRECT
+// elsewhere) while the read path fills the other block, so neither the GIL nor
+// the page cache is involved. When both blocks are full the read path waits
+// and the data backs up into the host buffer of the board.
+//
+// A file is a record_header followed by the packets of the reads in read
+// order. With a segment size the recording rotates to a new file at a read
+// boundary, every segment starts with its own header and decodes on its own.
+
+#ifndef TIMETAGGER4_RECORD_H
+#define TIMETAGGER4_RECORD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "TimeTagger4_interface.h"
+
+#define RECORD_MAGIC "TT4RAW\0\0"
+#define RECORD_VERSION 1
+#define RECORD_HEADER_SIZE 256		// a multiple of 8, the packets after it stay aligned
+#define RECORD_ALIGNMENT 4096		// of the blocks in memory, on disk and of their sizes
+#define RECORD_BLOCKS 2				// one filled by the read path, one written
+#define RECORD_DEFAULT_BLOCK_SIZE (4 << 20)
+#define RECORD_MIN_BLOCK_SIZE (64 << 10)
+
+// Start of every file, the scale factors of the configuration at the start of
+// the recording decode the packets offline
+struct record_header {
+	char magic[8];				// RECORD_MAGIC
+	uint32_t version;			// RECORD_VERSION
+	uint32_t header_size;		// RECORD_HEADER_SIZE, the packets start there
+	uint32_t segment;			// index of the file in the recording
+	int32_t tdc_mode;			// TIMETAGGER4_TDC_MODE_*
+	int32_t card_index;
+	int32_t board_serial;
+	int64_t rollover_period;	// TDC bins per rollover of the hit timestamp counter
+	double binsize;				// ps per TDC bin
+	double packet_binsize;		// ps per bin of the packet timestamp
+	int64_t group_period;		// packet bins between periodic starts, 0 if not periodic
+	uint8_t reserved[RECORD_HEADER_SIZE - 64];
+};
+
+class packet_recorder {
+public:
+	packet_recorder();
+	~packet_recorder();
+
+	// Opens the first file and starts the writer thread. block_size is rounded
+	// up to RECORD_ALIGNMENT, segment_size 0 writes a single file at path, else
+	// path gets the segment index before its extension. Returns NULL or the error.
+	const char* start(const char* path, const record_header& header, size_t block_size, uint64_t segment_size);
+
+	// Writes what is left and joins the writer thread
+	void stop();
+
+	bool active() const { return thread.joinable(); }
+
+	// Copies the packets first..last, they are contiguous in the DMA buffer.
+	// Called by the read paths under the device mutex, waits while no block is free.
+	void append(volatile crono_packet* first, volatile crono_packet* last);
+
+	std::string path;
+	std::atomic<uint64_t> bytes_recorded;	// packet bytes appended
+	std::atomic<uint64_t> bytes_written;	// to disk, headers included, padding excluded
+	std::atomic<uint64_t> bytes_lost;		// appended after a write error
+	std::atomic<uint32_t> segments;			// files opened
+	std::atomic<uint64_t> stalls;			// appends that waited for a free block
+	std::atomic<double> stall_seconds;
+
+	// first write error, empty if none
+	std::string error() const;
+
+private:
+	struct block {
+		uint8_t* data;
+		size_t used;
+		uint32_t segment;
+		bool segment_end;	// the file is closed after this block
+	};
+
+	void run();
+	void copy(const uint8_t* data, size_t size);
+	void end_segment();
+	void submit();
+	bool take_block();
+	void write_block(block& b);
+	void fail(const std::string& message);
+
+	std::vector<block> blocks;
+	size_t block_size;
+	uint64_t segment_size;
+	record_header header;
+
+	// producer side, guarded by the device mutex of the caller
+	int filling;				// block the read path copies into, -1 if none
+	uint32_t segment;
+	uint64_t segment_bytes;		// of the current segment, header included
+
+	mutable std::mutex mutex;	// guards the queues, stopping and the error
+	std::condition_variable full_ready;
+	std::condition_variable free_ready;
+	std::deque<int> full;
+	std::vector<int> free_blocks;
+	bool stopping;
+	std::atomic<bool> failed;
+	std::string error_message;
+
+	// writer side
+	std::thread thread;
+	intptr_t file;				// handle or descriptor of the open segment, -1 if none
+	uint64_t file_bytes;		// valid bytes of the open segment
+};
+
+#endif
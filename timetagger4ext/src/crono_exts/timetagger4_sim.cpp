@@ -0,0 +1,713 @@
+#ifdef TIMETAGGER4_SIM
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <new>
+#include <vector>
+#include "timetagger4_rawfile.h"
+#include "timetagger4_sim.h"
+
+static std::mutex sim_mutex;	// parameters and the table of cards
+static sim_parameters sim_params = {
+	1e6,
+	{ 1.0, 1.0, 1.0, 1.0 },
+	SIM_POISSON,
+	1.0,
+	0.0,
+	1 << 24,
+	500.0,
+	4000.0,
+	1
+};
+
+void sim_get_parameters(sim_parameters* params) {
+	std::lock_guard<std::mutex> lock(sim_mutex);
+	*params = sim_params;
+}
+
+void sim_set_parameters(const sim_parameters* params) {
+	std::lock_guard<std::mutex> lock(sim_mutex);
+	sim_params = *params;
+}
+
+static sim_replay sim_replay_params = { "", 1.0, false };
+
+void sim_get_replay(sim_replay* replay) {
+	std::lock_guard<std::mutex> lock(sim_mutex);
+	*replay = sim_replay_params;
+}
+
+const char* sim_set_replay(const sim_replay* replay) {
+	if (!replay->path.empty()) {
+		raw_file file;
+		const char* error = file.open(replay->path.c_str());
+		if (error)
+			return error;
+	}
+	std::lock_guard<std::mutex> lock(sim_mutex);
+	sim_replay_params = *replay;
+	return NULL;
+}
+
+// A hit of a group, in TDC bins from the group start
+struct sim_hit {
+	int64_t bins;
+	uint8_t channel;
+	bool operator<(const sim_hit& other) const { return bins < other.bins; }
+};
+
+struct sim_card {
+	timetagger4_device device;	// handed out, points back here
+	int card_index;
+	int board_id;
+	sim_parameters params;		// board properties from init, the rest from start_capture
+	timetagger4_configuration config;
+	const char* error;
+
+	// ring buffer in 64 bit words: packets live in [tail, head), or in
+	// [tail, wrap_end) and [0, head) after a wrap, none if empty
+	std::vector<uint64_t> ring;
+	size_t head;
+	size_t tail;
+	size_t wrap_end;
+	bool wrapped;
+	bool empty;
+	std::vector<uint64_t> held;	// packet made but placed by the next read, it would wrap this one
+	volatile crono_packet* last_read;
+
+	bool capturing;
+	bool paused;
+	std::chrono::steady_clock::time_point started;
+	int64_t period_bins;		// packet bins per group
+	int64_t group;				// index of the next group
+	uint8_t lost_flags;			// for the next packet, of groups lost before it
+	double next_hit[TIMETAGGER4_TDC_CHANNEL_COUNT];	// ps from the start of the next group
+	uint64_t rng;
+	std::vector<sim_hit> hits;
+	std::vector<uint32_t> words;
+
+	// replay of a recording instead of the groups
+	bool replaying;
+	bool replay_loop;
+	double replay_speed;
+	raw_file replay;
+	const crono_packet* replay_next;	// next packet of the file, NULL at its end
+	int64_t replay_first;		// timestamp of the first packet of the file
+	int64_t replay_offset;		// added to the timestamps, the length of the file times the loops
+};
+
+static sim_card* sim_cards[SIM_MAX_CARDS];
+
+static sim_card* card_of(timetagger4_device* device) {
+	return device ? (sim_card*)device->timetagger4 : NULL;
+}
+
+// splitmix64, cheap and good enough for arrival times
+static uint64_t next_random(sim_card* c) {
+	uint64_t z = (c->rng += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+// uniform in (0, 1]
+static double next_uniform(sim_card* c) {
+	return ((next_random(c) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+static double channel_rate(const sim_card* c, int channel) {
+	double total = 0;
+	for (int i = 0; i < TIMETAGGER4_TDC_CHANNEL_COUNT; i++)
+		total += c->params.channel_weights[i];
+	if (total <= 0 || !c->config.channel[channel].enabled)
+		return 0;
+	return c->params.hit_rate * c->params.channel_weights[channel] / total;
+}
+
+// ps to the next hit of a channel with rate hits/s
+static double hit_interval(sim_card* c, double rate) {
+	double mean = 1e12 / rate;
+	return c->params.statistics == SIM_PERIODIC ? mean : -log(next_uniform(c)) * mean;
+}
+
+static double period_ps(const sim_card* c) {
+	return c->period_bins * c->params.packet_binsize;
+}
+
+// Moves the timeline on by groups groups that were not made
+static void skip_groups(sim_card* c, int64_t groups) {
+	if (groups <= 0)
+		return;
+	double skipped = groups * period_ps(c);
+	for (int i = 0; i < TIMETAGGER4_TDC_CHANNEL_COUNT; i++)
+		c->next_hit[i] -= skipped;
+	c->group += groups;
+}
+
+// Window of a channel in ps from the group start
+static void channel_window(const sim_card* c, int channel, double* start, double* stop) {
+	double period = period_ps(c);
+	if (c->config.tdc_mode == TIMETAGGER4_TDC_MODE_CONTINUOUS) {
+		*start = 0;
+		*stop = period;
+		return;
+	}
+	*start = c->config.channel[channel].start * c->params.binsize;
+	*stop = std::min((double)c->config.channel[channel].stop * c->params.binsize, period);
+}
+
+// largest packet in words, a quarter of the ring so that reads keep flowing
+static size_t max_packet_words(const sim_card* c) {
+	return c->ring.size() / 4;
+}
+
+// Makes the packet of the next group into held, returns false for an empty
+// group that the configuration leaves out
+static bool make_group(sim_card* c) {
+	double period = period_ps(c);
+	c->hits.clear();
+	for (int channel = 0; channel < TIMETAGGER4_TDC_CHANNEL_COUNT; channel++) {
+		double rate = channel_rate(c, channel);
+		double& next = c->next_hit[channel];
+		if (rate <= 0) {
+			next = 0;
+			continue;
+		}
+		double start, stop;
+		channel_window(c, channel, &start, &stop);
+		if (next < start) {
+			// Poisson arrivals have no memory, periodic ones keep their phase
+			if (c->params.statistics == SIM_PERIODIC) {
+				double interval = 1e12 / rate;
+				next += ceil((start - next) / interval) * interval;
+			}
+			else
+				next = start + hit_interval(c, rate);
+		}
+		for (; next < stop; next += hit_interval(c, rate)) {
+			sim_hit hit = { (int64_t)(next / c->params.binsize), (uint8_t)channel };
+			c->hits.push_back(hit);
+		}
+		next -= period;
+	}
+	c->group++;
+	if (c->hits.empty() && c->config.ignore_empty_packets)
+		return false;
+	std::stable_sort(c->hits.begin(), c->hits.end());
+
+	// hit words in time order, an overflow word before the hits of every rollover
+	uint8_t flags = c->lost_flags;
+	c->lost_flags = 0;
+	size_t max_words = (max_packet_words(c) - 2) * 2;
+	int64_t rollover = c->params.rollover_period;
+	int64_t rollovers = 0;
+	c->words.clear();
+	for (size_t i = 0; i < c->hits.size(); i++) {
+		const sim_hit& hit = c->hits[i];
+		while (rollovers < hit.bins / rollover && rollovers < SIM_MAX_ROLLOVERS && c->words.size() < max_words) {
+			c->words.push_back((uint32_t)TIMETAGGER4_HIT_FLAG_TIME_OVERFLOW << 4);
+			rollovers++;
+		}
+		if (hit.bins / rollover > SIM_MAX_ROLLOVERS) {
+			flags |= TIMETAGGER4_PACKET_FLAG_SLOW_SYNC;
+			break;
+		}
+		if (c->words.size() >= max_words) {
+			flags |= TIMETAGGER4_PACKET_FLAG_SHORTENED;
+			break;
+		}
+		uint32_t hit_flags = TIMETAGGER4_HIT_FLAG_COARSE_TIMESTAMP;
+		if (c->config.channel[hit.channel].rising)
+			hit_flags |= TIMETAGGER4_HIT_FLAG_RISING;
+		c->words.push_back((uint32_t)(hit.bins % rollover) << 8 | hit_flags << 4 | hit.channel);
+	}
+	if (c->words.size() % 2) {
+		flags |= TIMETAGGER4_PACKET_FLAG_ODD_HITS;
+		c->words.push_back(0);
+	}
+
+	c->held.assign(2 + c->words.size() / 2, 0);
+	crono_packet* p = (crono_packet*)c->held.data();
+	p->channel = 0;
+	p->card = (uint8_t)c->board_id;
+	p->type = CRONO_PACKET_TYPE_TDC_DATA;
+	p->flags = flags;
+	p->length = (uint32_t)(c->words.size() / 2);
+	p->timestamp = (c->group - 1) * c->period_bins;
+	if (!c->words.empty())
+		memcpy(p->data, c->words.data(), c->words.size() * sizeof(uint32_t));
+	return true;
+}
+
+// Offset in the ring for words words, false if there is no room.
+// A packet that does not fit before the end of the ring goes to its start.
+static bool ring_room(sim_card* c, size_t words, size_t* at, bool* wraps) {
+	*wraps = false;
+	if (c->empty) {
+		c->head = c->tail = 0;
+		c->wrapped = false;
+	}
+	if (c->wrapped) {
+		// the free space ends at the tail
+		*at = c->head;
+		return c->head + words <= c->tail;
+	}
+	if (c->head + words <= c->ring.size()) {
+		*at = c->head;
+		return true;
+	}
+	*at = 0;
+	*wraps = true;
+	return words <= c->tail;
+}
+
+// Copies held to at, returns its size in words
+static size_t ring_place(sim_card* c, size_t at, bool wraps) {
+	if (wraps) {
+		c->wrap_end = c->head;
+		c->wrapped = true;
+	}
+	size_t words = c->held.size();
+	memcpy(&c->ring[at], c->held.data(), words * sizeof(uint64_t));
+	c->head = at + words;
+	c->empty = false;
+	c->held.clear();
+	return words;
+}
+
+// Frees the ring up to and including packet
+static void ring_free(sim_card* c, volatile crono_packet* packet) {
+	size_t start = (size_t)((volatile uint64_t*)packet - c->ring.data());
+	size_t end = (size_t)((volatile uint64_t*)crono_next_packet(packet) - c->ring.data());
+	if (c->wrapped && start < c->tail) {
+		// in the part after the wrap, all before it is free as well
+		c->wrapped = false;
+	}
+	c->tail = end;
+	if (c->wrapped && c->tail >= c->wrap_end) {
+		c->tail = 0;
+		c->wrapped = false;
+	}
+	if (!c->wrapped && c->tail == c->head)
+		c->empty = true;
+}
+
+// index of the first group not yet due
+static int64_t due_groups(const sim_card* c) {
+	if (c->params.speed <= 0)
+		return INT64_MAX;
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - c->started).count();
+	// a group is due once its period has passed
+	return (int64_t)(seconds * c->params.speed * 1e12 / period_ps(c));
+}
+
+// Timestamp of the next packet of the replay in the timeline of the capture
+static int64_t replay_timestamp(const sim_card* c) {
+	return c->replay_next->timestamp + c->replay_offset;
+}
+
+// Moves on to the next packet of the file, back to the first one when looping.
+// The timestamps of the next loop follow the last one by a group period.
+static void replay_advance(sim_card* c) {
+	int64_t last = c->replay_next ? replay_timestamp(c) : 0;
+	c->replay_next = c->replay.next_packet();
+	if (c->replay_next || !c->replay_loop || c->replay.packets == 0)
+		return;
+	c->replay.rewind();
+	c->replay_next = c->replay.next_packet();
+	int64_t period = std::max(c->replay.header().group_period, (int64_t)1);
+	c->replay_offset = last + period - c->replay_first;
+}
+
+static bool replay_due(const sim_card* c) {
+	if (!c->replay_next)
+		return false;
+	if (c->params.speed <= 0)
+		return true;
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - c->started).count();
+	double ps = (double)(replay_timestamp(c) - c->replay_first) * c->params.packet_binsize;
+	return ps <= seconds * c->params.speed * 1e12;
+}
+
+// Copies the next packet of the replay into held
+static void replay_take(sim_card* c) {
+	const crono_packet* p = c->replay_next;
+	size_t words = (size_t)((const uint64_t*)crono_next_packet((volatile crono_packet*)p) - (const uint64_t*)p);
+	size_t max_words = max_packet_words(c);
+	c->held.assign((const uint64_t*)p, (const uint64_t*)p + std::min(words, max_words));
+	crono_packet* packet = (crono_packet*)c->held.data();
+	packet->timestamp = replay_timestamp(c);
+	packet->flags |= c->lost_flags;
+	c->lost_flags = 0;
+	if (words > max_words) {
+		// cut like the board cuts packets that do not fit, the last word is a hit then
+		packet->length = (uint32_t)(max_words - 2);
+		packet->flags = (packet->flags | TIMETAGGER4_PACKET_FLAG_SHORTENED) & ~TIMETAGGER4_PACKET_FLAG_ODD_HITS;
+	}
+	replay_advance(c);
+}
+
+// Drops what became due while the board could not take it
+static void skip_due(sim_card* c) {
+	if (c->replaying) {
+		while (replay_due(c))
+			replay_advance(c);
+	}
+	else
+		skip_groups(c, due_groups(c) - c->group);
+}
+
+static void reset_replay(sim_card* c) {
+	c->params.speed = c->replay_speed;
+	c->replay.rewind();
+	c->replay_next = c->replay.next_packet();
+	c->replay_first = c->replay_next ? c->replay_next->timestamp : 0;
+	c->replay_offset = 0;
+}
+
+static void reset_timeline(sim_card* c) {
+	sim_parameters p;
+	sim_get_parameters(&p);
+	// the board properties stay those of init
+	c->params.hit_rate = p.hit_rate;
+	memcpy(c->params.channel_weights, p.channel_weights, sizeof(p.channel_weights));
+	c->params.statistics = p.statistics;
+	c->params.speed = p.speed;
+	c->params.loss_rate = p.loss_rate;
+	c->params.seed = p.seed;
+	c->rng = p.seed + c->card_index;
+	double period = c->config.auto_trigger_period / SIM_REF_CLOCK * 1e12;
+	c->period_bins = std::max((int64_t)1, (int64_t)(period / c->params.packet_binsize + 0.5));
+	c->group = 0;
+	c->lost_flags = 0;
+	c->held.clear();
+	for (int i = 0; i < TIMETAGGER4_TDC_CHANNEL_COUNT; i++) {
+		double rate = channel_rate(c, i);
+		c->next_hit[i] = rate > 0 ? hit_interval(c, rate) : 0;
+	}
+	c->started = std::chrono::steady_clock::now();
+}
+
+extern "C" {
+
+int timetagger4_get_default_init_parameters(timetagger4_init_parameters* init) {
+	memset(init, 0, sizeof(*init));
+	init->version = TIMETAGGER4_API_VERSION;
+	init->buffer_size[0] = 8 << 20;
+	init->buffer_type = TIMETAGGER4_BUFFER_ALLOCATE;
+	return CRONO_OK;
+}
+
+timetagger4_device* timetagger4_init(timetagger4_init_parameters* params, int* error_code, const char** error_message) {
+	*error_code = CRONO_OK;
+	*error_message = "OK";
+	if (params->card_index < 0 || params->card_index >= SIM_MAX_CARDS) {
+		*error_code = CRONO_DEVICE_OPEN_FAILED;
+		*error_message = "no simulated card with this index";
+		return NULL;
+	}
+	if (params->buffer_size[0] < SIM_MIN_BUFFER) {
+		*error_code = CRONO_INVALID_BUFFER_PARAMETERS;
+		*error_message = "the buffer of a simulated card takes at least 64 kB";
+		return NULL;
+	}
+	std::lock_guard<std::mutex> lock(sim_mutex);
+	if (sim_cards[params->card_index]) {
+		*error_code = CRONO_DEVICE_OPEN_FAILED;
+		*error_message = "the simulated card is already open";
+		return NULL;
+	}
+	sim_card* c = new (std::nothrow) sim_card();
+	if (c) {
+		try {
+			c->ring.resize((size_t)params->buffer_size[0] / sizeof(uint64_t));
+		}
+		catch (const std::bad_alloc&) {
+			delete c;
+			c = NULL;
+		}
+	}
+	if (!c) {
+		*error_code = CRONO_BUFFER_ALLOC_FAILED;
+		*error_message = "cannot allocate the buffer of the simulated card";
+		return NULL;
+	}
+	if (!sim_replay_params.path.empty()) {
+		const char* error = c->replay.open(sim_replay_params.path.c_str());
+		if (error) {
+			delete c;
+			*error_code = CRONO_DEVICE_OPEN_FAILED;
+			*error_message = error;
+			return NULL;
+		}
+	}
+	c->device.timetagger4 = c;
+	c->card_index = params->card_index;
+	c->board_id = params->board_id;
+	c->params = sim_params;
+	if (c->replay.is_open()) {
+		// the packets decode with the properties of the recording
+		const record_header& h = c->replay.header();
+		c->params.binsize = h.binsize;
+		c->params.packet_binsize = h.packet_binsize;
+		c->params.rollover_period = (uint32_t)h.rollover_period;
+		c->replaying = true;
+		c->replay_speed = sim_replay_params.speed;
+		c->replay_loop = sim_replay_params.loop;
+	}
+	c->error = "OK";
+	c->empty = true;
+	timetagger4_get_default_configuration(&c->device, &c->config);
+	sim_cards[params->card_index] = c;
+	return &c->device;
+}
+
+int timetagger4_close(timetagger4_device* device) {
+	sim_card* c = card_of(device);
+	if (!c)
+		return CRONO_INVALID_DEVICE;
+	std::lock_guard<std::mutex> lock(sim_mutex);
+	sim_cards[c->card_index] = NULL;
+	delete c;
+	return CRONO_OK;
+}
+
+int timetagger4_count_devices(int* error_code, const char** error_message) {
+	*error_code = CRONO_OK;
+	*error_message = "OK";
+	return SIM_MAX_CARDS;
+}
+
+const char* timetagger4_get_device_name(timetagger4_device*) {
+	return "TimeTagger4 simulator";
+}
+
+const char* timetagger4_get_last_error_message(timetagger4_device* device) {
+	sim_card* c = card_of(device);
+	return c ? c->error : "invalid device";
+}
+
+int timetagger4_get_static_info(timetagger4_device* device, timetagger4_static_info* info) {
+	sim_card* c = card_of(device);
+	if (!c)
+		return CRONO_INVALID_DEVICE;
+	memset(info, 0, sizeof(*info));
+	info->size = sizeof(*info);
+	info->board_id = c->board_id;
+	info->board_serial = c->card_index;
+	info->flash_valid = 1;
+	strcpy(info->calibration_date, "simulated");
+	strcpy(info->bitstream_date, "simulated");
+	info->auto_trigger_ref_clock = SIM_REF_CLOCK;
+	info->rollover_period = c->params.rollover_period;
+	return CRONO_OK;
+}
+
+int timetagger4_get_param_info(timetagger4_device* device, timetagger4_param_info* info) {
+	sim_card* c = card_of(device);
+	if (!c)
+		return CRONO_INVALID_DEVICE;
+	memset(info, 0, sizeof(*info));
+	info->size = sizeof(*info);
+	info->binsize = c->params.binsize;
+	info->packet_binsize = c->params.packet_binsize;
+	info->board_id = c->board_id;
+	info->channels = TIMETAGGER4_TDC_CHANNEL_COUNT;
+	info->channel_mask = (1 << TIMETAGGER4_TDC_CHANNEL_COUNT) - 1;
+	info->total_buffer = (int64_t)(c->ring.size() * sizeof(uint64_t));
+	return CRONO_OK;
+}
+
+int timetagger4_get_default_configuration(timetagger4_device* device, timetagger4_configuration* config) {
+	if (!card_of(device))
+		return CRONO_INVALID_DEVICE;
+	memset(config, 0, sizeof(*config));
+	config->size = sizeof(*config);
+	config->tdc_mode = TIMETAGGER4_TDC_MODE_GROUPED;
+	config->start_rising = 1;
+	config->auto_trigger_period = TIMETAGGER4_DEFAULT_AUTO_TRIGGER_PERIOD;
+	config->trigger[TIMETAGGER4_TRIGGER_S].rising = 1;
+	for (int i = 0; i < TIMETAGGER4_TDC_CHANNEL_COUNT; i++) {
+		config->channel[i].enabled = 1;
+		config->channel[i].rising = 1;
+		config->channel[i].stop = 30000;
+		config->trigger[TIMETAGGER4_TRIGGER_A + i].rising = 1;
+	}
+	return CRONO_OK;
+}
+
+int timetagger4_get_current_configuration(timetagger4_device* device, timetagger4_configuration* config) {
+	sim_card* c = card_of(device);
+	if (!c)
+		return CRONO_INVALID_DEVICE;
+	*config = c->config;
+	return CRONO_OK;
+}
+
+int timetagger4_configure(timetagger4_device* device, timetagger4_configuration* config) {
+	sim_card* c = card_of(device);
+	if (!c)
+		return CRONO_INVALID_DEVICE;
+	if (c->capturing) {
+		c->error = "stop the capture before configuring the simulated card";
+		return CRONO_WRONG_STATE;
+	}
+	if (config->tdc_mode != TIMETAGGER4_TDC_MODE_GROUPED && config->tdc_mode != TIMETAGGER4_TDC_MODE_CONTINUOUS) {
+		c->error = "invalid tdc_mode";
+		return CRONO_INVALID_CONFIG_PARAMETERS;
+	}
+	// the limits of the board, grouped mode takes longer periods than continuous mode
+	bool period_ok = config->tdc_mode == TIMETAGGER4_TDC_MODE_CONTINUOUS ?
+		config->auto_trigger_period >= TIMETAGGER4_MIN_CONT_AUTO_TRIGGER_PERIOD &&
+		config->auto_trigger_period <= TIMETAGGER4_MAX_CONT_AUTO_TRIGGER_PERIOD :
+		config->auto_trigger_period >= 10 && config->auto_trigger_period < 0x80000000u;
+	if (!period_ok) {
+		c->error = "auto_trigger_period out of range";
+		return CRONO_INVALID_CONFIG_PARAMETERS;
+	}
+	c->config = *config;
+	c->error = "OK";
+	return CRONO_OK;
+}
+
+int timetagger4_start_capture(timetagger4_device* device) {
+	sim_card* c = card_of(device);
+	if (!c)
+		return CRONO_INVALID_DEVICE;
+	reset_timeline(c);
+	if (c->replaying)
+		reset_replay(c);
+	c->capturing = true;
+	c->paused = false;
+	return CRONO_OK;
+}
+
+int timetagger4_stop_capture(timetagger4_device* device) {
+	sim_card* c = card_of(device);
+	if (!c)
+		return CRONO_INVALID_DEVICE;
+	c->capturing = false;
+	return CRONO_OK;
+}
+
+int timetagger4_pause_capture(timetagger4_device* device) {
+	sim_card* c = card_of(device);
+	if (!c)
+		return CRONO_INVALID_DEVICE;
+	c->paused = true;
+	return CRONO_OK;
+}
+
+int timetagger4_continue_capture(timetagger4_device* device) {
+	sim_card* c = card_of(device);
+	if (!c)
+		return CRONO_INVALID_DEVICE;
+	// the groups of the pause never started, the timestamps jump over them
+	if (c->paused && c->capturing && c->params.speed > 0)
+		skip_due(c);
+	c->paused = false;
+	return CRONO_OK;
+}
+
+int timetagger4_start_tiger(timetagger4_device* device) {
+	return card_of(device) ? CRONO_OK : CRONO_INVALID_DEVICE;
+}
+
+int timetagger4_stop_tiger(timetagger4_device* device) {
+	return card_of(device) ? CRONO_OK : CRONO_INVALID_DEVICE;
+}
+
+int timetagger4_acknowledge(timetagger4_device* device, volatile crono_packet* packet) {
+	sim_card* c = card_of(device);
+	if (!c)
+		return CRONO_INVALID_DEVICE;
+	uint64_t* p = (uint64_t*)packet;
+	if (c->empty || p < c->ring.data() || p >= c->ring.data() + c->ring.size())
+		return CRONO_INVALID_ARGUMENTS;
+	ring_free(c, packet);
+	return CRONO_OK;
+}
+
+int timetagger4_read(timetagger4_device* device, timetagger4_read_in* in, timetagger4_read_out* out) {
+	sim_card* c = card_of(device);
+	out->first_packet = NULL;
+	out->last_packet = NULL;
+	if (!c) {
+		out->error_code = CRONO_READ_INTERNAL_ERROR;
+		out->error_message = "invalid device";
+		return CRONO_READ_INTERNAL_ERROR;
+	}
+	if (in && in->acknowledge_last_read && c->last_read && !c->empty)
+		ring_free(c, c->last_read);
+	c->last_read = NULL;
+	out->error_code = CRONO_READ_NO_DATA;
+	out->error_message = "no data";
+	if (!c->capturing)
+		return CRONO_READ_NO_DATA;
+	bool fast = c->params.speed <= 0;
+	int64_t due = due_groups(c);
+	if (c->paused) {
+		// the board makes no groups while paused
+		if (!fast)
+			skip_due(c);
+		return CRONO_READ_NO_DATA;
+	}
+
+	// at speed 0 a read leaves room for more reads before the first is acknowledged
+	size_t read_limit = std::min((size_t)SIM_READ_BYTES / sizeof(uint64_t), max_packet_words(c));
+	size_t read_words = 0;
+	for (;;) {
+		if (c->held.empty()) {
+			if (fast && read_words >= read_limit)
+				break;
+			if (c->replaying) {
+				if (!replay_due(c))
+					break;
+				replay_take(c);
+				continue;
+			}
+			if (c->group >= due)
+				break;
+			if (c->params.loss_rate > 0 && next_uniform(c) <= c->params.loss_rate) {
+				// lost in the board before the DMA
+				skip_groups(c, 1);
+				c->lost_flags |= TIMETAGGER4_PACKET_FLAG_DMA_FIFO_FULL;
+				continue;
+			}
+			if (!make_group(c))
+				continue;
+		}
+		size_t at;
+		bool wraps;
+		if (!ring_room(c, c->held.size(), &at, &wraps)) {
+			if (fast)
+				break;
+			// the buffer is full, the board drops what is due until the reader frees some
+			c->held.clear();
+			skip_due(c);
+			c->lost_flags |= TIMETAGGER4_PACKET_FLAG_HOST_BUFFER_FULL;
+			break;
+		}
+		// the packets of a read are contiguous, the wrapped one starts the next read
+		if (wraps && out->first_packet)
+			break;
+		read_words += ring_place(c, at, wraps);
+		volatile crono_packet* p = (volatile crono_packet*)&c->ring[at];
+		if (!out->first_packet)
+			out->first_packet = p;
+		out->last_packet = p;
+	}
+	if (!out->first_packet)
+		return CRONO_READ_NO_DATA;
+	c->last_read = out->last_packet;
+	out->error_code = CRONO_READ_OK;
+	out->error_message = "OK";
+	return CRONO_READ_OK;
+}
+
+}
+
+#endif
@@ -0,0 +1,73 @@
+// Simulated TimeTagger4 for hosts without a board or driver
+//
+// Implements the timetagger4_* functions the extension calls, so that the
+// module built with TIMETAGGER4_SIM runs on any host. Every card writes
+// packets into a ring buffer of the requested size the way the board fills
+// its DMA buffer: one group per auto trigger period with the hits of the
+// enabled channels inside their window, an overflow word at every rollover of
+// the hit counter, a padding word after an odd number of hits, and flags on
+// the packet after groups were lost to a full buffer or to injected loss.
+// Packets are only freed by timetagger4_acknowledge().
+//
+// Groups are made when read. At a speed above 0 they are due at the wall
+// clock times speed since the start, and groups due while the buffer is full
+// are lost like on the board. At speed 0 the board time follows the reader, a
+// read returns up to SIM_READ_BYTES or a quarter of the buffer, and nothing is
+// lost to the buffer.
+//
+// With a replay set, the cards take the packets of a file written by record()
+// instead of making groups. A packet is due when its timestamp, from the first
+// packet of the file, has passed at the speed of the replay, and packets due
+// while the buffer is full are lost the same way. The packets keep their flags
+// and card, the bin sizes and the rollover period of the cards are those of
+// the recording.
+
+#ifndef TIMETAGGER4_SIM_H
+#define TIMETAGGER4_SIM_H
+
+#include <stdint.h>
+#include <string>
+#include "TimeTagger4_interface.h"
+
+#define SIM_MAX_CARDS 8
+#define SIM_READ_BYTES (1 << 20)		// packets per read at speed 0
+#define SIM_MIN_BUFFER (64 << 10)		// smallest ring buffer accepted by timetagger4_init()
+#define SIM_REF_CLOCK 75e6				// Hz of the auto trigger
+#define SIM_MAX_ROLLOVERS 255			// per group, later hits end the group with SLOW_SYNC
+
+// statistics of the hits of a channel
+#define SIM_POISSON 0
+#define SIM_PERIODIC 1
+
+struct sim_parameters {
+	double hit_rate;		// hits/s of all channels together
+	double channel_weights[TIMETAGGER4_TDC_CHANNEL_COUNT];	// share of the hit rate per channel
+	int statistics;			// SIM_*
+	double speed;			// board seconds per wall clock second, 0 as fast as read
+	double loss_rate;		// probability that a group is lost before the DMA, flagged on the next packet
+	uint32_t rollover_period;	// TDC bins per rollover of the hit counter, at most 2^24
+	double binsize;			// ps per TDC bin
+	double packet_binsize;	// ps per bin of the packet timestamp
+	uint64_t seed;			// of card 0, card i starts from seed + i
+};
+
+void sim_get_parameters(sim_parameters* params);
+
+// Used by the cards from their next timetagger4_start_capture(), the bin sizes
+// and the rollover period from their next timetagger4_init()
+void sim_set_parameters(const sim_parameters* params);
+
+struct sim_replay {
+	std::string path;	// of the recording, empty to make groups
+	double speed;		// as sim_parameters::speed, 1 at the pacing of the recording
+	bool loop;			// start over at the end of the file, else no more data
+};
+
+void sim_get_replay(sim_replay* replay);
+
+// Used by the cards from their next timetagger4_init(), the file is opened by
+// every card and restarts with every timetagger4_start_capture(). Returns NULL
+// or the error if the file is not a recording.
+const char* sim_set_replay(const sim_replay* replay);
+
+#endif
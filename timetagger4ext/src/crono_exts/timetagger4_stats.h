@@ -0,0 +1,167 @@
+// Accounting of the data loss the packets report
+//
+// Every read is scanned once, right after timetagger4_read(), for the packet
+// flags and for gaps in the packet timestamps. With a periodic start the gaps
+// reveal groups that were dropped before they reached the host buffer. The
+// counters are atomics, so they can be read at any time without the device lock.
+//
+// The fill level of the host buffer is estimated from positions: the end of the
+// last read is about where the board writes, the end of the last acknowledged
+// packet is where the free space begins. Their distance around the ring of
+// total_buffer bytes is the data waiting in the buffer. The streaming thread
+// acknowledges each read at once, for it the fill right after scan() is the
+// data the read found waiting.
+
+#ifndef TIMETAGGER4_STATS_H
+#define TIMETAGGER4_STATS_H
+
+#include <stdint.h>
+#include <atomic>
+#include <algorithm>
+#include "TimeTagger4_interface.h"
+#include "timetagger4_batch.h"
+
+// number of TIMETAGGER4_PACKET_FLAG_* bits counted, one counter per bit
+#define STATS_FLAG_BITS 8
+
+// Index into packet_stats::flags of the counter of a single flag bit
+constexpr int flag_bit(uint32_t flag) {
+	return flag > 1 ? 1 + flag_bit(flag >> 1) : 0;
+}
+
+// counters of the flags that report data loss, named in stats()
+static_assert(flag_bit(TIMETAGGER4_PACKET_FLAG_HOST_BUFFER_FULL) < STATS_FLAG_BITS &&
+	flag_bit(TIMETAGGER4_PACKET_FLAG_DMA_FIFO_FULL) < STATS_FLAG_BITS &&
+	flag_bit(TIMETAGGER4_PACKET_FLAG_SHORTENED) < STATS_FLAG_BITS &&
+	flag_bit(TIMETAGGER4_PACKET_FLAG_START_MISSED) < STATS_FLAG_BITS &&
+	flag_bit(TIMETAGGER4_PACKET_FLAG_SLOW_SYNC) < STATS_FLAG_BITS, "a data loss flag has no counter");
+
+// Groups missing between two packets, group_period is the expected distance of
+// the packet timestamps, 0 if the starts are not periodic
+inline uint32_t inferred_gap(int64_t previous, int64_t timestamp, int64_t group_period) {
+	if (group_period <= 0 || previous < 0 || timestamp <= previous)
+		return 0;
+	int64_t periods = (timestamp - previous + group_period / 2) / group_period;
+	return periods > 1 ? (uint32_t)(periods - 1) : 0;
+}
+
+class packet_stats {
+public:
+	packet_stats() : buffer_bytes(0), fill_bytes(0), peak_fill_bytes(0), read_end(0), acknowledged_end(0) { reset(); }
+
+	std::atomic<uint64_t> reads;
+	std::atomic<uint64_t> packets;
+	std::atomic<uint64_t> hit_words;
+	std::atomic<uint64_t> flags[STATS_FLAG_BITS];	// packets with flag bit i set
+	std::atomic<uint64_t> groups_dropped;			// inferred from timestamp gaps
+	std::atomic<uint64_t> gaps;						// places where groups were dropped
+	std::atomic<uint64_t> groups_paused;			// skipped while capture was paused, not dropped
+	std::atomic<int64_t> buffer_bytes;				// total_buffer of the board, 0 if unknown
+	std::atomic<int64_t> fill_bytes;				// estimated bytes waiting in the buffer
+	std::atomic<int64_t> peak_fill_bytes;			// largest fill_bytes since reset()
+
+	// Counts the packets of one read. Called in read order under the device lock.
+	void scan(volatile crono_packet* first, volatile crono_packet* last, int64_t group_period) {
+		uint64_t packet_count = 0;
+		uint64_t word_count = 0;
+		uint64_t flag_count[STATS_FLAG_BITS] = { 0 };
+		uint64_t dropped = 0;
+		uint64_t gap_count = 0;
+		uint64_t paused = 0;
+		for (volatile crono_packet* p = first; p <= last; p = crono_next_packet(p)) {
+			packet_count++;
+			word_count += packet_hit_count(p);
+			uint32_t packet_flags = p->flags;
+			for (int bit = 0; bit < STATS_FLAG_BITS; bit++)
+				flag_count[bit] += (packet_flags >> bit) & 1;
+			uint32_t gap = inferred_gap(last_timestamp, p->timestamp, group_period);
+			if (pause_pending)
+				paused += gap;
+			else {
+				dropped += gap;
+				gap_count += gap != 0;
+			}
+			pause_pending = false;
+			last_timestamp = p->timestamp;
+		}
+		if (last) {
+			if (!acknowledged_end)
+				acknowledged_end = (uintptr_t)first;
+			read_end = (uintptr_t)crono_next_packet(last);
+			update_fill();
+		}
+		// one atomic add per counter and read, not per packet
+		reads.fetch_add(1, std::memory_order_relaxed);
+		packets.fetch_add(packet_count, std::memory_order_relaxed);
+		hit_words.fetch_add(word_count, std::memory_order_relaxed);
+		for (int bit = 0; bit < STATS_FLAG_BITS; bit++) {
+			if (flag_count[bit])
+				flags[bit].fetch_add(flag_count[bit], std::memory_order_relaxed);
+		}
+		if (dropped) {
+			groups_dropped.fetch_add(dropped, std::memory_order_relaxed);
+			gaps.fetch_add(gap_count, std::memory_order_relaxed);
+		}
+		if (paused)
+			groups_paused.fetch_add(paused, std::memory_order_relaxed);
+	}
+
+	// The buffer is free up to and including packet, under the device lock like scan()
+	void acknowledged(volatile crono_packet* packet) {
+		acknowledged_end = (uintptr_t)crono_next_packet(packet);
+		update_fill();
+	}
+
+	// The gap before the next packet comes from a pause of the capture
+	void expect_pause_gap() {
+		pause_pending = true;
+	}
+
+	// Sets the size of the ring, 0 if unknown, under the device lock like scan()
+	void set_buffer_size(int64_t bytes) {
+		buffer_bytes = bytes;
+	}
+
+	// Forgets the positions when the buffer goes away with the device
+	void clear_fill() {
+		acknowledged_end = 0;
+		read_end = 0;
+		fill_bytes = 0;
+	}
+
+	// Clears the counters, under the device lock like scan()
+	void reset() {
+		reads = 0;
+		packets = 0;
+		hit_words = 0;
+		for (int bit = 0; bit < STATS_FLAG_BITS; bit++)
+			flags[bit] = 0;
+		groups_dropped = 0;
+		gaps = 0;
+		groups_paused = 0;
+		last_timestamp = -1;
+		pause_pending = false;
+		peak_fill_bytes = fill_bytes.load();
+	}
+
+private:
+	void update_fill() {
+		int64_t fill = 0;
+		if (read_end >= acknowledged_end)
+			fill = (int64_t)(read_end - acknowledged_end);
+		// the data wraps around the end of the ring
+		else if (buffer_bytes > 0)
+			fill = buffer_bytes - (int64_t)(acknowledged_end - read_end);
+		fill = std::max<int64_t>(fill, 0);
+		fill_bytes.store(fill, std::memory_order_relaxed);
+		if (fill > peak_fill_bytes.load(std::memory_order_relaxed))
+			peak_fill_bytes.store(fill, std::memory_order_relaxed);
+	}
+
+	int64_t last_timestamp;		// timestamp of the last packet scanned, -1 if none
+	bool pause_pending;			// the next gap is counted in groups_paused
+	uintptr_t read_end;			// end of the last packet read, 0 if none
+	uintptr_t acknowledged_end;	// end of the last packet acknowledged, else the start of the first read
+};
+
+#endif
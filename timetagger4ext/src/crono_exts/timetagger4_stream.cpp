@@ -0,0 +1,177 @@
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <system_error>
+#include "timetagger4_stream.h"
+#include "timetagger4_wait.h"
+
+batch_stream::batch_stream() :
+	batches_dropped(0), packets_dropped(0), stop_requested(false),
+	device(NULL), device_mutex(NULL), stats(NULL), last_timestamp(NULL), events(NULL), clock(NULL), pressure(NULL), shedding(NULL), recorder(NULL), mode(OUTPUT_NS) {
+	memset(&scale, 0, sizeof(scale));
+}
+
+batch_stream::~batch_stream() {
+	stop();
+	clear();
+}
+
+// Frees the queued batches, the caller is the consumer and the thread is stopped
+void batch_stream::clear() {
+	hit_batch batch;
+	while (queue.pop(batch))
+		batch_free(&batch);
+}
+
+const char* batch_stream::start(timetagger4_device* device, std::mutex* device_mutex, packet_stats* stats, int64_t* last_timestamp,
+	clock_events* events, const clock_correction* clock, backpressure* pressure,
+	load_shedding* shedding, packet_recorder* recorder, const batch_scale& scale, int mode, size_t capacity) {
+	std::lock_guard<std::mutex> control(control_mutex);
+	stop_thread();
+	clear();
+	queue.resize(capacity);
+	batches_dropped = 0;
+	packets_dropped = 0;
+	this->device = device;
+	this->device_mutex = device_mutex;
+	this->stats = stats;
+	this->last_timestamp = last_timestamp;
+	this->events = events;
+	this->clock = clock;
+	this->pressure = pressure;
+	this->shedding = shedding;
+	this->recorder = recorder;
+	this->scale = scale;
+	this->mode = mode;
+	stop_requested = false;
+	try {
+		thread = std::thread(&batch_stream::run, this);
+	}
+	catch (const std::system_error&) {
+		return "cannot create the streaming thread";
+	}
+	return NULL;
+}
+
+void batch_stream::stop() {
+	std::lock_guard<std::mutex> control(control_mutex);
+	stop_thread();
+}
+
+void batch_stream::stop_thread() {
+	if (!thread.joinable())
+		return;
+	stop_requested = true;
+	thread.join();
+}
+
+static double steady_seconds() {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Pauses or continues the board by the watermarks, under the device lock. backlog
+// is the data the last read found in the host buffer, the thread acknowledges
+// every read at once, so the fill left afterwards is no measure of it.
+void batch_stream::apply_pressure(int64_t backlog) {
+	size_t queued = queue.size();
+	int64_t fill = std::max(backlog, stats->fill_bytes.load(std::memory_order_relaxed));
+	if (pressure->should_pause(queued, queue.capacity(), fill, stats->buffer_bytes.load(std::memory_order_relaxed))) {
+		if (timetagger4_pause_capture(device) == CRONO_OK)
+			pressure->pause(steady_seconds());
+	}
+	else if (pressure->should_continue(queued, queue.capacity())) {
+		if (timetagger4_continue_capture(device) == CRONO_OK) {
+			pressure->resume(steady_seconds(), *last_timestamp);
+			stats->expect_pause_gap();
+		}
+	}
+}
+
+// With a shedding policy a batch that finds the queue full is shed whole, so the
+// shed counts stay complete. Returns false without a policy.
+bool batch_stream::shed_batch(hit_batch* batch) {
+	std::lock_guard<std::mutex> lock(*device_mutex);
+	batch_shed& shed = shedding->state;
+	if (shed.policy == SHED_NONE)
+		return false;
+	for (size_t i = 0; i < batch->packet_count; i++) {
+		shed.pending_groups += batch->meta[i].shed_groups;
+		shed.hits += batch->meta[i].hit_count;
+	}
+	shed.pending_groups += (uint32_t)batch->packet_count;
+	shed.groups += batch->packet_count;
+	batch_free(batch);
+	return true;
+}
+
+void batch_stream::run() {
+	timetagger4_read_in read_config;
+	// packets are acknowledged explicitly as soon as they are decoded
+	read_config.acknowledge_last_read = 0;
+	timetagger4_read_out read_data;
+	adaptive_wait wait(-1);
+
+	while (!stop_requested.load(std::memory_order_relaxed)) {
+		hit_batch batch;
+		batch_init(&batch, mode);
+		int status = CRONO_READ_NO_DATA;
+		bool ok = false;
+		int64_t backlog = 0;
+		{
+			std::lock_guard<std::mutex> lock(*device_mutex);
+			// with backpressure a full queue leaves the data in the host buffer
+			bool hold = pressure->enabled && queue.size() >= queue.capacity();
+			if (!hold) {
+				ok = batch_reserve(&batch, 0, 0);
+				status = timetagger4_read(device, &read_config, &read_data);
+			}
+			if (status == CRONO_OK) {
+				pressure->packets_read(read_data.first_packet->timestamp, scale.group_period);
+				stats->scan(read_data.first_packet, read_data.last_packet, scale.group_period);
+				// everything up to the end of this read waited in the buffer
+				backlog = stats->fill_bytes.load(std::memory_order_relaxed);
+				events->record(read_data.first_packet, read_data.last_packet, scale);
+				recorder->append(read_data.first_packet, read_data.last_packet);
+				scale.clock = *clock;
+				batch.last_timestamp = *last_timestamp;
+				shedding->update(queue.size(), queue.capacity());
+				batch.shed = shedding->state.policy != SHED_NONE ? &shedding->state : NULL;
+				if (ok)
+					ok = batch_append(&batch, read_data.first_packet, read_data.last_packet, &scale);
+				batch.shed = NULL;
+				*last_timestamp = read_data.last_packet->timestamp;
+				timetagger4_acknowledge(device, read_data.last_packet);
+				stats->acknowledged(read_data.last_packet);
+			}
+			else if (status == CRONO_READ_NO_DATA && !hold && pressure->paused) {
+				pressure->drained = true;
+			}
+			apply_pressure(backlog);
+		}
+		if (status != CRONO_OK) {
+			batch_free(&batch);
+			wait.next();
+			continue;
+		}
+		wait.reset();
+		// everything was shed, the counts go with the next packet kept
+		if (ok && batch.packet_count == 0) {
+			batch_free(&batch);
+			continue;
+		}
+		// without memory for the batch the data is lost like with a full queue
+		if (!ok || !queue.push(batch)) {
+			if (ok && shed_batch(&batch))
+				continue;
+			batches_dropped++;
+			packets_dropped += batch.packet_count;
+			batch_free(&batch);
+		}
+	}
+	// a paused board would stay paused for the reads after streaming
+	std::lock_guard<std::mutex> lock(*device_mutex);
+	if (pressure->paused && timetagger4_continue_capture(device) == CRONO_OK) {
+		pressure->resume(steady_seconds(), *last_timestamp);
+		stats->expect_pause_gap();
+	}
+}
@@ -0,0 +1,85 @@
+// Background acquisition thread
+//
+// The thread loops over timetagger4_read(), decodes every read into a
+// hit_batch, acknowledges the packets right away and pushes the batch into a
+// bounded SPSC queue that Python pops from. The card's host buffer is drained
+// at the speed of the driver regardless of what the interpreter is doing, unless
+// backpressure holds the data back in the host buffer and pauses the board.
+
+#ifndef TIMETAGGER4_STREAM_H
+#define TIMETAGGER4_STREAM_H
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include "TimeTagger4_interface.h"
+#include "timetagger4_batch.h"
+#include "timetagger4_clock.h"
+#include "timetagger4_pressure.h"
+#include "timetagger4_queue.h"
+#include "timetagger4_record.h"
+#include "timetagger4_stats.h"
+
+class batch_stream {
+public:
+	batch_stream();
+	~batch_stream();
+
+	// Starts the thread, device_mutex serializes its driver calls with other callers.
+	// Every read is counted in stats and its reference events go to clock_events.
+	// last_timestamp is the timestamp of the last packet handed out before, the
+	// thread updates it. clock is the correction of OUTPUT_PS, taken anew for
+	// every read. pressure decides when to pause the board and shedding what to
+	// leave out of the batches. recorder gets a raw copy of every read. All of them
+	// are guarded by device_mutex.
+	// capacity is the number of batches the queue holds before new ones are dropped.
+	// start() empties and resizes the queue, so the consumer calls it like pop(),
+	// never both at once. It joins a running thread, which is best left to stop()
+	// beforehand where the consumer can wait without blocking others.
+	// Returns NULL or the error if the thread cannot be created. Throws
+	// std::bad_alloc if the queue cannot be allocated.
+	const char* start(timetagger4_device* device, std::mutex* device_mutex, packet_stats* stats, int64_t* last_timestamp,
+		clock_events* events, const clock_correction* clock, backpressure* pressure,
+		load_shedding* shedding, packet_recorder* recorder, const batch_scale& scale, int mode, size_t capacity);
+
+	// Stops and joins the thread, batches still queued can be popped afterwards
+	void stop();
+
+	bool running() const { return thread.joinable(); }
+
+	// consumer side, returns false if no batch is ready
+	bool pop(hit_batch* batch) { return queue.pop(*batch); }
+	size_t queued() const { return queue.size(); }
+	size_t capacity() const { return queue.capacity(); }
+
+	// batches and packets that were decoded but found the queue full, without load shedding
+	std::atomic<uint64_t> batches_dropped;
+	std::atomic<uint64_t> packets_dropped;
+
+private:
+	void run();
+	void stop_thread();
+	void clear();
+	void apply_pressure(int64_t backlog);
+	bool shed_batch(hit_batch* batch);
+
+	spsc_queue<hit_batch> queue;
+	std::mutex control_mutex;	// start() and stop() against each other
+	std::thread thread;
+	std::atomic<bool> stop_requested;
+
+	timetagger4_device* device;
+	std::mutex* device_mutex;
+	packet_stats* stats;
+	int64_t* last_timestamp;
+	clock_events* events;
+	const clock_correction* clock;
+	backpressure* pressure;
+	load_shedding* shedding;
+	packet_recorder* recorder;
+	batch_scale scale;
+	int mode;
+};
+
+#endif
@@ -0,0 +1,65 @@
+// Adaptive waiting for data that arrives in bursts
+//
+// A poll loop calls next() each time it found nothing. The first polls follow
+// each other immediately, which catches data that is about to arrive without
+// any sleep latency. After that the pause between polls doubles from a few
+// microseconds up to a millisecond, so a longer wait costs no CPU time.
+
+#ifndef TIMETAGGER4_WAIT_H
+#define TIMETAGGER4_WAIT_H
+
+#include <chrono>
+#include <thread>
+
+class adaptive_wait {
+public:
+	// timeout in seconds, a negative timeout never expires
+	explicit adaptive_wait(double timeout) :
+		start(std::chrono::steady_clock::now()), forever(timeout < 0), polls(0) {
+		deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(forever ? 0.0 : timeout));
+		reset();
+	}
+
+	// Waits before the next poll.
+	// Returns false without waiting once the timeout has passed.
+	bool next() {
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (!forever && now >= deadline)
+			return false;
+		if (polls < SPIN_POLLS) {
+			polls++;
+			std::this_thread::yield();
+			return true;
+		}
+		std::chrono::steady_clock::duration pause = delay;
+		if (!forever && deadline - now < pause)
+			pause = deadline - now;
+		std::this_thread::sleep_for(pause);
+		const std::chrono::steady_clock::duration max_delay = std::chrono::microseconds(MAX_DELAY_US);
+		delay = delay * 2 < max_delay ? delay * 2 : max_delay;
+		return true;
+	}
+
+	// Starts over with busy polling, e.g. after data arrived
+	void reset() {
+		polls = 0;
+		delay = std::chrono::microseconds(MIN_DELAY_US);
+	}
+
+	// seconds since the wait was created
+	double waited() const {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+private:
+	enum { SPIN_POLLS = 64, MIN_DELAY_US = 2, MAX_DELAY_US = 1000 };
+
+	std::chrono::steady_clock::time_point start;
+	std::chrono::steady_clock::time_point deadline;
+	bool forever;
+	int polls;
+	std::chrono::steady_clock::duration delay;
+};
+
+#endif
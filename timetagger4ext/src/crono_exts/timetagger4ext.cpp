@@ -1,49 +1,404 @@
 #include <Python.h>
+#include <structmember.h>
 #include <numpy/arrayobject.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
 #include <chrono>
+#include <mutex>
+#include <new>
 #include <thread>
+#include <vector>
 #include "TimeTagger4_interface.h"
+#include "timetagger4_ack.h"
+#include "timetagger4_batch.h"
+#include "timetagger4_clock.h"
+#include "timetagger4_codec.h"
+#include "timetagger4_config.h"
+#include "timetagger4_decode.h"
+#include "timetagger4_hitfile.h"
+#include "timetagger4_merge.h"
+#include "timetagger4_pool.h"
+#include "timetagger4_rawfile.h"
+#include "timetagger4_record.h"
+#ifdef TIMETAGGER4_SIM
+#include "timetagger4_sim.h"
+#endif
+#include "timetagger4_stats.h"
+#include "timetagger4_stream.h"
+#include "timetagger4_wait.h"
+// the same sources build the module on the driver and on the simulated board
+#ifdef TIMETAGGER4_SIM
+#define MODULE_NAME "timetagger4sim"
+#define MODULE_INIT PyInit_timetagger4sim
+#else
+#define MODULE_NAME "timetagger4vector"
+#define MODULE_INIT PyInit_timetagger4vector
+#endif
 const bool USE_TIGER_START = true;	// if false, external signal must be provided on start; not applicable if continuous mode is enabled
 const bool USE_TIGER_STOPS = true; 	// if false please connect signals to some of channels A-D
 // Function declarations
 static PyObject* timetagger4vector_init(PyObject* self, PyObject* args);
 static PyObject* timetagger4vector_config(PyObject* self, PyObject* args);
+static PyObject* timetagger4vector_configure(PyObject* self, PyObject* args);
+static PyObject* timetagger4vector_buffer_size_for(PyObject* self, PyObject* args);
+static PyObject* timetagger4vector_get_config(PyObject* self, PyObject* args);
 static PyObject* timetagger4vector_start(PyObject* self, PyObject* args);
 static PyObject* timetagger4vector_stop(PyObject* self, PyObject* args);
 static PyObject* timetagger4vector_close(PyObject* self, PyObject* args);
 static PyObject* timetagger4vector_read(PyObject* self, PyObject* args);
+static PyObject* timetagger4vector_read_batch(PyObject* self, PyObject* args);
+static PyObject* timetagger4vector_read_channels(PyObject* self, PyObject* args);
+static PyObject* timetagger4vector_set_decode_kernel(PyObject* self, PyObject* args);
+static PyObject* timetagger4vector_start_streaming(PyObject* self, PyObject* args);
+static PyObject* timetagger4vector_stop_streaming(PyObject* self, PyObject* args);
+static PyObject* timetagger4vector_pop(PyObject* self, PyObject* args);
+static PyObject* timetagger4vector_streaming_info(PyObject* self, PyObject* args);
+static PyObject* timetagger4vector_set_backpressure(PyObject* self, PyObject* args);
+static PyObject* timetagger4vector_set_load_shedding(PyObject* self, PyObject* args);
+static PyObject* timetagger4vector_pause_log(PyObject* self, PyObject* args);
+static PyObject* timetagger4vector_record(PyObject* self, PyObject* args);
+static PyObject* timetagger4vector_stop_recording(PyObject* self, PyObject* args);
+static PyObject* timetagger4vector_recording_info(PyObject* self, PyObject* args);
+static PyObject* timetagger4vector_read_raw(PyObject* self, PyObject* args);
+static PyObject* timetagger4vector_read_into(PyObject* self, PyObject* args);
+static PyObject* timetagger4vector_pool_stats(PyObject* self, PyObject* args);
+static PyObject* timetagger4vector_set_pool_limit(PyObject* self, PyObject* args);
+static PyObject* timetagger4vector_stats(PyObject* self, PyObject* args);
+static PyObject* timetagger4vector_reset_stats(PyObject* self, PyObject* args);
+static PyTypeObject* create_packet_buffer_type();
+static int add_device_type(PyObject* module);
+static int add_merger_type(PyObject* module);
+static int add_clock_sync_type(PyObject* module);
+static int add_raw_file_type(PyObject* module);
+static int add_hit_writer_type(PyObject* module);
+static PyObject* timetagger4vector_load(PyObject* self, PyObject* args, PyObject* kwds);
+static PyObject* timetagger4vector_compress(PyObject* self, PyObject* args);
+static PyObject* timetagger4vector_decompress(PyObject* self, PyObject* args);
+#ifdef TIMETAGGER4_SIM
+static PyObject* timetagger4vector_simulate(PyObject* self, PyObject* args, PyObject* kwds);
+static PyObject* timetagger4vector_replay(PyObject* self, PyObject* args, PyObject* kwds);
+#endif
 
 // Method definitions
 static PyMethodDef TimeTagger4VectorMethods[] = {
-	{"init", timetagger4vector_init, METH_VARARGS, "Initialize the module"},
-	{"config", timetagger4vector_config, METH_VARARGS, "Configure the module"},
+	{"init", timetagger4vector_init, METH_VARARGS, "Initialize the module, optionally with a buffer size in bytes or \"auto\", hit_rate, stall_time[, group_rate]"},
+	{"buffer_size_for", timetagger4vector_buffer_size_for, METH_VARARGS, "Packet buffer size in bytes that holds stall_time seconds at hit_rate hits/s in group_rate packets/s, one packet per hit by default"},
+	{"config", timetagger4vector_config, METH_VARARGS, "Configure the module for TDC_MODE_GROUPED or TDC_MODE_CONTINUOUS"},
+	{"configure", timetagger4vector_configure, METH_VARARGS, "Change the configuration keys given in a dict, the board is only written if something changed"},
+	{"get_config", timetagger4vector_get_config, METH_VARARGS, "The configuration of the module as a dict"},
 	{"start", timetagger4vector_start, METH_VARARGS, "Start the module"},
 	{"stop", timetagger4vector_stop, METH_VARARGS, "Stop the module"},
 	{"close", timetagger4vector_close, METH_VARARGS, "Close the module"},
-	{"read", timetagger4vector_read, METH_VARARGS, "Read data from the module"},
+	{"read", timetagger4vector_read, METH_VARARGS, "Read data from the module, waits up to timeout seconds for min_packets packets"},
+	{"read_batch", timetagger4vector_read_batch, METH_VARARGS, "Read packets into one flat batch (values, offsets, meta), waits up to timeout seconds for min_packets packets"},
+	{"read_channels", timetagger4vector_read_channels, METH_VARARGS, "Like read_batch() but with one contiguous array per enabled TDC channel (values, offsets, meta)"},
+	{"set_decode_kernel", timetagger4vector_set_decode_kernel, METH_VARARGS, "Select the hit decoding kernel by name (avx512, avx2, scalar)"},
+	{"start_streaming", timetagger4vector_start_streaming, METH_VARARGS, "Start a native thread that reads and decodes into a queue of batches"},
+	{"stop_streaming", timetagger4vector_stop_streaming, METH_VARARGS, "Stop the streaming thread"},
+	{"pop", timetagger4vector_pop, METH_VARARGS, "Pop the next batch of the streaming thread, None if none is ready within timeout seconds"},
+	{"streaming_info", timetagger4vector_streaming_info, METH_VARARGS, "State of the streaming thread and its queue"},
+	{"set_backpressure", timetagger4vector_set_backpressure, METH_VARARGS, "Let the streaming thread pause the board instead of dropping data, enabled[, queue_high, queue_low, buffer_high] as fractions"},
+	{"set_load_shedding", timetagger4vector_set_load_shedding, METH_VARARGS, "Let the streaming thread shed data under load instead of dropping batches, policy[, n, high, low] with SHED_* policies and fractions of the queue"},
+	{"record", timetagger4vector_record, METH_VARARGS, "Copy the raw packets of every read to disk from a writer thread, path[, segment_size, block_size] in bytes"},
+	{"stop_recording", timetagger4vector_stop_recording, METH_VARARGS, "Write what is left of the recording and close it, returns recording_info()"},
+	{"recording_info", timetagger4vector_recording_info, METH_VARARGS, "State of the recording: bytes recorded, written and lost, segments, stalls and the first error"},
+	{"pause_log", timetagger4vector_pause_log, METH_VARARGS, "Pauses of the board by backpressure with the packet timestamps around each gap, clear removes the finished ones"},
+	{"read_raw", timetagger4vector_read_raw, METH_VARARGS, "Read packets as a zero-copy PacketBuffer, acknowledged when released, None if none arrive within timeout seconds"},
+	{"read_into", timetagger4vector_read_into, METH_VARARGS, "Decode into caller-provided (values, offsets, meta) buffers, int64 values in the given mode, returns (hits, packets, more)"},
+	{"pool_stats", timetagger4vector_pool_stats, METH_VARARGS, "Statistics of the pool recycling the buffers of decoded arrays"},
+	{"set_pool_limit", timetagger4vector_set_pool_limit, METH_VARARGS, "Set the maximum number of bytes the buffer pool keeps for reuse"},
+	{"stats", timetagger4vector_stats, METH_VARARGS, "Counters of packets read, packet flags and groups dropped, without taking the device lock"},
+	{"reset_stats", timetagger4vector_reset_stats, METH_VARARGS, "Set the counters of stats() to zero"},
+	{"load", (PyCFunction)(void(*)(void))timetagger4vector_load, METH_VARARGS | METH_KEYWORDS, "Load the hits with t0 <= time < t1 ps of the given channels from a hit file, reading only the chunks that hold some, as Hits"},
+	{"compress", timetagger4vector_compress, METH_VARARGS, "Compress a Batch with int64 values into bytes, delta and bit-packed"},
+	{"decompress", timetagger4vector_decompress, METH_VARARGS, "Restore the Batch of compress(), data[, mode] with mode OUTPUT_BINS or OUTPUT_PS as read"},
+#ifdef TIMETAGGER4_SIM
+	{"simulate", (PyCFunction)(void(*)(void))timetagger4vector_simulate, METH_VARARGS | METH_KEYWORDS, "Set what the simulated boards produce from their next start(), returns all parameters as a dict"},
+	{"replay", (PyCFunction)(void(*)(void))timetagger4vector_replay, METH_VARARGS | METH_KEYWORDS, "Replay the recording at path on the simulated boards from their next init(), speed 1 at its pacing, 0 as fast as read, None to simulate again"},
+#endif
 	{NULL, NULL, 0, NULL}
 };
 
 // Module definition
 static struct PyModuleDef timetagger4vector = {
 	PyModuleDef_HEAD_INIT,
-	"timetagger4vector",
+	MODULE_NAME,
 	"A CPython module for cronologic timetagger",
 	-1,
 	TimeTagger4VectorMethods
 };
 
+static PyArray_Descr* batch_meta_descr[3] = { NULL, NULL, NULL };
+
+// Result of read_batch(): hits of packet i are values[offsets[i]:offsets[i + 1]]
+static PyStructSequence_Field batch_fields[] = {
+	{"values", "hit times of all packets relative to the start of their group in ns or TDC bins, or absolute in ps"},
+	{"offsets", "int64 array of packet_count + 1 offsets into values"},
+	{"meta", "structured array with timestamp, flags, card, channel, hit_count, gap, shed_groups and shed_hits per packet"},
+	{"wait", "seconds the read waited for the data"},
+	{"channels", "uint8 array with the TDC channel of every hit in values"},
+	{NULL, NULL}
+};
+static PyStructSequence_Desc batch_desc = {
+	MODULE_NAME ".Batch",
+	"Packets of one read, decoded into contiguous arrays",
+	batch_fields,
+	3
+};
+static PyTypeObject BatchType;
+
+// Result of read_channels(): hits of channel channels[r] in packet i are values[r][offsets[r, i]:offsets[r, i + 1]]
+static PyStructSequence_Field channel_batch_fields[] = {
+	{"values", "tuple with one array of hit times per enabled TDC channel, in the units of the output mode"},
+	{"offsets", "int64 array of shape (len(channels), packet_count + 1) with the offsets into values[r]"},
+	{"meta", "structured array with timestamp, flags, card, channel, hit_count, gap, shed_groups and shed_hits per packet"},
+	{"wait", "seconds the read waited for the data"},
+	{"channels", "tuple with the TDC channel of every entry of values"},
+	{NULL, NULL}
+};
+static PyStructSequence_Desc channel_batch_desc = {
+	MODULE_NAME ".ChannelBatch",
+	"Packets of one read, decoded into one contiguous array per enabled TDC channel",
+	channel_batch_fields,
+	3
+};
+static PyTypeObject ChannelBatchType;
+
+// Result of Merger.pop(): the hits of all sources in time order
+static PyStructSequence_Field merged_fields[] = {
+	{"time", "int64 array of hit times in ps on the OUTPUT_PS timeline"},
+	{"card", "uint8 array with the card field of the packet of every hit"},
+	{"channel", "uint8 array with the TDC channel of every hit"},
+	{NULL, NULL}
+};
+static PyStructSequence_Desc merged_desc = {
+	MODULE_NAME ".Merged",
+	"Hits of several cards merged into one time-ordered stream",
+	merged_fields,
+	3
+};
+static PyTypeObject MergedType;
+
+// Result of load(): the hits of a hit file in a time range
+static PyStructSequence_Field hits_fields[] = {
+	{"time", "int64 array of hit times in ps"},
+	{"card", "uint8 array with the card field of the packet of every hit"},
+	{"channel", "uint8 array with the TDC channel of every hit"},
+	{"flags", "uint8 array with the flags of the packet of every hit"},
+	{"chunks_read", "chunks of the file that were read, the others were skipped by their index"},
+	{NULL, NULL}
+};
+static PyStructSequence_Desc hits_desc = {
+	MODULE_NAME ".Hits",
+	"Hits loaded from a hit file",
+	hits_fields,
+	4
+};
+static PyTypeObject HitsType;
+// zero-copy view of the packets of one read, created by create_packet_buffer_type()
+static PyTypeObject* PacketBufferType = NULL;
+
+static PyArray_Descr* create_batch_meta_descr(const char* timestamp_format) {
+	PyObject* fields = Py_BuildValue("[(ss)(ss)(ss)(ss)(ss)(ss)(ss)(ss)]",
+		"timestamp", timestamp_format, "flags", "u1", "card", "u1", "channel", "u1", "hit_count", "<u4", "gap", "<u4",
+		"shed_groups", "<u4", "shed_hits", "<u4");
+	if (!fields)
+		return NULL;
+	PyArray_Descr* descr = NULL;
+	int ok = PyArray_DescrAlignConverter(fields, &descr);
+	Py_DECREF(fields);
+	if (!ok)
+		return NULL;
+	// itemsize through the attribute, the descriptor struct differs between numpy 1.x and 2.x
+	PyObject* itemsize = PyObject_GetAttrString((PyObject*)descr, "itemsize");
+	long size = itemsize ? PyLong_AsLong(itemsize) : -1;
+	Py_XDECREF(itemsize);
+	if (size != (long)sizeof(batch_meta)) {
+		Py_DECREF(descr);
+		PyErr_SetString(PyExc_RuntimeError, "batch meta dtype does not match struct batch_meta");
+		return NULL;
+	}
+	return descr;
+}
+
 // Module initialization function
-PyMODINIT_FUNC PyInit_timetagger4vector(void) {
+PyMODINIT_FUNC MODULE_INIT(void) {
 	import_array();  // Initialize the NumPy C API
-	return PyModule_Create(&timetagger4vector);
+	batch_meta_descr[OUTPUT_NS] = create_batch_meta_descr("<f8");
+	if (!batch_meta_descr[OUTPUT_NS])
+		return NULL;
+	batch_meta_descr[OUTPUT_BINS] = create_batch_meta_descr("<i8");
+	if (!batch_meta_descr[OUTPUT_BINS])
+		return NULL;
+	// same layout, the timestamp is in ps instead of packet bins
+	batch_meta_descr[OUTPUT_PS] = batch_meta_descr[OUTPUT_BINS];
+	Py_INCREF(batch_meta_descr[OUTPUT_PS]);
+	if (PyStructSequence_InitType2(&BatchType, &batch_desc) < 0)
+		return NULL;
+	if (PyStructSequence_InitType2(&ChannelBatchType, &channel_batch_desc) < 0)
+		return NULL;
+	if (PyStructSequence_InitType2(&MergedType, &merged_desc) < 0)
+		return NULL;
+	if (PyStructSequence_InitType2(&HitsType, &hits_desc) < 0)
+		return NULL;
+
+	PyObject* module = PyModule_Create(&timetagger4vector);
+	if (!module)
+		return NULL;
+	Py_INCREF(&BatchType);
+	if (PyModule_AddObject(module, "Batch", (PyObject*)&BatchType) < 0) {
+		Py_DECREF(&BatchType);
+		Py_DECREF(module);
+		return NULL;
+	}
+	Py_INCREF(&ChannelBatchType);
+	if (PyModule_AddObject(module, "ChannelBatch", (PyObject*)&ChannelBatchType) < 0) {
+		Py_DECREF(&ChannelBatchType);
+		Py_DECREF(module);
+		return NULL;
+	}
+	PacketBufferType = create_packet_buffer_type();
+	if (!PacketBufferType) {
+		Py_DECREF(module);
+		return NULL;
+	}
+	Py_INCREF(PacketBufferType);
+	if (PyModule_AddObject(module, "PacketBuffer", (PyObject*)PacketBufferType) < 0) {
+		Py_DECREF(PacketBufferType);
+		Py_DECREF(module);
+		return NULL;
+	}
+	if (add_device_type(module) < 0 || add_merger_type(module) < 0 || add_clock_sync_type(module) < 0 ||
+		add_raw_file_type(module) < 0 || add_hit_writer_type(module) < 0) {
+		Py_DECREF(module);
+		return NULL;
+	}
+	Py_INCREF(batch_meta_descr[OUTPUT_NS]);
+	if (PyModule_AddObject(module, "batch_meta_dtype", (PyObject*)batch_meta_descr[OUTPUT_NS]) < 0) {
+		Py_DECREF(batch_meta_descr[OUTPUT_NS]);
+		Py_DECREF(module);
+		return NULL;
+	}
+	Py_INCREF(batch_meta_descr[OUTPUT_BINS]);
+	if (PyModule_AddObject(module, "batch_meta_bins_dtype", (PyObject*)batch_meta_descr[OUTPUT_BINS]) < 0) {
+		Py_DECREF(batch_meta_descr[OUTPUT_BINS]);
+		Py_DECREF(module);
+		return NULL;
+	}
+	// scale factors of OUTPUT_BINS, updated by config()
+	if (PyModule_AddIntConstant(module, "OUTPUT_NS", OUTPUT_NS) < 0 ||
+		PyModule_AddIntConstant(module, "OUTPUT_BINS", OUTPUT_BINS) < 0 ||
+		PyModule_AddIntConstant(module, "OUTPUT_PS", OUTPUT_PS) < 0 ||
+		PyModule_AddIntConstant(module, "TDC_MODE_GROUPED", TIMETAGGER4_TDC_MODE_GROUPED) < 0 ||
+		PyModule_AddIntConstant(module, "TDC_MODE_CONTINUOUS", TIMETAGGER4_TDC_MODE_CONTINUOUS) < 0 ||
+		PyModule_AddIntConstant(module, "CLOCK_GROUP_START", CLOCK_EVENTS_GROUP_START) < 0 ||
+		PyModule_AddIntConstant(module, "SHED_NONE", SHED_NONE) < 0 ||
+		PyModule_AddIntConstant(module, "SHED_DROP_GROUPS", SHED_DROP_GROUPS) < 0 ||
+		PyModule_AddIntConstant(module, "SHED_EVERY_NTH", SHED_EVERY_NTH) < 0 ||
+		PyModule_AddIntConstant(module, "SHED_FIRST_HITS", SHED_FIRST_HITS) < 0 ||
+		PyModule_AddIntConstant(module, "MIN_CONT_AUTO_TRIGGER_PERIOD", TIMETAGGER4_MIN_CONT_AUTO_TRIGGER_PERIOD) < 0 ||
+		PyModule_AddIntConstant(module, "MAX_CONT_AUTO_TRIGGER_PERIOD", TIMETAGGER4_MAX_CONT_AUTO_TRIGGER_PERIOD) < 0 ||
+		PyModule_AddIntConstant(module, "TRIGGER_S", TIMETAGGER4_TRIGGER_S) < 0 ||
+		PyModule_AddIntConstant(module, "TRIGGER_A", TIMETAGGER4_TRIGGER_A) < 0 ||
+		PyModule_AddIntConstant(module, "TRIGGER_B", TIMETAGGER4_TRIGGER_B) < 0 ||
+		PyModule_AddIntConstant(module, "TRIGGER_C", TIMETAGGER4_TRIGGER_C) < 0 ||
+		PyModule_AddIntConstant(module, "TRIGGER_D", TIMETAGGER4_TRIGGER_D) < 0 ||
+		PyModule_AddIntConstant(module, "TRIGGER_SOURCE_S", TIMETAGGER4_TRIGGER_SOURCE_S) < 0 ||
+		PyModule_AddIntConstant(module, "TRIGGER_SOURCE_A", TIMETAGGER4_TRIGGER_SOURCE_A) < 0 ||
+		PyModule_AddIntConstant(module, "TRIGGER_SOURCE_B", TIMETAGGER4_TRIGGER_SOURCE_B) < 0 ||
+		PyModule_AddIntConstant(module, "TRIGGER_SOURCE_C", TIMETAGGER4_TRIGGER_SOURCE_C) < 0 ||
+		PyModule_AddIntConstant(module, "TRIGGER_SOURCE_D", TIMETAGGER4_TRIGGER_SOURCE_D) < 0 ||
+		PyModule_AddIntConstant(module, "TRIGGER_SOURCE_AUTO", TIMETAGGER4_TRIGGER_SOURCE_AUTO) < 0 ||
+		PyModule_AddIntConstant(module, "tdc_mode", TIMETAGGER4_TDC_MODE_GROUPED) < 0 ||
+		PyModule_AddObject(module, "binsize", PyFloat_FromDouble(0.0)) < 0 ||
+		PyModule_AddObject(module, "packet_binsize", PyFloat_FromDouble(0.0)) < 0 ||
+		PyModule_AddIntConstant(module, "rollover_period", 0) < 0 ||
+		PyModule_AddStringConstant(module, "decode_kernel", decode_init()) < 0) {
+		Py_DECREF(module);
+		return NULL;
+	}
+#ifdef TIMETAGGER4_SIM
+	if (PyModule_AddIntConstant(module, "SIM_POISSON", SIM_POISSON) < 0 ||
+		PyModule_AddIntConstant(module, "SIM_PERIODIC", SIM_PERIODIC) < 0) {
+		Py_DECREF(module);
+		return NULL;
+	}
+#endif
+	return module;
 }
 
-timetagger4_device* device;
-timetagger4_static_info static_info;
-timetagger4_param_info parinfo;
+// Default parameters of Device() and of the module's default device
+const int DEFAULT_CARD_INDEX = 0;
+const int DEFAULT_BOARD_ID = 0;
+const unsigned long long DEFAULT_BUFFER_SIZE = 8 * 1024 * 1024;
+// bounds of the "auto" buffer size of init()
+const double MIN_AUTO_BUFFER_MIB = 1.0;
+const double MAX_AUTO_BUFFER_BYTES = 1099511627776.0;
+// ClockSync defaults, 1 us pairing tolerance and a fit over about the last 1000 pulses
+const long long DEFAULT_CLOCK_TOLERANCE = 1000000;
+const double DEFAULT_CLOCK_HALF_LIFE = 1000.0;
+
+// Everything one board needs: handle, info structs and read state.
+// Each Device owns one, so several boards acquire in parallel, each under its own mutex.
+struct device_state {
+	device_state(int card_index, int board_id, unsigned long long buffer_size) :
+		card_index(card_index), board_id(board_id), buffer_size(buffer_size), device(NULL),
+		tdc_mode(TIMETAGGER4_TDC_MODE_GROUPED), group_period(0), configured(false), last_wait(0.0),
+		leftover_first(NULL), leftover_last(NULL), decoded_timestamp(-1) {
+		memset(&static_info, 0, sizeof(static_info));
+		memset(&parinfo, 0, sizeof(parinfo));
+		memset(&config, 0, sizeof(config));
+		memset(&clock, 0, sizeof(clock));
+	}
+
+	int card_index;		// which of the TimeTagger4 boards found in the system is used
+	int board_id;		// value copied to the "card" field of every packet
+	unsigned long long buffer_size;
+	timetagger4_device* device;	// NULL until init() and after close()
+	timetagger4_static_info static_info;
+	timetagger4_param_info parinfo;
+	int tdc_mode;
+	// packet bins between two starts of the auto trigger, 0 if the starts are not periodic
+	int64_t group_period;
+	// what the board was configured with, valid if configured
+	timetagger4_configuration config;
+	bool configured;
+	// seconds the last read waited, only accessed with the GIL
+	double last_wait;
+
+	// serializes the driver calls, they run without the GIL
+	std::mutex device_mutex;
+	// native acquisition thread of start_streaming()
+	batch_stream stream;
+	// reads not acknowledged yet, guarded by device_mutex
+	ack_ledger acks;
+	// packets of the last read that read_into() had no room for, guarded by device_mutex
+	volatile crono_packet* leftover_first;
+	volatile crono_packet* leftover_last;
+	// flags and gaps of all packets read, scanned under device_mutex, read without it
+	packet_stats read_stats;
+	// timestamp of the last packet handed out in read order, the gap of the next one
+	// is relative to it. Guarded by device_mutex, -1 if unknown.
+	int64_t decoded_timestamp;
+	// raw times of the reference signal for a ClockSync, guarded by device_mutex
+	clock_events reference_events;
+	// correction of OUTPUT_PS onto the reference timeline, guarded by device_mutex
+	clock_correction clock;
+	// pauses of the board by the streaming thread, guarded by device_mutex
+	backpressure pressure;
+	// what the streaming thread leaves out of the batches under load, guarded by device_mutex
+	load_shedding shedding;
+	// raw copy of every read to disk, appended to under device_mutex
+	packet_recorder recorder;
+};
+
+// Python object of one board, state is NULL until __init__ ran
+struct DeviceObject {
+	PyObject_HEAD
+	device_state* state;
+};
 
 
 void print_device_information(timetagger4_device* device, timetagger4_static_info* si, timetagger4_param_info* pi) {
@@ -57,244 +412,3218 @@ void print_device_information(timetagger4_device* device, timetagger4_static_inf
 	printf("\nTDC binsize         : %0.2f ps\n", pi->binsize);
 }
 
+// State of a Device, NULL with an exception set if __init__ did not run
+static device_state* device_of(DeviceObject* self) {
+	if (!self->state)
+		PyErr_SetString(PyExc_RuntimeError, "Device.__init__() was not called");
+	return self->state;
+}
+
+// State of a Device whose board is initialized, NULL with an exception set otherwise
+static device_state* open_device(DeviceObject* self) {
+	device_state* d = device_of(self);
+	if (d && !d->device) {
+		PyErr_SetString(PyExc_RuntimeError, "device is not initialized, call init() first");
+		return NULL;
+	}
+	return d;
+}
+
+// Packet buffer that holds stall_time seconds of data, hit_rate hits in group_rate
+// packets per second, and as much again for the data being processed. A packet
+// takes a 16 byte header, 4 bytes per hit and up to 4 bytes of padding.
+static unsigned long long auto_buffer_size(double hit_rate, double stall_time, double group_rate) {
+	double bytes = 2.0 * stall_time * (hit_rate * 4.0 + group_rate * 20.0);
+	double mib = ceil(bytes / (1024.0 * 1024.0));
+	if (mib < MIN_AUTO_BUFFER_MIB)
+		mib = MIN_AUTO_BUFFER_MIB;
+	return (unsigned long long)mib * 1024 * 1024;
+}
+
+// Parses the optional (hit_rate, stall_time, group_rate) of the "auto" policy, the
+// group rate defaults to one packet per hit. Returns 0 with an exception set on bad input.
+static unsigned long long parse_auto_buffer_size(double hit_rate, double stall_time, double group_rate) {
+	if (group_rate < 0)
+		group_rate = hit_rate;
+	if (!(hit_rate > 0) || !(stall_time > 0) || !isfinite(hit_rate) || !isfinite(stall_time) || !isfinite(group_rate)) {
+		PyErr_SetString(PyExc_ValueError, "the auto buffer size needs a positive hit_rate and stall_time");
+		return 0;
+	}
+	if (2.0 * stall_time * (hit_rate * 4.0 + group_rate * 20.0) > MAX_AUTO_BUFFER_BYTES) {
+		PyErr_SetString(PyExc_ValueError, "the auto buffer size exceeds 1 TiB");
+		return 0;
+	}
+	return auto_buffer_size(hit_rate, stall_time, group_rate);
+}
+
 // Function implementations
-static PyObject* timetagger4vector_init(PyObject* self, PyObject* args) {
+static PyObject* Device_init(DeviceObject* self, PyObject* args) {
+	PyObject* size = Py_None;
+	double hit_rate = 0.0;
+	double stall_time = 0.0;
+	double group_rate = -1.0;
+	if (!PyArg_ParseTuple(args, "|Oddd", &size, &hit_rate, &stall_time, &group_rate))
+		return NULL;
+	device_state* d = device_of(self);
+	if (!d)
+		return NULL;
+	if (d->device) {
+		PyErr_SetString(PyExc_RuntimeError, "device is already initialized");
+		return NULL;
+	}
+	// None keeps the buffer size of the Device, "auto" sizes it for a stall at the given rate
+	unsigned long long buffer_size = d->buffer_size;
+	if (PyUnicode_Check(size)) {
+		if (PyUnicode_CompareWithASCIIString(size, "auto") != 0) {
+			PyErr_SetString(PyExc_ValueError, "buffer_size must be a number of bytes or \"auto\"");
+			return NULL;
+		}
+		buffer_size = parse_auto_buffer_size(hit_rate, stall_time, group_rate);
+		if (buffer_size == 0)
+			return NULL;
+	}
+	else if (size != Py_None) {
+		buffer_size = PyLong_AsUnsignedLongLong(size);
+		if (buffer_size == (unsigned long long)-1 && PyErr_Occurred())
+			return NULL;
+		if (buffer_size == 0) {
+			PyErr_SetString(PyExc_ValueError, "buffer_size must be positive or \"auto\"");
+			return NULL;
+		}
+	}
+	d->buffer_size = buffer_size;
 	// prepare initialization
 	timetagger4_init_parameters params;
 
 	timetagger4_get_default_init_parameters(&params);
-	params.buffer_size[0] = 8 * 1024 * 1024;				// size of the packet buffer
-	params.board_id = 0;							// value copied to "card" field of every packet, allowed range 0..255
-	params.card_index = 0;						// which of the TimeTagger4 board found in the system to be used
+	params.buffer_size[0] = d->buffer_size;		// size of the packet buffer
+	params.board_id = d->board_id;				// value copied to "card" field of every packet, allowed range 0..255
+	params.card_index = d->card_index;			// which of the TimeTagger4 board found in the system to be used
 
 	int error_code;
 	const char* err_message;
+	timetagger4_device* device;
+	// other boards keep acquiring while this one initializes
+	Py_BEGIN_ALLOW_THREADS
 	device = timetagger4_init(&params, &error_code, &err_message);
+	Py_END_ALLOW_THREADS
 	if (error_code != CRONO_OK) {
-		printf("Could not init TimeTagger4 compatible board: %s\n", err_message);
+		printf("Could not init TimeTagger4 compatible board %d: %s\n", d->card_index, err_message);
 		return PyLong_FromLong(error_code);
 	}
-	timetagger4_static_info static_info;
-	timetagger4_get_static_info(device, &static_info);
+	timetagger4_get_static_info(device, &d->static_info);
+	d->configured = false;
+	{
+		std::lock_guard<std::mutex> lock(d->device_mutex);
+		d->device = device;
+	}
 	return PyLong_FromLong(TIMETAGGER4_OK);
 }
 
-static PyObject* timetagger4vector_config(PyObject* self, PyObject* args) {
+// reading from Python and the streaming thread would split the data between them
+static bool check_not_streaming(device_state* d) {
+	if (d->stream.running()) {
+		PyErr_SetString(PyExc_RuntimeError, "streaming is active, use pop() to get data");
+		return false;
+	}
+	return true;
+}
+
+// Writes config to the board unless the board has it already, and updates the
+// scale factors. Returns the driver status.
+static int configure_device(device_state* d, timetagger4_configuration* config) {
+	if (d->configured && memcmp(config, &d->config, sizeof(*config)) == 0)
+		return TIMETAGGER4_OK;
+	int status;
+	{
+		std::lock_guard<std::mutex> lock(d->device_mutex);
+		status = timetagger4_configure(d->device, config);
+	}
+	if (status != TIMETAGGER4_OK) {
+		const char* err_message = timetagger4_get_last_error_message(d->device);
+		printf("Could not configure TimeTagger4 compatible board: %s\n", err_message);
+		// the board may be configured partly, the next configure() writes again
+		d->configured = false;
+		return status;
+	}
+	d->config = *config;
+	d->configured = true;
+	timetagger4_get_static_info(d->device, &d->static_info);
+	timetagger4_get_param_info(d->device, &d->parinfo);
+	{
+		std::lock_guard<std::mutex> lock(d->device_mutex);
+		d->read_stats.set_buffer_size(d->parinfo.total_buffer);
+	}
+	// with a fixed period, gaps in the packet timestamps reveal dropped groups
+	d->group_period = config_group_period(config, &d->static_info, &d->parinfo);
+	d->tdc_mode = config->tdc_mode;
+	return TIMETAGGER4_OK;
+}
+
+// The writer thread starts and stops under the device lock without the GIL
+static bool recording_active(device_state* d) {
+	std::lock_guard<std::mutex> lock(d->device_mutex);
+	return d->recorder.active();
+}
+
+// A configure() while streaming would leave the thread decoding with the old scale factors,
+// one while recording the file header
+static device_state* device_to_configure(DeviceObject* self) {
+	device_state* d = open_device(self);
+	if (!d || !check_not_streaming(d))
+		return NULL;
+	if (recording_active(d)) {
+		PyErr_SetString(PyExc_RuntimeError, "recording is active, call stop_recording() first");
+		return NULL;
+	}
+	return d;
+}
+
+static PyObject* Device_config(DeviceObject* self, PyObject* args) {
+	int tdc_mode = TIMETAGGER4_TDC_MODE_GROUPED;
+	if (!PyArg_ParseTuple(args, "|i", &tdc_mode))
+		return NULL;
+	device_state* d = device_to_configure(self);
+	if (!d)
+		return NULL;
+	if (tdc_mode != TIMETAGGER4_TDC_MODE_GROUPED && tdc_mode != TIMETAGGER4_TDC_MODE_CONTINUOUS) {
+		PyErr_SetString(PyExc_ValueError, "tdc_mode must be TDC_MODE_GROUPED or TDC_MODE_CONTINUOUS");
+		return NULL;
+	}
+
 	// prepare configuration
-	timetagger4_static_info static_info;
-	timetagger4_get_static_info(device, &static_info);
+	timetagger4_get_static_info(d->device, &d->static_info);
 	timetagger4_configuration config;
 	// fill configuration data structure with default values
 	// so that the configuration is valid and only parameters
 	// of interest have to be set explicitly
-	timetagger4_get_default_configuration(device, &config);
+	timetagger4_get_default_configuration(d->device, &config);
+	config_example(&config, &d->static_info, tdc_mode, USE_TIGER_START, USE_TIGER_STOPS);
 
-	// set config of the 4 TDC channels
-	for (int i = 0; i < TIMETAGGER4_TDC_CHANNEL_COUNT; i++)
-	{
-		// enable recording hits on TDC channel
-		config.channel[i].enabled = true;
+	// write configuration to board
+	int status = configure_device(d, &config);
+	if (status != TIMETAGGER4_OK)
+		return PyLong_FromLong(status);
+
+	print_device_information(d->device, &d->static_info, &d->parinfo);
+	return PyLong_FromLong(TIMETAGGER4_OK);
 
-		// define range of the group
-		config.channel[i].start = 0;	// range begins right after start pulse
+}
 
-		config.channel[i].stop = 30000;	// recording window stops after ~15 us
+static PyObject* config_value_to_python(const char* p, config_type type) {
+	switch (type) {
+	case CONFIG_BOOL:
+		return PyBool_FromLong(*(const crono_bool_t*)p);
+	case CONFIG_INT:
+		return PyLong_FromLong(*(const int*)p);
+	case CONFIG_UINT32:
+		return PyLong_FromUnsignedLong(*(const uint32_t*)p);
+	default:
+		return PyFloat_FromDouble(*(const double*)p);
+	}
+}
 
+// Stores value at p, raises TypeError or OverflowError if it does not fit the type
+static bool config_value_from_python(char* p, config_type type, PyObject* value, const char* name) {
+	if (type == CONFIG_DOUBLE) {
+		double v = PyFloat_AsDouble(value);
+		if (v == -1.0 && PyErr_Occurred())
+			return false;
+		*(double*)p = v;
+		return true;
+	}
+	if (!PyLong_Check(value)) {
+		PyErr_Format(PyExc_TypeError, "%s must be an int or bool", name);
+		return false;
+	}
+	long long v = PyLong_AsLongLong(value);
+	if (v == -1 && PyErr_Occurred())
+		return false;
+	switch (type) {
+	case CONFIG_BOOL:
+		*(crono_bool_t*)p = v != 0;
+		return true;
+	case CONFIG_INT:
+		if (v < INT32_MIN || v > INT32_MAX)
+			break;
+		*(int*)p = (int)v;
+		return true;
+	default:
+		if (v < 0 || v > UINT32_MAX)
+			break;
+		*(uint32_t*)p = (uint32_t)v;
+		return true;
+	}
+	PyErr_Format(PyExc_OverflowError, "%s is out of range", name);
+	return false;
+}
 
-		// measure only rising edge for tiger (positive) pulse or falling for user (negative) pulse
-		config.trigger[TIMETAGGER4_TRIGGER_A + i].falling = USE_TIGER_STOPS ? 0 : 1;
-		config.trigger[TIMETAGGER4_TRIGGER_A + i].rising = USE_TIGER_STOPS ? 1 : 0;
+static const config_field* find_config_field(const config_field* fields, PyObject* key) {
+	const char* name = PyUnicode_Check(key) ? PyUnicode_AsUTF8(key) : NULL;
+	if (name) {
+		for (const config_field* f = fields; f->name; f++) {
+			if (strcmp(f->name, name) == 0)
+				return f;
+		}
 	}
+	PyErr_Clear();
+	PyErr_Format(PyExc_KeyError, "unknown configuration key %R", key);
+	return NULL;
+}
 
-	// generate an internal 25 kHz trigger, used for tiger and continuous mode
-	config.auto_trigger_period = (int)(static_info.auto_trigger_ref_clock / 1000);
-	config.auto_trigger_random_exponent = 0;
+static PyObject* config_fields_to_dict(const char* base, const config_field* fields) {
+	PyObject* dict = PyDict_New();
+	if (!dict)
+		return NULL;
+	for (const config_field* f = fields; f->name; f++) {
+		PyObject* value = config_value_to_python(base + f->offset, f->type);
+		if (!value || PyDict_SetItemString(dict, f->name, value) < 0) {
+			Py_XDECREF(value);
+			Py_DECREF(dict);
+			return NULL;
+		}
+		Py_DECREF(value);
+	}
+	return dict;
+}
 
-	// setup TiGeR
-	// sending a signal to the LEMO outputs (and to the TDC on the same channel)
-	// requires proper 50 Ohm termination on the LEMO output to work reliably
+// Sets the fields named in dict, the others keep their value
+static bool config_fields_from_dict(char* base, const config_field* fields, PyObject* dict, const char* name) {
+	if (!PyDict_Check(dict)) {
+		PyErr_Format(PyExc_TypeError, "%s entries must be dicts", name);
+		return false;
+	}
+	PyObject* key;
+	PyObject* value;
+	Py_ssize_t pos = 0;
+	while (PyDict_Next(dict, &pos, &key, &value)) {
+		const config_field* f = find_config_field(fields, key);
+		if (!f || !config_value_from_python(base + f->offset, f->type, value, f->name))
+			return false;
+	}
+	return true;
+}
 
-	// width of the 12ns pulse in the auto_trigger clock periods
-	int pulse_width = (int)(12e-9 * static_info.auto_trigger_ref_clock);
+static PyObject* config_element_to_python(const char* element, const config_field* fields) {
+	if (!fields->name)
+		return config_value_to_python(element, fields->type);
+	return config_fields_to_dict(element, fields);
+}
 
+static bool config_element_from_python(char* element, const config_field* fields, PyObject* value, const char* name) {
+	if (!fields->name)
+		return config_value_from_python(element, fields->type, value, name);
+	return config_fields_from_dict(element, fields, value, name);
+}
 
-	// use 200 kHz auto trigger to generate
+// The configuration as a dict of plain values and lists
+static PyObject* config_to_dict(const timetagger4_configuration* config) {
+	const char* base = (const char*)config;
+	PyObject* dict = config_fields_to_dict(base, config_scalars);
+	if (!dict)
+		return NULL;
+	for (const config_array* a = config_arrays; a->name; a++) {
+		PyObject* list = PyList_New((Py_ssize_t)a->count);
+		if (!list || PyDict_SetItemString(dict, a->name, list) < 0) {
+			Py_XDECREF(list);
+			Py_DECREF(dict);
+			return NULL;
+		}
+		Py_DECREF(list);
+		for (size_t i = 0; i < a->count; i++) {
+			PyObject* element = config_element_to_python(base + a->offset + i * a->stride, a->fields);
+			if (!element) {
+				Py_DECREF(dict);
+				return NULL;
+			}
+			PyList_SET_ITEM(list, (Py_ssize_t)i, element);
+		}
+	}
+	return dict;
+}
 
-	// generate above configured auto trigger to generate a 
-	// signal with 12 ns pulse width on LEMO output Start
-	config.tiger_block[0].enable = USE_TIGER_START ? 1 : 0;
-	config.tiger_block[0].start = 0;
-	config.tiger_block[0].stop = config.tiger_block[0].start + pulse_width;
-	config.tiger_block[0].negate = 0;
-	config.tiger_block[0].retrigger = 0;
-	config.tiger_block[0].extend = 0;
-	config.tiger_block[0].enable_lemo_output = 1;
-	config.tiger_block[0].sources = TIMETAGGER4_TRIGGER_SOURCE_AUTO;
-	// if TiGeR is used for triggering with positive pulses
-	if (USE_TIGER_START)
-		config.dc_offset[0] = TIMETAGGER4_DC_OFFSET_P_LVCMOS_18;
-	else // user input expect NIM signal
-		config.dc_offset[0] = TIMETAGGER4_DC_OFFSET_N_NIM;
+// Updates one element of an array, index may be negative as in a list
+static bool config_array_item_from_python(char* base, const config_array* a, Py_ssize_t index, PyObject* value) {
+	if (index < 0)
+		index += (Py_ssize_t)a->count;
+	if (index < 0 || (size_t)index >= a->count) {
+		PyErr_Format(PyExc_IndexError, "%s index out of range", a->name);
+		return false;
+	}
+	return config_element_from_python(base + a->offset + (size_t)index * a->stride, a->fields, value, a->name);
+}
 
-	// start group on falling edges on the start channel 0
-	config.trigger[TIMETAGGER4_TRIGGER_S].falling = USE_TIGER_START ? 0 : 1;
-	config.trigger[TIMETAGGER4_TRIGGER_S].rising = USE_TIGER_START ? 1 : 0;
+// Updates an array from a sequence, None keeps an element, or from a dict of index: element
+static bool config_array_from_python(char* base, const config_array* a, PyObject* value) {
+	if (PyDict_Check(value)) {
+		PyObject* key;
+		PyObject* item;
+		Py_ssize_t pos = 0;
+		while (PyDict_Next(value, &pos, &key, &item)) {
+			Py_ssize_t index = PyNumber_AsSsize_t(key, PyExc_IndexError);
+			if (index == -1 && PyErr_Occurred())
+				return false;
+			if (!config_array_item_from_python(base, a, index, item))
+				return false;
+		}
+		return true;
+	}
+	PyObject* sequence = PySequence_Fast(value, "configuration arrays must be a sequence or a dict of index: entry");
+	if (!sequence)
+		return false;
+	bool ok = true;
+	Py_ssize_t count = PySequence_Fast_GET_SIZE(sequence);
+	if ((size_t)count > a->count) {
+		PyErr_Format(PyExc_ValueError, "%s has %d entries", a->name, (int)a->count);
+		ok = false;
+	}
+	for (Py_ssize_t i = 0; ok && i < count; i++) {
+		PyObject* item = PySequence_Fast_GET_ITEM(sequence, i);
+		if (item != Py_None)
+			ok = config_array_item_from_python(base, a, i, item);
+	}
+	Py_DECREF(sequence);
+	return ok;
+}
 
+// Applies the keys of dict to config, the members not named keep their value
+static bool config_from_dict(timetagger4_configuration* config, PyObject* dict) {
+	if (!PyDict_Check(dict)) {
+		PyErr_SetString(PyExc_TypeError, "the configuration must be a dict");
+		return false;
+	}
+	char* base = (char*)config;
+	PyObject* key;
+	PyObject* value;
+	Py_ssize_t pos = 0;
+	while (PyDict_Next(dict, &pos, &key, &value)) {
+		const char* name = PyUnicode_Check(key) ? PyUnicode_AsUTF8(key) : NULL;
+		const config_array* array = NULL;
+		for (const config_array* a = config_arrays; name && a->name; a++) {
+			if (strcmp(a->name, name) == 0)
+				array = a;
+		}
+		if (array) {
+			if (!config_array_from_python(base, array, value))
+				return false;
+			continue;
+		}
+		const config_field* f = find_config_field(config_scalars, key);
+		if (!f || !config_value_from_python(base + f->offset, f->type, value, f->name))
+			return false;
+	}
+	return true;
+}
 
-	for (int i = 1; i < TDC4_TIGER_COUNT; i++) {
-		config.tiger_block[i].enable = USE_TIGER_STOPS ? 1 : 0;
-		config.tiger_block[i].start = i * 100;
-		config.tiger_block[i].stop = config.tiger_block[i].start + pulse_width;
-		config.tiger_block[i].negate = 0;
-		config.tiger_block[i].retrigger = 0;
-		config.tiger_block[i].extend = 0;
-		config.tiger_block[i].enable_lemo_output = USE_TIGER_STOPS ? 1 : 0;
-		config.tiger_block[i].sources = TIMETAGGER4_TRIGGER_SOURCE_AUTO;
+static PyObject* Device_configure(DeviceObject* self, PyObject* args) {
+	PyObject* changes;
+	if (!PyArg_ParseTuple(args, "O!", &PyDict_Type, &changes))
+		return NULL;
+	device_state* d = device_to_configure(self);
+	if (!d)
+		return NULL;
+	// changes apply to what the board has, the driver defaults before the first configuration
+	timetagger4_configuration config;
+	if (d->configured)
+		config = d->config;
+	else
+		timetagger4_get_default_configuration(d->device, &config);
+	if (!config_from_dict(&config, changes))
+		return NULL;
+	const char* error = config_check(&config);
+	if (error) {
+		PyErr_SetString(PyExc_ValueError, error);
+		return NULL;
+	}
+	return PyLong_FromLong(configure_device(d, &config));
+}
 
+static PyObject* Device_get_config(DeviceObject* self, PyObject* args) {
+	device_state* d = open_device(self);
+	if (!d)
+		return NULL;
+	if (d->configured)
+		return config_to_dict(&d->config);
+	timetagger4_configuration config;
+	timetagger4_get_default_configuration(d->device, &config);
+	return config_to_dict(&config);
+}
 
-		if (USE_TIGER_STOPS)
-			config.dc_offset[i] = TIMETAGGER4_DC_OFFSET_P_LVCMOS_18;
-		else // user input expect NIM signal
-			config.dc_offset[i] = TIMETAGGER4_DC_OFFSET_N_NIM;
 
-		// this is not related to the tigers, but uses the same indexing (0 is start)
-		// optionally increase input delay by 10 * 200 ps for each channel on new TT		
-		// config.delay_config[i].delay = i * 10;
+static PyObject* Device_start(DeviceObject* self, PyObject* args) {
+	device_state* d = open_device(self);
+	if (!d)
+		return NULL;
+	int status;
+	Py_BEGIN_ALLOW_THREADS
+	{
+		std::lock_guard<std::mutex> lock(d->device_mutex);
+		// start data capture
+		status = d->device ? timetagger4_start_capture(d->device) : CRONO_INVALID_DEVICE;
+		if (status != CRONO_OK && d->device) {
+			printf("Could not start capturing %s", timetagger4_get_last_error_message(d->device));
+			timetagger4_close(d->device);
+			d->device = NULL;
+		}
+		else {
+			// start timing generator
+			timetagger4_start_tiger(d->device);
+		}
 	}
+	Py_END_ALLOW_THREADS
+	if (status != CRONO_OK)
+		return  PyLong_FromLong(status);
+	Py_RETURN_NONE;
+}
 
+static PyObject* Device_stop(DeviceObject* self, PyObject* args) {
+	device_state* d = open_device(self);
+	if (!d)
+		return NULL;
+	Py_BEGIN_ALLOW_THREADS
+	{
+		std::lock_guard<std::mutex> lock(d->device_mutex);
+		// shut down packet generation and DMA transfers
+		if (d->device)
+			timetagger4_stop_capture(d->device);
+	}
+	Py_END_ALLOW_THREADS
+	Py_RETURN_NONE;
 
+}
 
-	// write configuration to board
-	int status = timetagger4_configure(device, &config);
-	if (status != TIMETAGGER4_OK) {
-		const char* err_message = timetagger4_get_last_error_message(device);
-		printf("Could not init TimeTagger4 compatible board: %s\n", err_message);
+// Stops streaming and closes the board if it is open, called without the GIL.
+// Returns false and leaves the board open while packet buffers point into its DMA buffer.
+static bool device_close(device_state* d) {
+	d->stream.stop();
+	std::lock_guard<std::mutex> lock(d->device_mutex);
+	if (d->acks.outstanding() > 0)
+		return false;
+	d->recorder.stop();
+	// deactivate timetagger4
+	d->acks.clear();
+	d->read_stats.clear_fill();
+	d->leftover_first = NULL;
+	d->leftover_last = NULL;
+	d->decoded_timestamp = -1;
+	if (d->device)
+		timetagger4_close(d->device);
+	d->device = NULL;
+	return true;
+}
 
-		return PyLong_FromLong(status);
+static PyObject* Device_close(DeviceObject* self, PyObject* args) {
+	device_state* d = device_of(self);
+	if (!d)
+		return NULL;
+	bool closed;
+	Py_BEGIN_ALLOW_THREADS
+	closed = device_close(d);
+	Py_END_ALLOW_THREADS
+	if (!closed) {
+		// their views would point to the freed DMA buffer
+		PyErr_SetString(PyExc_RuntimeError, "release all packet buffers before close()");
+		return NULL;
 	}
-	timetagger4_get_static_info(device, &static_info);
+	Py_RETURN_NONE;
+
+}
 
-	timetagger4_get_param_info(device, &parinfo);
 
-	print_device_information(device, &static_info, &parinfo);
-	return PyLong_FromLong(TIMETAGGER4_OK);
+bool hasData = false;
 
+// Scale factors set by config(). The clock correction is left out, it changes
+// while reading; the OUTPUT_PS paths take it under device_mutex.
+static batch_scale current_scale(const device_state* d) {
+	batch_scale scale;
+	scale.rollover_period = d->static_info.rollover_period;
+	scale.binsize = d->parinfo.binsize;
+	scale.packet_binsize = d->parinfo.packet_binsize;
+	scale.group_period = d->group_period;
+	memset(&scale.clock, 0, sizeof(scale.clock));
+	return scale;
 }
 
-static PyObject* timetagger4vector_start(PyObject* self, PyObject* args) {
-	// start data capture
-	int status = timetagger4_start_capture(device);
-	if (status != CRONO_OK) {
-		printf("Could not start capturing %s", timetagger4_get_last_error_message(device));
-		timetagger4_close(device);
-		return  PyLong_FromLong(status);
+// Frees the DMA buffer up to and including packet, the caller holds device_mutex
+static void acknowledge(device_state* d, volatile crono_packet* packet) {
+	timetagger4_acknowledge(d->device, packet);
+	d->read_stats.acknowledged(packet);
+}
+
+// Gets the next packets: what read_into() left over, else a new read.
+// The caller holds device_mutex and acknowledges them through acks.
+static int fetch_packets(device_state* d, timetagger4_read_out* out) {
+	if (!d->device)
+		return CRONO_INVALID_DEVICE;
+	if (d->leftover_first) {
+		out->first_packet = d->leftover_first;
+		out->last_packet = d->leftover_last;
+		d->leftover_first = NULL;
+		d->leftover_last = NULL;
+		return CRONO_OK;
+	}
+	timetagger4_read_in read_config;
+	// acknowledged explicitly, packet buffers of earlier reads may still be in use
+	read_config.acknowledge_last_read = 0;
+	int status = timetagger4_read(d->device, &read_config, out);
+	if (status == CRONO_OK) {
+		d->read_stats.scan(out->first_packet, out->last_packet, d->group_period);
+		d->reference_events.record(out->first_packet, out->last_packet, current_scale(d));
+		d->recorder.append(out->first_packet, out->last_packet);
 	}
+	return status;
+}
 
-	// start timing generator
-	timetagger4_start_tiger(device);
-	Py_RETURN_NONE;
+// Reads until consume() holds at least min_packets packets or timeout seconds pass.
+// consume() gets every read under the device mutex and returns the number of
+// packets it holds so far, -1 to stop. Called without the GIL.
+// Returns the seconds spent waiting for the data.
+template <class Consume>
+static double read_packets(device_state* d, double timeout, int min_packets, Consume consume) {
+	adaptive_wait wait(timeout);
+	int held = 0;
+	for (;;) {
+		int now_held = held;
+		{
+			std::lock_guard<std::mutex> lock(d->device_mutex);
+			timetagger4_read_out packets;
+			if (fetch_packets(d, &packets) == CRONO_OK)
+				now_held = consume(&packets);
+		}
+		if (now_held < 0 || now_held >= min_packets)
+			break;
+		// more data is likely to follow a partial read
+		if (now_held > held)
+			wait.reset();
+		held = now_held;
+		if (!wait.next())
+			break;
+	}
+	return wait.waited();
 }
 
-static PyObject* timetagger4vector_stop(PyObject* self, PyObject* args) {
+static bool check_output_mode(int mode) {
+	if (mode != OUTPUT_NS && mode != OUTPUT_BINS && mode != OUTPUT_PS) {
+		PyErr_SetString(PyExc_ValueError, "mode must be OUTPUT_NS, OUTPUT_BINS or OUTPUT_PS");
+		return false;
+	}
+	return true;
+}
 
-	// shut down packet generation and DMA transfers
-	int status = timetagger4_stop_capture(device);
-	Py_RETURN_NONE;
+// how long the read functions wait for data by default, in seconds
+const double DEFAULT_READ_TIMEOUT = 0.01;
 
+// checks the timeout and min_packets arguments of the read functions
+static bool check_wait_args(double timeout, int min_packets) {
+	if (min_packets < 1) {
+		PyErr_SetString(PyExc_ValueError, "min_packets must be at least 1");
+		return false;
+	}
+	if (timeout != timeout) {
+		PyErr_SetString(PyExc_ValueError, "timeout must be a number of seconds");
+		return false;
+	}
+	return true;
 }
-static PyObject* timetagger4vector_close(PyObject* self, PyObject* args) {
-	// deactivate timetagger4
-	timetagger4_close(device);
-	Py_RETURN_NONE;
 
+static void free_buffer_capsule(PyObject* capsule) {
+	pool_free(PyCapsule_GetPointer(capsule, MODULE_NAME ".buffer"));
 }
 
+// C contiguous array of any shape over a pool buffer, like array_from_buffer()
+static PyObject* array_from_buffer_nd(void* data, int nd, npy_intp* dims, PyArray_Descr* descr) {
+	PyObject* capsule = PyCapsule_New(data, MODULE_NAME ".buffer", free_buffer_capsule);
+	if (!capsule) {
+		pool_free(data);
+		Py_DECREF(descr);
+		return NULL;
+	}
+	PyObject* array = PyArray_NewFromDescr(&PyArray_Type, descr, nd, dims, NULL, data, NPY_ARRAY_CARRAY, NULL);
+	if (!array) {
+		Py_DECREF(capsule);
+		return NULL;
+	}
+	// steals the capsule
+	if (PyArray_SetBaseObject((PyArrayObject*)array, capsule) < 0) {
+		Py_DECREF(array);
+		return NULL;
+	}
+	return array;
+}
 
-bool hasData = false;
-// structure with packet pointers for read data
-timetagger4_read_out read_data;
-static PyObject* timetagger4vector_read(PyObject* self, PyObject* args) {
-
-	// configure readout behaviour
-	timetagger4_read_in read_config;
-	// automatically acknowledge all data as processed
-	// on the next call to timetagger4_read()
-	// old packet pointers are invalid after calling timetagger4_read()
-	read_config.acknowledge_last_read = 1;
+// 1-d numpy array over a pool buffer, the array owns the buffer and returns it to the pool.
+// Steals the reference to descr, the buffer is freed on failure as well.
+static PyObject* array_from_buffer(void* data, npy_intp count, PyArray_Descr* descr) {
+	npy_intp dims[1] = { count };
+	return array_from_buffer_nd(data, 1, dims, descr);
+}
 
-	// Create a Python list to hold the NumPy arrays
-	PyObject* py_list = PyList_New(0);
-	if (!py_list) {
+// Hands the buffers of a decoded batch over to numpy arrays in a Batch
+static PyObject* batch_to_python(hit_batch* batch, double waited) {
+	PyObject* result = PyStructSequence_New(&BatchType);
+	if (!result) {
+		batch_free(batch);
 		return NULL;
 	}
+	PyObject* values = array_from_buffer(batch->values, (npy_intp)batch->hit_count,
+		PyArray_DescrFromType(batch->mode == OUTPUT_NS ? NPY_DOUBLE : NPY_INT64));
+	batch->values = NULL;
+	PyObject* offsets = array_from_buffer(batch->offsets, (npy_intp)batch->packet_count + 1, PyArray_DescrFromType(NPY_INT64));
+	batch->offsets = NULL;
+	Py_INCREF(batch_meta_descr[batch->mode]);
+	PyObject* meta = array_from_buffer(batch->meta, (npy_intp)batch->packet_count, batch_meta_descr[batch->mode]);
+	batch->meta = NULL;
+	PyObject* channels;
+	if (batch->channels) {
+		channels = array_from_buffer(batch->channels, (npy_intp)batch->hit_count, PyArray_DescrFromType(NPY_UINT8));
+		batch->channels = NULL;
+	}
+	else {
+		channels = Py_None;
+		Py_INCREF(channels);
+	}
+	batch_free(batch);
+	PyObject* wait = PyFloat_FromDouble(waited);
+	if (!values || !offsets || !meta || !wait || !channels) {
+		Py_XDECREF(values);
+		Py_XDECREF(offsets);
+		Py_XDECREF(meta);
+		Py_XDECREF(wait);
+		Py_XDECREF(channels);
+		Py_DECREF(result);
+		return NULL;
+	}
+	PyStructSequence_SetItem(result, 0, values);
+	PyStructSequence_SetItem(result, 1, offsets);
+	PyStructSequence_SetItem(result, 2, meta);
+	PyStructSequence_SetItem(result, 3, wait);
+	PyStructSequence_SetItem(result, 4, channels);
+	return result;
+}
 
-	// get pointers to acquired packets
-	int status = timetagger4_read(device, &read_config, &read_data);
-	if (status != CRONO_OK) {
-		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+// Hands the per-channel buffers and the meta of the flat batch over to a ChannelBatch,
+// both batches are empty afterwards
+static PyObject* channel_batch_to_python(channel_batch* channels, hit_batch* batch, double waited) {
+	PyObject* result = PyStructSequence_New(&ChannelBatchType);
+	PyObject* values = PyTuple_New(channels->channel_count);
+	PyObject* numbers = PyTuple_New(channels->channel_count);
+	if (!result || !values || !numbers) {
+		Py_XDECREF(result);
+		Py_XDECREF(values);
+		Py_XDECREF(numbers);
+		channel_batch_free(channels);
+		batch_free(batch);
+		return NULL;
 	}
-	else
-	{
-		// iterate over all packets received with the last read
-		volatile crono_packet* p = read_data.first_packet;
-		while (p <= read_data.last_packet)
-		{
+	bool ok = true;
+	for (int r = 0; r < channels->channel_count; r++) {
+		PyObject* array = array_from_buffer(channels->values[r], (npy_intp)channels->hit_count[r],
+			PyArray_DescrFromType(channels->mode == OUTPUT_NS ? NPY_DOUBLE : NPY_INT64));
+		channels->values[r] = NULL;
+		if (!array)
+			ok = false;
+		else
+			PyTuple_SET_ITEM(values, r, array);
+		PyObject* number = PyLong_FromLong(channels->channels[r]);
+		if (!number)
+			ok = false;
+		else
+			PyTuple_SET_ITEM(numbers, r, number);
+	}
+	npy_intp dims[2] = { channels->channel_count, (npy_intp)channels->packet_count + 1 };
+	PyObject* offsets = array_from_buffer_nd(channels->offsets, 2, dims, PyArray_DescrFromType(NPY_INT64));
+	channels->offsets = NULL;
+	channel_batch_free(channels);
+	Py_INCREF(batch_meta_descr[batch->mode]);
+	PyObject* meta = array_from_buffer(batch->meta, (npy_intp)batch->packet_count, batch_meta_descr[batch->mode]);
+	batch->meta = NULL;
+	batch_free(batch);
+	PyObject* wait = PyFloat_FromDouble(waited);
+	if (!ok || !offsets || !meta || !wait) {
+		Py_DECREF(values);
+		Py_DECREF(numbers);
+		Py_XDECREF(offsets);
+		Py_XDECREF(meta);
+		Py_XDECREF(wait);
+		Py_DECREF(result);
+		return NULL;
+	}
+	PyStructSequence_SetItem(result, 0, values);
+	PyStructSequence_SetItem(result, 1, offsets);
+	PyStructSequence_SetItem(result, 2, meta);
+	PyStructSequence_SetItem(result, 3, wait);
+	PyStructSequence_SetItem(result, 4, numbers);
+	return result;
+}
 
-			int hit_count = 2 * (p->length);
-			// Two hits fit into every 64 bit word. The second in the last word might be empty
-			// This flag  tells us, whether the number of hits in the packet is odd
-			if ((p->flags & TIMETAGGER4_PACKET_FLAG_ODD_HITS) != 0)
-				hit_count -= 1;
-
-			uint32_t* packet_data = (uint32_t*)(p->data);
-			uint32_t rollover_count = 0;
-			npy_intp dims[1] = { hit_count + 1 };
-			PyObject* array = PyArray_SimpleNew(1, dims, NPY_DOUBLE);
-			if (!array) {
-				Py_DECREF(py_list);
-				return NULL;
-			}
-			double* array_data = (double*)PyArray_DATA((PyArrayObject*)array);
-			double group_abs_time = p->timestamp * parinfo.packet_binsize / 1000.0;
-			// first value is the absolute time
-			array_data[0] = group_abs_time;
-			// 
-			uint64_t rollover_period_bins = static_info.rollover_period;
-			for (int i = 0; i < hit_count; i++)
+static PyObject* Device_read(DeviceObject* self, PyObject* args) {
+	device_state* d = open_device(self);
+	if (!d)
+		return NULL;
+	double timeout = DEFAULT_READ_TIMEOUT;
+	int min_packets = 1;
+	if (!PyArg_ParseTuple(args, "|di", &timeout, &min_packets))
+		return NULL;
+	if (!check_wait_args(timeout, min_packets))
+		return NULL;
+	if (!check_not_streaming(d))
+		return NULL;
+
+	// decoded without the GIL: per packet the group time followed by one slot per hit word
+	std::vector<double> values;
+	std::vector<npy_intp> lengths;
+	bool ok = true;
+	double waited;
+	Py_BEGIN_ALLOW_THREADS
+	waited = read_packets(d, timeout, min_packets, [&](timetagger4_read_out* packets) -> int {
+		try {
+			// iterate over all packets received with the last read
+			volatile crono_packet* p = packets->first_packet;
+			while (p <= packets->last_packet)
 			{
-				uint32_t hit = packet_data[i];
-				uint32_t channel = hit & 0xf;
-				// extract hit flags
-				uint32_t flags = hit >> 4 & 0xf;
-
-				if ((flags & TIMETAGGER4_HIT_FLAG_TIME_OVERFLOW) != 0) {
-					// this is a overflow of the 23/24 bit counter)
-					rollover_count++;
-				}
-				else {
-					// extract hit timestamp
-					uint32_t ts_offset = hit >> 8 & 0xffffff;
+				int hit_count = packet_hit_count(p);
+				uint32_t* packet_data = (uint32_t*)(p->data);
+				uint32_t rollover_count = 0;
+				lengths.push_back(hit_count + 1);
+				// first value is the absolute time
+				values.push_back(p->timestamp * d->parinfo.packet_binsize / 1000.0);
+				uint64_t rollover_period_bins = d->static_info.rollover_period;
+				for (int i = 0; i < hit_count; i++)
+				{
+					uint32_t hit = packet_data[i];
+					// extract hit flags
+					uint32_t flags = hit >> 4 & 0xf;
+
+					if ((flags & TIMETAGGER4_HIT_FLAG_TIME_OVERFLOW) != 0) {
+						// this is a overflow of the 23/24 bit counter, its slot carries no time
+						rollover_count++;
+						values.push_back(NAN);
+					}
+					else {
+						// extract hit timestamp
+						uint32_t ts_offset = hit >> 8 & 0xffffff;
 
-					// Convert timestamp to ns, this is relative to the start of the group
-					double ts_offset_ns = (ts_offset + rollover_count * rollover_period_bins) * parinfo.binsize / 1000.0;
-					array_data[i + 1] = ts_offset_ns;
+						// Convert timestamp to ns, this is relative to the start of the group
+						values.push_back((ts_offset + rollover_count * rollover_period_bins) * d->parinfo.binsize / 1000.0);
+					}
 				}
+				p = crono_next_packet(p);
 			}
-
-
-			PyList_Append(py_list, array);
-			p = crono_next_packet(p);
 		}
+		catch (const std::bad_alloc&) {
+			ok = false;
+		}
+		d->decoded_timestamp = packets->last_packet->timestamp;
+		// the packets are acknowledged once decoded
+		volatile crono_packet* ack = d->acks.done(packets->last_packet);
+		if (ack)
+			acknowledge(d, ack);
+		return ok ? (int)lengths.size() : -1;
+	});
+	Py_END_ALLOW_THREADS
+	d->last_wait = waited;
+	if (!ok)
+		return PyErr_NoMemory();
 
-
-
+	// Create a Python list to hold the NumPy arrays
+	PyObject* py_list = PyList_New(0);
+	if (!py_list) {
+		return NULL;
+	}
+	const double* packet_values = values.data();
+	for (size_t n = 0; n < lengths.size(); n++) {
+		npy_intp dims[1] = { lengths[n] };
+		PyObject* array = PyArray_SimpleNew(1, dims, NPY_DOUBLE);
+		if (!array || PyList_Append(py_list, array) < 0) {
+			Py_XDECREF(array);
+			Py_DECREF(py_list);
+			return NULL;
+		}
+		memcpy(PyArray_DATA((PyArrayObject*)array), packet_values, lengths[n] * sizeof(double));
+		packet_values += lengths[n];
+		Py_DECREF(array);
 	}
 	return py_list;
 }
 
+// Bit c set for every TDC channel enabled in the configuration of the board
+static unsigned enabled_channels(device_state* d) {
+	timetagger4_configuration config;
+	Py_BEGIN_ALLOW_THREADS
+	{
+		std::lock_guard<std::mutex> lock(d->device_mutex);
+		timetagger4_get_current_configuration(d->device, &config);
+	}
+	Py_END_ALLOW_THREADS
+	unsigned mask = 0;
+	for (int c = 0; c < TIMETAGGER4_TDC_CHANNEL_COUNT; c++) {
+		if (config.channel[c].enabled)
+			mask |= 1u << c;
+	}
+	return mask;
+}
 
+// Parses (mode, timeout, min_packets) and reads the packets into batch without the GIL.
+// count_channels has the decode count the hits per TDC channel for batch_demux().
+// Returns false with an exception set on failure, the batch holds no buffers then.
+static bool read_hits(DeviceObject* self, PyObject* args, hit_batch* batch, double* waited, bool count_channels) {
+	device_state* d = open_device(self);
+	if (!d)
+		return false;
+	int mode = OUTPUT_NS;
+	double timeout = DEFAULT_READ_TIMEOUT;
+	int min_packets = 1;
+	if (!PyArg_ParseTuple(args, "|idi", &mode, &timeout, &min_packets))
+		return false;
+	if (!check_output_mode(mode))
+		return false;
+	if (!check_wait_args(timeout, min_packets))
+		return false;
+	if (!check_not_streaming(d))
+		return false;
 
+	// the reads and the whole decode pass run without the GIL into buffers owned by C++
+	batch_init(batch, mode);
+	batch->count_channels = count_channels;
+	batch_scale scale = current_scale(d);
+	bool ok;
+	Py_BEGIN_ALLOW_THREADS
+	ok = batch_reserve(batch, 0, 0);
+	*waited = read_packets(d, timeout, min_packets, [&](timetagger4_read_out* packets) -> int {
+		batch->last_timestamp = d->decoded_timestamp;
+		scale.clock = d->clock;
+		if (ok)
+			ok = batch_append(batch, packets->first_packet, packets->last_packet, &scale);
+		d->decoded_timestamp = packets->last_packet->timestamp;
+		volatile crono_packet* ack = d->acks.done(packets->last_packet);
+		if (ack)
+			acknowledge(d, ack);
+		return ok ? (int)batch->packet_count : -1;
+	});
+	Py_END_ALLOW_THREADS
+	d->last_wait = *waited;
+	if (!ok) {
+		batch_free(batch);
+		PyErr_NoMemory();
+		return false;
+	}
+	return true;
+}
 
+static PyObject* Device_read_batch(DeviceObject* self, PyObject* args) {
+	hit_batch batch;
+	double waited;
+	if (!read_hits(self, args, &batch, &waited, false))
+		return NULL;
+	return batch_to_python(&batch, waited);
+}
+
+static PyObject* Device_read_channels(DeviceObject* self, PyObject* args) {
+	device_state* d = open_device(self);
+	if (!d)
+		return NULL;
+	unsigned enabled = enabled_channels(d);
+	hit_batch batch;
+	double waited;
+	if (!read_hits(self, args, &batch, &waited, true))
+		return NULL;
+	channel_batch channels;
+	bool ok;
+	Py_BEGIN_ALLOW_THREADS
+	ok = batch_demux(&batch, enabled, &channels);
+	Py_END_ALLOW_THREADS
+	if (!ok) {
+		batch_free(&batch);
+		return PyErr_NoMemory();
+	}
+	return channel_batch_to_python(&channels, &batch, waited);
+}
+
+static PyObject* timetagger4vector_set_decode_kernel(PyObject* self, PyObject* args) {
+	const char* name;
+	if (!PyArg_ParseTuple(args, "s", &name))
+		return NULL;
+	if (!decode_use_kernel(name)) {
+		PyErr_Format(PyExc_ValueError, "decode kernel '%s' is unknown or not supported by this CPU", name);
+		return NULL;
+	}
+	PyObject* kernel_name = PyUnicode_FromString(decode_kernel_name());
+	if (!kernel_name || PyObject_SetAttrString(self, "decode_kernel", kernel_name) < 0) {
+		Py_XDECREF(kernel_name);
+		return NULL;
+	}
+	Py_DECREF(kernel_name);
+	Py_RETURN_NONE;
+}
+
+static PyObject* Device_start_streaming(DeviceObject* self, PyObject* args) {
+	device_state* d = open_device(self);
+	if (!d)
+		return NULL;
+	int mode = OUTPUT_NS;
+	int capacity = 64;
+	if (!PyArg_ParseTuple(args, "|ii", &mode, &capacity))
+		return NULL;
+	if (!check_output_mode(mode))
+		return NULL;
+	if (capacity < 1) {
+		PyErr_SetString(PyExc_ValueError, "capacity must be at least 1");
+		return NULL;
+	}
+	if (d->acks.outstanding() > 0) {
+		// the thread acknowledges every read, which would free the buffers
+		PyErr_SetString(PyExc_RuntimeError, "release all packet buffers before streaming");
+		return NULL;
+	}
+	if (d->leftover_first) {
+		PyErr_SetString(PyExc_RuntimeError, "read_into() left packets over, read them before streaming");
+		return NULL;
+	}
+	batch_scale scale = current_scale(d);
+	// the old thread is joined without the GIL, the queue is reset with it, which
+	// keeps pop() out as the GIL makes the Python threads a single consumer
+	Py_BEGIN_ALLOW_THREADS
+	d->stream.stop();
+	Py_END_ALLOW_THREADS
+	// close() may have run meanwhile
+	if (!open_device(self))
+		return NULL;
+	const char* error = NULL;
+	try {
+		error = d->stream.start(d->device, &d->device_mutex, &d->read_stats, &d->decoded_timestamp,
+			&d->reference_events, &d->clock, &d->pressure, &d->shedding, &d->recorder, scale, mode, capacity);
+	}
+	catch (const std::bad_alloc&) {
+		return PyErr_NoMemory();
+	}
+	if (error) {
+		PyErr_SetString(PyExc_RuntimeError, error);
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject* Device_stop_streaming(DeviceObject* self, PyObject* args) {
+	device_state* d = device_of(self);
+	if (!d)
+		return NULL;
+	Py_BEGIN_ALLOW_THREADS
+	d->stream.stop();
+	Py_END_ALLOW_THREADS
+	Py_RETURN_NONE;
+}
+
+static PyObject* Device_pop(DeviceObject* self, PyObject* args) {
+	device_state* d = device_of(self);
+	if (!d)
+		return NULL;
+	double timeout = 0.0;
+	if (!PyArg_ParseTuple(args, "|d", &timeout))
+		return NULL;
+
+	// the GIL makes the Python threads a single consumer of the queue
+	hit_batch batch;
+	adaptive_wait wait(timeout > 0 ? timeout : 0.0);
+	bool popped = d->stream.pop(&batch);
+	while (!popped) {
+		bool waiting;
+		Py_BEGIN_ALLOW_THREADS
+		waiting = wait.next();
+		Py_END_ALLOW_THREADS
+		if (!waiting)
+			break;
+		popped = d->stream.pop(&batch);
+	}
+	if (!popped)
+		Py_RETURN_NONE;
+	return batch_to_python(&batch, wait.waited());
+}
+
+static PyObject* Device_set_backpressure(DeviceObject* self, PyObject* args) {
+	int enabled;
+	double queue_high = 0.75;
+	double queue_low = 0.25;
+	double buffer_high = 0.5;
+	if (!PyArg_ParseTuple(args, "p|ddd", &enabled, &queue_high, &queue_low, &buffer_high))
+		return NULL;
+	device_state* d = device_of(self);
+	if (!d)
+		return NULL;
+	if (!(queue_low >= 0 && queue_low < queue_high && queue_high <= 1)) {
+		PyErr_SetString(PyExc_ValueError, "0 <= queue_low < queue_high <= 1 is required");
+		return NULL;
+	}
+	if (!(buffer_high > 0 && buffer_high <= 1)) {
+		PyErr_SetString(PyExc_ValueError, "buffer_high must be within 0..1");
+		return NULL;
+	}
+	std::lock_guard<std::mutex> lock(d->device_mutex);
+	d->pressure.enabled = enabled != 0;
+	d->pressure.queue_high = queue_high;
+	d->pressure.queue_low = queue_low;
+	d->pressure.buffer_high = buffer_high;
+	Py_RETURN_NONE;
+}
+
+static PyObject* Device_set_load_shedding(DeviceObject* self, PyObject* args) {
+	int policy;
+	unsigned int n = 1;
+	double high = 0.5;
+	double low = 0.25;
+	if (!PyArg_ParseTuple(args, "i|Idd", &policy, &n, &high, &low))
+		return NULL;
+	device_state* d = device_of(self);
+	if (!d)
+		return NULL;
+	if (policy < SHED_NONE || policy > SHED_FIRST_HITS) {
+		PyErr_SetString(PyExc_ValueError, "policy must be one of the SHED_* constants");
+		return NULL;
+	}
+	if ((policy == SHED_EVERY_NTH || policy == SHED_FIRST_HITS) && n < 1) {
+		PyErr_SetString(PyExc_ValueError, "n must be at least 1");
+		return NULL;
+	}
+	if (!(low >= 0 && low < high && high <= 1)) {
+		PyErr_SetString(PyExc_ValueError, "0 <= low < high <= 1 is required");
+		return NULL;
+	}
+	std::lock_guard<std::mutex> lock(d->device_mutex);
+	// the totals keep counting across changes of the policy
+	d->shedding.state.policy = policy;
+	d->shedding.state.n = n;
+	d->shedding.state.active = false;
+	d->shedding.high = high;
+	d->shedding.low = low;
+	Py_RETURN_NONE;
+}
+
+static PyObject* none() {
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject* Device_pause_log(DeviceObject* self, PyObject* args) {
+	int clear = 0;
+	if (!PyArg_ParseTuple(args, "|p", &clear))
+		return NULL;
+	device_state* d = device_of(self);
+	if (!d)
+		return NULL;
+	std::vector<pause_interval> log;
+	{
+		std::lock_guard<std::mutex> lock(d->device_mutex);
+		log = d->pressure.log;
+		if (clear)
+			d->pressure.log.erase(d->pressure.log.begin(), d->pressure.log.begin() + d->pressure.closed());
+	}
+	int64_t packet_whole_ps = (int64_t)d->parinfo.packet_binsize;
+	double packet_fraction_ps = d->parinfo.packet_binsize - packet_whole_ps;
+	PyObject* list = PyList_New((Py_ssize_t)log.size());
+	if (!list)
+		return NULL;
+	for (size_t i = 0; i < log.size(); i++) {
+		const pause_interval& p = log[i];
+		PyObject* resumed_at = p.resumed_at > 0 ? PyFloat_FromDouble(p.resumed_at) : none();
+		PyObject* last_ps = p.last_timestamp >= 0 ?
+			PyLong_FromLongLong(to_ps(p.last_timestamp, packet_whole_ps, packet_fraction_ps)) : none();
+		PyObject* first_ps = p.first_timestamp >= 0 ?
+			PyLong_FromLongLong(to_ps(p.first_timestamp, packet_whole_ps, packet_fraction_ps)) : none();
+		PyObject* entry = NULL;
+		if (resumed_at && last_ps && first_ps) {
+			entry = Py_BuildValue("{s:d,s:O,s:O,s:O,s:k}",
+				"paused_at", p.paused_at,
+				"resumed_at", resumed_at,
+				"last_ps", last_ps,
+				"first_ps", first_ps,
+				"groups", (unsigned long)p.groups);
+		}
+		Py_XDECREF(resumed_at);
+		Py_XDECREF(last_ps);
+		Py_XDECREF(first_ps);
+		if (!entry) {
+			Py_DECREF(list);
+			return NULL;
+		}
+		PyList_SET_ITEM(list, (Py_ssize_t)i, entry);
+	}
+	return list;
+}
+
+static PyObject* Device_record(DeviceObject* self, PyObject* args) {
+	const char* path;
+	unsigned long long segment_size = 0;
+	unsigned long long block_size = RECORD_DEFAULT_BLOCK_SIZE;
+	if (!PyArg_ParseTuple(args, "s|KK", &path, &segment_size, &block_size))
+		return NULL;
+	device_state* d = open_device(self);
+	if (!d)
+		return NULL;
+	if (recording_active(d)) {
+		PyErr_SetString(PyExc_RuntimeError, "recording is active already");
+		return NULL;
+	}
+	if (block_size > (1ULL << 30)) {
+		PyErr_SetString(PyExc_ValueError, "block_size must be at most 1 GiB");
+		return NULL;
+	}
+	record_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RECORD_MAGIC, sizeof(header.magic));
+	header.version = RECORD_VERSION;
+	header.header_size = RECORD_HEADER_SIZE;
+	header.tdc_mode = d->tdc_mode;
+	header.card_index = d->card_index;
+	header.board_serial = d->static_info.board_serial;
+	batch_scale scale = current_scale(d);
+	header.rollover_period = scale.rollover_period;
+	header.binsize = scale.binsize;
+	header.packet_binsize = scale.packet_binsize;
+	header.group_period = scale.group_period;
+	std::string error;
+	Py_BEGIN_ALLOW_THREADS
+	{
+		std::lock_guard<std::mutex> lock(d->device_mutex);
+		const char* message = d->recorder.start(path, header, (size_t)block_size, segment_size);
+		if (message)
+			error = message;
+	}
+	Py_END_ALLOW_THREADS
+	if (!error.empty()) {
+		PyErr_SetString(PyExc_OSError, error.c_str());
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject* Device_recording_info(DeviceObject* self, PyObject* args) {
+	device_state* d = device_of(self);
+	if (!d)
+		return NULL;
+	packet_recorder& r = d->recorder;
+	// record() and stop_recording() change both under the device lock without the GIL
+	bool recording;
+	std::string path;
+	{
+		std::lock_guard<std::mutex> lock(d->device_mutex);
+		recording = r.active();
+		path = r.path;
+	}
+	std::string error = r.error();
+	PyObject* error_object = error.empty() ? none() : PyUnicode_FromString(error.c_str());
+	if (!error_object)
+		return NULL;
+	return Py_BuildValue("{s:O,s:s,s:K,s:K,s:K,s:k,s:K,s:d,s:N}",
+		"recording", recording ? Py_True : Py_False,
+		"path", path.c_str(),
+		"bytes_recorded", (unsigned long long)r.bytes_recorded.load(),
+		"bytes_written", (unsigned long long)r.bytes_written.load(),
+		"bytes_lost", (unsigned long long)r.bytes_lost.load(),
+		"segments", (unsigned long)r.segments.load(),
+		"stalls", (unsigned long long)r.stalls.load(),
+		"stall_seconds", r.stall_seconds.load(),
+		"error", error_object);
+}
+
+static PyObject* Device_stop_recording(DeviceObject* self, PyObject* args) {
+	device_state* d = device_of(self);
+	if (!d)
+		return NULL;
+	Py_BEGIN_ALLOW_THREADS
+	{
+		std::lock_guard<std::mutex> lock(d->device_mutex);
+		d->recorder.stop();
+	}
+	Py_END_ALLOW_THREADS
+	return Device_recording_info(self, args);
+}
+
+static PyObject* Device_streaming_info(DeviceObject* self, PyObject* args) {
+	device_state* d = device_of(self);
+	if (!d)
+		return NULL;
+	bool paused;
+	uint64_t pauses;
+	load_shedding shedding;
+	{
+		std::lock_guard<std::mutex> lock(d->device_mutex);
+		paused = d->pressure.paused;
+		pauses = d->pressure.pauses;
+		shedding = d->shedding;
+	}
+	return Py_BuildValue("{s:O,s:n,s:n,s:K,s:K,s:O,s:K,s:O,s:K,s:K,s:K}",
+		"running", d->stream.running() ? Py_True : Py_False,
+		"queued", (Py_ssize_t)d->stream.queued(),
+		"capacity", (Py_ssize_t)d->stream.capacity(),
+		"batches_dropped", (unsigned long long)d->stream.batches_dropped.load(),
+		"packets_dropped", (unsigned long long)d->stream.packets_dropped.load(),
+		"paused", paused ? Py_True : Py_False,
+		"pauses", (unsigned long long)pauses,
+		"shedding", shedding.state.active ? Py_True : Py_False,
+		"shed_activations", (unsigned long long)shedding.activations,
+		"groups_shed", (unsigned long long)shedding.state.groups,
+		"hits_shed", (unsigned long long)shedding.state.hits);
+}
+
+static PyObject* timetagger4vector_pool_stats(PyObject* self, PyObject* args) {
+	pool_stats stats;
+	pool_get_stats(&stats);
+	return Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:K}",
+		"hits", (unsigned long long)stats.hits,
+		"misses", (unsigned long long)stats.misses,
+		"bytes_held", (unsigned long long)stats.bytes_held,
+		"buffers_held", (unsigned long long)stats.buffers_held,
+		"bytes_in_use", (unsigned long long)stats.bytes_in_use,
+		"limit", (unsigned long long)stats.limit);
+}
+
+static PyObject* timetagger4vector_set_pool_limit(PyObject* self, PyObject* args) {
+	unsigned long long limit;
+	if (!PyArg_ParseTuple(args, "K", &limit))
+		return NULL;
+	pool_set_limit(limit);
+	Py_RETURN_NONE;
+}
+
+static PyObject* Device_stats(DeviceObject* self, PyObject* args) {
+	device_state* d = device_of(self);
+	if (!d)
+		return NULL;
+	PyObject* flags = PyTuple_New(STATS_FLAG_BITS);
+	if (!flags)
+		return NULL;
+	for (int bit = 0; bit < STATS_FLAG_BITS; bit++) {
+		PyObject* count = PyLong_FromUnsignedLongLong(d->read_stats.flags[bit].load(std::memory_order_relaxed));
+		if (!count) {
+			Py_DECREF(flags);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(flags, bit, count);
+	}
+	// named counters for the TIMETAGGER4_PACKET_FLAG_* bits that report data loss
+	return Py_BuildValue("{s:K,s:K,s:K,s:N,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:L,s:L,s:L,s:L}",
+		"reads", (unsigned long long)d->read_stats.reads.load(std::memory_order_relaxed),
+		"packets", (unsigned long long)d->read_stats.packets.load(std::memory_order_relaxed),
+		"hit_words", (unsigned long long)d->read_stats.hit_words.load(std::memory_order_relaxed),
+		"flags", flags,
+		"slow_sync", (unsigned long long)d->read_stats.flags[flag_bit(TIMETAGGER4_PACKET_FLAG_SLOW_SYNC)].load(std::memory_order_relaxed),
+		"start_missed", (unsigned long long)d->read_stats.flags[flag_bit(TIMETAGGER4_PACKET_FLAG_START_MISSED)].load(std::memory_order_relaxed),
+		"shortened", (unsigned long long)d->read_stats.flags[flag_bit(TIMETAGGER4_PACKET_FLAG_SHORTENED)].load(std::memory_order_relaxed),
+		"dma_fifo_full", (unsigned long long)d->read_stats.flags[flag_bit(TIMETAGGER4_PACKET_FLAG_DMA_FIFO_FULL)].load(std::memory_order_relaxed),
+		"host_buffer_full", (unsigned long long)d->read_stats.flags[flag_bit(TIMETAGGER4_PACKET_FLAG_HOST_BUFFER_FULL)].load(std::memory_order_relaxed),
+		"groups_dropped", (unsigned long long)d->read_stats.groups_dropped.load(std::memory_order_relaxed),
+		"gaps", (unsigned long long)d->read_stats.gaps.load(std::memory_order_relaxed),
+		"groups_paused", (unsigned long long)d->read_stats.groups_paused.load(std::memory_order_relaxed),
+		"group_period", (long long)d->group_period,
+		// host buffer fill level, estimated at the last read or acknowledge
+		"buffer_size", (long long)d->read_stats.buffer_bytes.load(std::memory_order_relaxed),
+		"buffer_fill", (long long)d->read_stats.fill_bytes.load(std::memory_order_relaxed),
+		"buffer_fill_peak", (long long)d->read_stats.peak_fill_bytes.load(std::memory_order_relaxed));
+}
+
+static PyObject* Device_reset_stats(DeviceObject* self, PyObject* args) {
+	device_state* d = device_of(self);
+	if (!d)
+		return NULL;
+	Py_BEGIN_ALLOW_THREADS
+	{
+		std::lock_guard<std::mutex> lock(d->device_mutex);
+		d->read_stats.reset();
+	}
+	Py_END_ALLOW_THREADS
+	Py_RETURN_NONE;
+}
+
+// Zero-copy view of the packets of one read, straight in the DMA buffer.
+// Exports the raw 64 bit words from the first packet header to the end of the
+// last packet through the buffer protocol. The packets are acknowledged once
+// the buffer is released and all earlier reads are released as well.
+struct PacketBufferObject {
+	PyObject_HEAD
+	DeviceObject* owner;	// keeps the state of the device that read the packets alive
+	volatile crono_packet* first;
+	volatile crono_packet* last;
+	Py_ssize_t packet_count;
+	Py_ssize_t word_count;
+	Py_ssize_t word_size;
+	uint64_t ack_id;
+	bool released;
+	Py_ssize_t exports;	// buffer views currently handed out
+};
+
+static void packet_buffer_release(PacketBufferObject* self) {
+	if (self->released)
+		return;
+	self->released = true;
+	if (self->packet_count == 0)
+		return;
+	device_state* d = self->owner->state;
+	std::lock_guard<std::mutex> lock(d->device_mutex);
+	volatile crono_packet* ack = d->acks.release(self->ack_id);
+	if (ack && d->device)
+		acknowledge(d, ack);
+}
+
+static void PacketBuffer_dealloc(PacketBufferObject* self) {
+	packet_buffer_release(self);
+	Py_DECREF(self->owner);
+	PyTypeObject* type = Py_TYPE(self);
+	type->tp_free((PyObject*)self);
+	Py_DECREF(type);
+}
+
+static int PacketBuffer_getbuffer(PacketBufferObject* self, Py_buffer* view, int flags) {
+	if (self->released) {
+		PyErr_SetString(PyExc_BufferError, "packet buffer is released");
+		return -1;
+	}
+	if ((flags & PyBUF_WRITABLE) == PyBUF_WRITABLE) {
+		PyErr_SetString(PyExc_BufferError, "packet buffer is read-only");
+		return -1;
+	}
+	view->obj = (PyObject*)self;
+	Py_INCREF(self);
+	view->buf = (void*)self->first;
+	view->len = self->word_count * self->word_size;
+	view->readonly = 1;
+	view->itemsize = self->word_size;
+	view->format = (flags & PyBUF_FORMAT) == PyBUF_FORMAT ? (char*)"Q" : NULL;
+	view->ndim = 1;
+	view->shape = (flags & PyBUF_ND) == PyBUF_ND ? &self->word_count : NULL;
+	view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? &self->word_size : NULL;
+	view->suboffsets = NULL;
+	view->internal = NULL;
+	self->exports++;
+	return 0;
+}
+
+static void PacketBuffer_releasebuffer(PacketBufferObject* self, Py_buffer* view) {
+	self->exports--;
+}
+
+static PyObject* PacketBuffer_release(PacketBufferObject* self, PyObject* args) {
+	if (self->exports > 0) {
+		PyErr_SetString(PyExc_BufferError, "packet buffer has exported views, drop them before release()");
+		return NULL;
+	}
+	packet_buffer_release(self);
+	Py_RETURN_NONE;
+}
+
+static PyObject* PacketBuffer_decode(PacketBufferObject* self, PyObject* args) {
+	int mode = OUTPUT_NS;
+	if (!PyArg_ParseTuple(args, "|i", &mode))
+		return NULL;
+	if (!check_output_mode(mode))
+		return NULL;
+	if (self->released) {
+		PyErr_SetString(PyExc_ValueError, "packet buffer is released");
+		return NULL;
+	}
+	hit_batch batch;
+	batch_init(&batch, mode);
+	device_state* d = self->owner->state;
+	batch_scale scale = current_scale(d);
+	{
+		std::lock_guard<std::mutex> lock(d->device_mutex);
+		scale.clock = d->clock;
+	}
+	bool ok;
+	Py_BEGIN_ALLOW_THREADS
+	ok = batch_reserve(&batch, 0, 0);
+	if (ok && self->packet_count > 0)
+		ok = batch_append(&batch, self->first, self->last, &scale);
+	Py_END_ALLOW_THREADS
+	if (!ok) {
+		batch_free(&batch);
+		return PyErr_NoMemory();
+	}
+	return batch_to_python(&batch, 0.0);
+}
+
+static PyObject* PacketBuffer_enter(PyObject* self, PyObject* args) {
+	Py_INCREF(self);
+	return self;
+}
+
+static PyObject* PacketBuffer_exit(PacketBufferObject* self, PyObject* args) {
+	PyObject* result = PacketBuffer_release(self, NULL);
+	if (!result)
+		return NULL;
+	Py_DECREF(result);
+	Py_RETURN_FALSE;
+}
+
+static PyObject* PacketBuffer_get_released(PacketBufferObject* self, void* closure) {
+	return PyBool_FromLong(self->released);
+}
+
+static PyMethodDef PacketBuffer_methods[] = {
+	{"release", (PyCFunction)PacketBuffer_release, METH_NOARGS, "Acknowledge the packets, the buffer can not be accessed afterwards"},
+	{"decode", (PyCFunction)PacketBuffer_decode, METH_VARARGS, "Decode the packets into a Batch"},
+	{"__enter__", (PyCFunction)PacketBuffer_enter, METH_NOARGS, NULL},
+	{"__exit__", (PyCFunction)PacketBuffer_exit, METH_VARARGS, NULL},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyMemberDef PacketBuffer_members[] = {
+	{(char*)"packet_count", T_PYSSIZET, offsetof(PacketBufferObject, packet_count), READONLY, (char*)"number of packets in the buffer"},
+	{NULL, 0, 0, 0, NULL}
+};
+
+static PyGetSetDef PacketBuffer_getset[] = {
+	{(char*)"released", (getter)PacketBuffer_get_released, NULL, (char*)"True once the packets are released", NULL},
+	{NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyTypeObject* create_packet_buffer_type() {
+	PyType_Slot slots[] = {
+		{Py_tp_dealloc, (void*)PacketBuffer_dealloc},
+		{Py_tp_doc, (void*)"Zero-copy view of the raw 64 bit words of the packets of one read"},
+		{Py_tp_methods, PacketBuffer_methods},
+		{Py_tp_members, PacketBuffer_members},
+		{Py_tp_getset, PacketBuffer_getset},
+		{Py_bf_getbuffer, (void*)PacketBuffer_getbuffer},
+		{Py_bf_releasebuffer, (void*)PacketBuffer_releasebuffer},
+		{0, NULL}
+	};
+	PyType_Spec spec = {
+		MODULE_NAME ".PacketBuffer",
+		sizeof(PacketBufferObject),
+		0,
+#ifdef Py_TPFLAGS_DISALLOW_INSTANTIATION
+		Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+#else
+		Py_TPFLAGS_DEFAULT,
+#endif
+		slots
+	};
+	return (PyTypeObject*)PyType_FromSpec(&spec);
+}
+
+static PyObject* Device_read_raw(DeviceObject* self, PyObject* args) {
+	device_state* d = open_device(self);
+	if (!d)
+		return NULL;
+	double timeout = DEFAULT_READ_TIMEOUT;
+	if (!PyArg_ParseTuple(args, "|d", &timeout))
+		return NULL;
+	if (!check_wait_args(timeout, 1))
+		return NULL;
+	if (!check_not_streaming(d))
+		return NULL;
+
+	// the packets stay in the DMA buffer until the PacketBuffer is released
+	timetagger4_read_out raw_data;
+	uint64_t ack_id = 0;
+	double waited;
+	Py_BEGIN_ALLOW_THREADS
+	// a buffer covers a single read, the next one may start anywhere in the DMA buffer
+	waited = read_packets(d, timeout, 1, [&](timetagger4_read_out* packets) -> int {
+		raw_data = *packets;
+		ack_id = d->acks.hold(raw_data.last_packet);
+		d->decoded_timestamp = raw_data.last_packet->timestamp;
+		return 1;
+	});
+	Py_END_ALLOW_THREADS
+	d->last_wait = waited;
+	if (ack_id == 0)
+		Py_RETURN_NONE;
+
+	PacketBufferObject* buffer = PyObject_New(PacketBufferObject, PacketBufferType);
+	if (!buffer) {
+		std::lock_guard<std::mutex> lock(d->device_mutex);
+		volatile crono_packet* ack = d->acks.release(ack_id);
+		if (ack && d->device)
+			acknowledge(d, ack);
+		return NULL;
+	}
+	Py_INCREF(self);
+	buffer->owner = self;
+	buffer->first = raw_data.first_packet;
+	buffer->last = raw_data.last_packet;
+	buffer->packet_count = 0;
+	for (volatile crono_packet* p = raw_data.first_packet; p <= raw_data.last_packet; p = crono_next_packet(p))
+		buffer->packet_count++;
+	buffer->word_size = sizeof(uint64_t);
+	buffer->word_count = (Py_ssize_t)(((volatile char*)crono_next_packet(raw_data.last_packet) - (volatile char*)raw_data.first_packet) / sizeof(uint64_t));
+	buffer->ack_id = ack_id;
+	buffer->released = false;
+	buffer->exports = 0;
+	return (PyObject*)buffer;
+}
+
+// format character of a buffer without the byte order prefix, the data is native little endian
+static const char* buffer_format(const Py_buffer* view) {
+	const char* format = view->format ? view->format : "B";
+	if (*format == '@' || *format == '=' || *format == '<')
+		format++;
+	return format;
+}
+
+static bool is_int64_buffer(const Py_buffer* view) {
+	const char* format = buffer_format(view);
+	return view->itemsize == 8 && (strcmp(format, "q") == 0 || strcmp(format, "l") == 0);
+}
+
+static PyObject* Device_read_into(DeviceObject* self, PyObject* args) {
+	device_state* d = open_device(self);
+	if (!d)
+		return NULL;
+	PyObject* values_obj;
+	PyObject* offsets_obj;
+	PyObject* meta_obj;
+	double timeout = DEFAULT_READ_TIMEOUT;
+	int min_packets = 1;
+	// int64 values default to OUTPUT_BINS, OUTPUT_PS has to be asked for
+	int int64_mode = OUTPUT_BINS;
+	if (!PyArg_ParseTuple(args, "OOO|dii", &values_obj, &offsets_obj, &meta_obj, &timeout, &min_packets, &int64_mode))
+		return NULL;
+	if (!check_wait_args(timeout, min_packets))
+		return NULL;
+	if (int64_mode != OUTPUT_BINS && int64_mode != OUTPUT_PS) {
+		PyErr_SetString(PyExc_ValueError, "mode must be OUTPUT_BINS or OUTPUT_PS");
+		return NULL;
+	}
+	if (!check_not_streaming(d))
+		return NULL;
+
+	const int flags = PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS | PyBUF_FORMAT;
+	Py_buffer values, offsets, meta;
+	if (PyObject_GetBuffer(values_obj, &values, flags) < 0)
+		return NULL;
+	if (PyObject_GetBuffer(offsets_obj, &offsets, flags) < 0) {
+		PyBuffer_Release(&values);
+		return NULL;
+	}
+	if (PyObject_GetBuffer(meta_obj, &meta, flags) < 0) {
+		PyBuffer_Release(&values);
+		PyBuffer_Release(&offsets);
+		return NULL;
+	}
+
+	// the type of values selects the output mode, meta must use the matching dtype
+	hit_batch batch;
+	batch_init(&batch, OUTPUT_NS);
+	const char* error = NULL;
+	if (values.itemsize == 8 && strcmp(buffer_format(&values), "d") == 0)
+		batch.mode = OUTPUT_NS;
+	else if (is_int64_buffer(&values))
+		batch.mode = int64_mode;
+	else
+		error = "values must be a float64 (OUTPUT_NS) or int64 (OUTPUT_BINS, OUTPUT_PS) buffer";
+	if (!error && (!is_int64_buffer(&offsets) || offsets.len < (Py_ssize_t)sizeof(int64_t)))
+		error = "offsets must be a non-empty int64 buffer";
+	if (!error && meta.itemsize != (Py_ssize_t)sizeof(batch_meta))
+		error = "meta must be a buffer of batch_meta_dtype or batch_meta_bins_dtype";
+	if (error) {
+		PyBuffer_Release(&values);
+		PyBuffer_Release(&offsets);
+		PyBuffer_Release(&meta);
+		PyErr_SetString(PyExc_ValueError, error);
+		return NULL;
+	}
+	batch.values = (int64_t*)values.buf;
+	batch.hit_capacity = values.len / sizeof(int64_t);
+	batch.offsets = (int64_t*)offsets.buf;
+	batch.meta = (batch_meta*)meta.buf;
+	size_t offsets_capacity = offsets.len / sizeof(int64_t) - 1;
+	size_t meta_capacity = meta.len / sizeof(batch_meta);
+	batch.packet_capacity = offsets_capacity < meta_capacity ? offsets_capacity : meta_capacity;
+	batch.offsets[0] = 0;
+
+	batch_scale scale = current_scale(d);
+	int next_hits = -1;
+	bool more;
+	double waited;
+	Py_BEGIN_ALLOW_THREADS
+	waited = read_packets(d, timeout, min_packets, [&](timetagger4_read_out* packets) -> int {
+		volatile crono_packet* last_decoded;
+		batch.last_timestamp = d->decoded_timestamp;
+		scale.clock = d->clock;
+		volatile crono_packet* rest = batch_fill(&batch, packets->first_packet, packets->last_packet, &scale, &last_decoded);
+		d->decoded_timestamp = batch.last_timestamp;
+		if (last_decoded) {
+			volatile crono_packet* ack = d->acks.done(last_decoded);
+			if (ack)
+				acknowledge(d, ack);
+		}
+		if (!rest)
+			return (int)batch.packet_count;
+		// what did not fit stays in the DMA buffer for the next call
+		d->leftover_first = rest;
+		d->leftover_last = packets->last_packet;
+		if (batch.packet_count == 0)
+			next_hits = packet_hit_count(rest);
+		return -1;
+	});
+	{
+		std::lock_guard<std::mutex> lock(d->device_mutex);
+		more = d->leftover_first != NULL;
+	}
+	Py_END_ALLOW_THREADS
+	PyBuffer_Release(&values);
+	PyBuffer_Release(&offsets);
+	PyBuffer_Release(&meta);
+
+	d->last_wait = waited;
+	if (next_hits >= 0) {
+		PyErr_Format(PyExc_ValueError, "buffers too small for the next packet with %d hit words", next_hits);
+		return NULL;
+	}
+	return Py_BuildValue("(nnO)", (Py_ssize_t)batch.hit_count, (Py_ssize_t)batch.packet_count, more ? Py_True : Py_False);
+}
+
+static int Device_tp_init(DeviceObject* self, PyObject* args, PyObject* kwds) {
+	static const char* keywords[] = { "card_index", "board_id", "buffer_size", NULL };
+	int card_index = DEFAULT_CARD_INDEX;
+	int board_id = DEFAULT_BOARD_ID;
+	unsigned long long buffer_size = DEFAULT_BUFFER_SIZE;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iiK", (char**)keywords, &card_index, &board_id, &buffer_size))
+		return -1;
+	if (card_index < 0) {
+		PyErr_SetString(PyExc_ValueError, "card_index must not be negative");
+		return -1;
+	}
+	if (board_id < 0 || board_id > 255) {
+		PyErr_SetString(PyExc_ValueError, "board_id must be in the range 0..255");
+		return -1;
+	}
+	if (buffer_size == 0) {
+		PyErr_SetString(PyExc_ValueError, "buffer_size must be positive");
+		return -1;
+	}
+	if (self->state) {
+		if (self->state->device) {
+			PyErr_SetString(PyExc_RuntimeError, "close() the device before initializing it again");
+			return -1;
+		}
+		delete self->state;
+		self->state = NULL;
+	}
+	self->state = new (std::nothrow) device_state(card_index, board_id, buffer_size);
+	if (!self->state) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	return 0;
+}
+
+static void Device_dealloc(DeviceObject* self) {
+	if (self->state) {
+		// joins the streaming thread, which never needs the GIL. No packet buffer
+		// is left, each keeps the Device alive.
+		Py_BEGIN_ALLOW_THREADS
+		device_close(self->state);
+		Py_END_ALLOW_THREADS
+		delete self->state;
+	}
+	PyTypeObject* type = Py_TYPE(self);
+	type->tp_free((PyObject*)self);
+	Py_DECREF(type);
+}
+
+static PyObject* Device_enter(PyObject* self, PyObject* args) {
+	Py_INCREF(self);
+	return self;
+}
+
+static PyObject* Device_exit(DeviceObject* self, PyObject* args) {
+	PyObject* result = Device_close(self, NULL);
+	if (!result)
+		return NULL;
+	Py_DECREF(result);
+	Py_RETURN_FALSE;
+}
+
+static PyObject* Device_get_card_index(DeviceObject* self, void* closure) {
+	device_state* d = device_of(self);
+	return d ? PyLong_FromLong(d->card_index) : NULL;
+}
+
+static PyObject* Device_get_board_id(DeviceObject* self, void* closure) {
+	device_state* d = device_of(self);
+	return d ? PyLong_FromLong(d->board_id) : NULL;
+}
+
+static PyObject* Device_get_buffer_size(DeviceObject* self, void* closure) {
+	device_state* d = device_of(self);
+	return d ? PyLong_FromUnsignedLongLong(d->buffer_size) : NULL;
+}
+
+static PyObject* Device_get_initialized(DeviceObject* self, void* closure) {
+	device_state* d = device_of(self);
+	return d ? PyBool_FromLong(d->device != NULL) : NULL;
+}
+
+static PyObject* Device_get_binsize(DeviceObject* self, void* closure) {
+	device_state* d = device_of(self);
+	return d ? PyFloat_FromDouble(d->parinfo.binsize) : NULL;
+}
+
+static PyObject* Device_get_packet_binsize(DeviceObject* self, void* closure) {
+	device_state* d = device_of(self);
+	return d ? PyFloat_FromDouble(d->parinfo.packet_binsize) : NULL;
+}
+
+static PyObject* Device_get_rollover_period(DeviceObject* self, void* closure) {
+	device_state* d = device_of(self);
+	return d ? PyLong_FromUnsignedLong(d->static_info.rollover_period) : NULL;
+}
+
+static PyObject* Device_get_tdc_mode(DeviceObject* self, void* closure) {
+	device_state* d = device_of(self);
+	return d ? PyLong_FromLong(d->tdc_mode) : NULL;
+}
+
+static PyObject* Device_get_last_wait(DeviceObject* self, void* closure) {
+	device_state* d = device_of(self);
+	return d ? PyFloat_FromDouble(d->last_wait) : NULL;
+}
+
+static PyObject* Device_get_clock(DeviceObject* self, void* closure) {
+	device_state* d = device_of(self);
+	if (!d)
+		return NULL;
+	clock_correction clock;
+	{
+		std::lock_guard<std::mutex> lock(d->device_mutex);
+		clock = d->clock;
+	}
+	return Py_BuildValue("(ddL)", clock.offset, clock.drift, (long long)clock.pivot);
+}
+
+static PyObject* Device_set_clock(DeviceObject* self, PyObject* args) {
+	double offset = 0.0;
+	double drift = 0.0;
+	long long pivot = 0;
+	if (!PyArg_ParseTuple(args, "|ddL", &offset, &drift, &pivot))
+		return NULL;
+	device_state* d = device_of(self);
+	if (!d)
+		return NULL;
+	if (!isfinite(offset) || !isfinite(drift)) {
+		PyErr_SetString(PyExc_ValueError, "offset and drift must be finite");
+		return NULL;
+	}
+	std::lock_guard<std::mutex> lock(d->device_mutex);
+	d->clock.offset = offset;
+	d->clock.drift = drift;
+	d->clock.pivot = (int64_t)pivot;
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef Device_methods[] = {
+	{"init", (PyCFunction)Device_init, METH_VARARGS, "Initialize the board, optionally with a buffer size in bytes or \"auto\", hit_rate, stall_time[, group_rate]"},
+	{"config", (PyCFunction)Device_config, METH_VARARGS, "Configure the board for TDC_MODE_GROUPED or TDC_MODE_CONTINUOUS"},
+	{"configure", (PyCFunction)Device_configure, METH_VARARGS, "Change the configuration keys given in a dict, the board is only written if something changed"},
+	{"get_config", (PyCFunction)Device_get_config, METH_VARARGS, "The configuration of the board as a dict, keys and lists as in timetagger4_configuration"},
+	{"start", (PyCFunction)Device_start, METH_VARARGS, "Start capturing"},
+	{"stop", (PyCFunction)Device_stop, METH_VARARGS, "Stop capturing"},
+	{"close", (PyCFunction)Device_close, METH_VARARGS, "Close the board, init() opens it again"},
+	{"read", (PyCFunction)Device_read, METH_VARARGS, "Read data from the board, waits up to timeout seconds for min_packets packets"},
+	{"read_batch", (PyCFunction)Device_read_batch, METH_VARARGS, "Read packets into one flat batch (values, offsets, meta), waits up to timeout seconds for min_packets packets"},
+	{"read_channels", (PyCFunction)Device_read_channels, METH_VARARGS, "Like read_batch() but with one contiguous array per enabled TDC channel (values, offsets, meta)"},
+	{"start_streaming", (PyCFunction)Device_start_streaming, METH_VARARGS, "Start a native thread that reads and decodes into a queue of batches"},
+	{"stop_streaming", (PyCFunction)Device_stop_streaming, METH_VARARGS, "Stop the streaming thread"},
+	{"pop", (PyCFunction)Device_pop, METH_VARARGS, "Pop the next batch of the streaming thread, None if none is ready within timeout seconds"},
+	{"streaming_info", (PyCFunction)Device_streaming_info, METH_VARARGS, "State of the streaming thread and its queue"},
+	{"set_backpressure", (PyCFunction)Device_set_backpressure, METH_VARARGS, "Let the streaming thread pause the board instead of dropping data, enabled[, queue_high, queue_low, buffer_high] as fractions"},
+	{"set_load_shedding", (PyCFunction)Device_set_load_shedding, METH_VARARGS, "Let the streaming thread shed data under load instead of dropping batches, policy[, n, high, low] with SHED_* policies and fractions of the queue"},
+	{"record", (PyCFunction)Device_record, METH_VARARGS, "Copy the raw packets of every read to disk from a writer thread, path[, segment_size, block_size] in bytes"},
+	{"stop_recording", (PyCFunction)Device_stop_recording, METH_VARARGS, "Write what is left of the recording and close it, returns recording_info()"},
+	{"recording_info", (PyCFunction)Device_recording_info, METH_VARARGS, "State of the recording: bytes recorded, written and lost, segments, stalls and the first error"},
+	{"pause_log", (PyCFunction)Device_pause_log, METH_VARARGS, "Pauses of the board by backpressure with the packet timestamps around each gap, clear removes the finished ones"},
+	{"read_raw", (PyCFunction)Device_read_raw, METH_VARARGS, "Read packets as a zero-copy PacketBuffer, acknowledged when released, None if none arrive within timeout seconds"},
+	{"read_into", (PyCFunction)Device_read_into, METH_VARARGS, "Decode into caller-provided (values, offsets, meta) buffers, int64 values in the given mode, returns (hits, packets, more)"},
+	{"stats", (PyCFunction)Device_stats, METH_VARARGS, "Counters of packets read, packet flags and groups dropped, without taking the device lock"},
+	{"reset_stats", (PyCFunction)Device_reset_stats, METH_VARARGS, "Set the counters of stats() to zero"},
+	{"set_clock", (PyCFunction)Device_set_clock, METH_VARARGS, "Set the correction of OUTPUT_PS times, t + offset + drift * (t - pivot), no arguments for none"},
+	{"__enter__", (PyCFunction)Device_enter, METH_NOARGS, NULL},
+	{"__exit__", (PyCFunction)Device_exit, METH_VARARGS, NULL},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef Device_getset[] = {
+	{(char*)"card_index", (getter)Device_get_card_index, NULL, (char*)"index of the board among the TimeTagger4 boards in the system", NULL},
+	{(char*)"board_id", (getter)Device_get_board_id, NULL, (char*)"value of the card field of every packet", NULL},
+	{(char*)"buffer_size", (getter)Device_get_buffer_size, NULL, (char*)"size of the packet buffer in bytes requested from the driver", NULL},
+	{(char*)"initialized", (getter)Device_get_initialized, NULL, (char*)"True between init() and close()", NULL},
+	{(char*)"binsize", (getter)Device_get_binsize, NULL, (char*)"TDC bin size in ps, set by config()", NULL},
+	{(char*)"packet_binsize", (getter)Device_get_packet_binsize, NULL, (char*)"packet timestamp bin size in ps, set by config()", NULL},
+	{(char*)"rollover_period", (getter)Device_get_rollover_period, NULL, (char*)"TDC bins per overflow of the hit timestamp, set by config()", NULL},
+	{(char*)"tdc_mode", (getter)Device_get_tdc_mode, NULL, (char*)"TDC_MODE_GROUPED or TDC_MODE_CONTINUOUS, set by config()", NULL},
+	{(char*)"last_wait", (getter)Device_get_last_wait, NULL, (char*)"seconds the last read waited for data", NULL},
+	{(char*)"clock", (getter)Device_get_clock, NULL, (char*)"(offset, drift, pivot) applied to OUTPUT_PS times, see set_clock()", NULL},
+	{NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyTypeObject* create_device_type() {
+	PyType_Slot slots[] = {
+		{Py_tp_new, (void*)PyType_GenericNew},
+		{Py_tp_init, (void*)Device_tp_init},
+		{Py_tp_dealloc, (void*)Device_dealloc},
+		{Py_tp_doc, (void*)"Device(card_index=0, board_id=0, buffer_size=8 MiB)\n\n"
+			"One TimeTagger4 board with its own handle, read state and streaming thread. "
+			"Each board has its own lock, so several devices acquire in parallel."},
+		{Py_tp_methods, Device_methods},
+		{Py_tp_getset, Device_getset},
+		{0, NULL}
+	};
+	PyType_Spec spec = {
+		MODULE_NAME ".Device",
+		sizeof(DeviceObject),
+		0,
+		Py_TPFLAGS_DEFAULT,
+		slots
+	};
+	return (PyTypeObject*)PyType_FromSpec(&spec);
+}
+
+// The module functions act on the default device, Device() with the default
+// parameters, and mirror its scale factors and last_wait in module attributes
+static DeviceObject* default_device = NULL;
+static PyTypeObject* DeviceType = NULL;
+
+static PyObject* default_device_result(PyObject* module, PyObject* result) {
+	if (!result)
+		return NULL;
+	device_state* d = default_device->state;
+	PyObject* binsize = PyFloat_FromDouble(d->parinfo.binsize);
+	PyObject* packet_binsize = PyFloat_FromDouble(d->parinfo.packet_binsize);
+	PyObject* rollover_period = PyLong_FromUnsignedLong(d->static_info.rollover_period);
+	PyObject* mode = PyLong_FromLong(d->tdc_mode);
+	PyObject* last_wait = PyFloat_FromDouble(d->last_wait);
+	int attr_status = (binsize && packet_binsize && rollover_period && mode && last_wait &&
+		PyObject_SetAttrString(module, "binsize", binsize) == 0 &&
+		PyObject_SetAttrString(module, "packet_binsize", packet_binsize) == 0 &&
+		PyObject_SetAttrString(module, "rollover_period", rollover_period) == 0 &&
+		PyObject_SetAttrString(module, "tdc_mode", mode) == 0 &&
+		PyObject_SetAttrString(module, "last_wait", last_wait) == 0) ? 0 : -1;
+	Py_XDECREF(binsize);
+	Py_XDECREF(packet_binsize);
+	Py_XDECREF(rollover_period);
+	Py_XDECREF(mode);
+	Py_XDECREF(last_wait);
+	if (attr_status < 0) {
+		Py_DECREF(result);
+		return NULL;
+	}
+	return result;
+}
+
+static PyObject* timetagger4vector_init(PyObject* self, PyObject* args) {
+	return default_device_result(self, Device_init(default_device, args));
+}
+
+static PyObject* timetagger4vector_config(PyObject* self, PyObject* args) {
+	return default_device_result(self, Device_config(default_device, args));
+}
+
+static PyObject* timetagger4vector_buffer_size_for(PyObject* self, PyObject* args) {
+	double hit_rate;
+	double stall_time;
+	double group_rate = -1.0;
+	if (!PyArg_ParseTuple(args, "dd|d", &hit_rate, &stall_time, &group_rate))
+		return NULL;
+	unsigned long long size = parse_auto_buffer_size(hit_rate, stall_time, group_rate);
+	return size ? PyLong_FromUnsignedLongLong(size) : NULL;
+}
+
+static PyObject* timetagger4vector_configure(PyObject* self, PyObject* args) {
+	return default_device_result(self, Device_configure(default_device, args));
+}
+
+static PyObject* timetagger4vector_get_config(PyObject* self, PyObject* args) {
+	return default_device_result(self, Device_get_config(default_device, args));
+}
+
+static PyObject* timetagger4vector_start(PyObject* self, PyObject* args) {
+	return default_device_result(self, Device_start(default_device, args));
+}
+
+static PyObject* timetagger4vector_stop(PyObject* self, PyObject* args) {
+	return default_device_result(self, Device_stop(default_device, args));
+}
+
+static PyObject* timetagger4vector_close(PyObject* self, PyObject* args) {
+	return default_device_result(self, Device_close(default_device, args));
+}
+
+static PyObject* timetagger4vector_read(PyObject* self, PyObject* args) {
+	return default_device_result(self, Device_read(default_device, args));
+}
+
+static PyObject* timetagger4vector_read_batch(PyObject* self, PyObject* args) {
+	return default_device_result(self, Device_read_batch(default_device, args));
+}
+
+static PyObject* timetagger4vector_read_channels(PyObject* self, PyObject* args) {
+	return default_device_result(self, Device_read_channels(default_device, args));
+}
+
+static PyObject* timetagger4vector_start_streaming(PyObject* self, PyObject* args) {
+	return default_device_result(self, Device_start_streaming(default_device, args));
+}
+
+static PyObject* timetagger4vector_stop_streaming(PyObject* self, PyObject* args) {
+	return default_device_result(self, Device_stop_streaming(default_device, args));
+}
+
+static PyObject* timetagger4vector_pop(PyObject* self, PyObject* args) {
+	return default_device_result(self, Device_pop(default_device, args));
+}
+
+static PyObject* timetagger4vector_streaming_info(PyObject* self, PyObject* args) {
+	return default_device_result(self, Device_streaming_info(default_device, args));
+}
+
+static PyObject* timetagger4vector_set_backpressure(PyObject* self, PyObject* args) {
+	return default_device_result(self, Device_set_backpressure(default_device, args));
+}
+
+static PyObject* timetagger4vector_set_load_shedding(PyObject* self, PyObject* args) {
+	return default_device_result(self, Device_set_load_shedding(default_device, args));
+}
+
+static PyObject* timetagger4vector_pause_log(PyObject* self, PyObject* args) {
+	return default_device_result(self, Device_pause_log(default_device, args));
+}
+
+static PyObject* timetagger4vector_record(PyObject* self, PyObject* args) {
+	return default_device_result(self, Device_record(default_device, args));
+}
+
+static PyObject* timetagger4vector_stop_recording(PyObject* self, PyObject* args) {
+	return default_device_result(self, Device_stop_recording(default_device, args));
+}
+
+static PyObject* timetagger4vector_recording_info(PyObject* self, PyObject* args) {
+	return default_device_result(self, Device_recording_info(default_device, args));
+}
+
+static PyObject* timetagger4vector_read_raw(PyObject* self, PyObject* args) {
+	return default_device_result(self, Device_read_raw(default_device, args));
+}
+
+static PyObject* timetagger4vector_read_into(PyObject* self, PyObject* args) {
+	return default_device_result(self, Device_read_into(default_device, args));
+}
+
+static PyObject* timetagger4vector_stats(PyObject* self, PyObject* args) {
+	return default_device_result(self, Device_stats(default_device, args));
+}
+
+static PyObject* timetagger4vector_reset_stats(PyObject* self, PyObject* args) {
+	return default_device_result(self, Device_reset_stats(default_device, args));
+}
+
+// Adds the Device type and the default device the module functions act on
+static int add_device_type(PyObject* module) {
+	PyTypeObject* device_type = create_device_type();
+	if (!device_type)
+		return -1;
+	// the module reference keeps DeviceType alive
+	Py_INCREF(device_type);
+	if (PyModule_AddObject(module, "Device", (PyObject*)device_type) < 0) {
+		Py_DECREF(device_type);
+		Py_DECREF(device_type);
+		return -1;
+	}
+	DeviceType = device_type;
+	default_device = (DeviceObject*)PyObject_CallObject((PyObject*)device_type, NULL);
+	if (!default_device)
+		return -1;
+	// the module keeps one reference, the other one lives as long as the process
+	Py_INCREF(default_device);
+	if (PyModule_AddObject(module, "default_device", (PyObject*)default_device) < 0) {
+		Py_DECREF(default_device);
+		return -1;
+	}
+	return 0;
+}
+
+// Native k-way merge of the OUTPUT_PS batches of several cards
+struct MergerObject {
+	PyObject_HEAD
+	hit_merger* merger;	// NULL until __init__ ran
+};
+
+static hit_merger* merger_of(MergerObject* self) {
+	if (!self->merger)
+		PyErr_SetString(PyExc_RuntimeError, "Merger.__init__() was not called");
+	return self->merger;
+}
+
+static int Merger_tp_init(MergerObject* self, PyObject* args, PyObject* kwds) {
+	static const char* keywords[] = { "sources", "window", NULL };
+	int sources;
+	long long window = 0;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "i|L", (char**)keywords, &sources, &window))
+		return -1;
+	if (sources < 1) {
+		PyErr_SetString(PyExc_ValueError, "sources must be at least 1");
+		return -1;
+	}
+	if (window < 0) {
+		PyErr_SetString(PyExc_ValueError, "window must not be negative");
+		return -1;
+	}
+	hit_merger* merger = new (std::nothrow) hit_merger((size_t)sources, (int64_t)window);
+	if (!merger) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	delete self->merger;
+	self->merger = merger;
+	return 0;
+}
+
+static void Merger_dealloc(MergerObject* self) {
+	delete self->merger;
+	PyTypeObject* type = Py_TYPE(self);
+	type->tp_free((PyObject*)self);
+	Py_DECREF(type);
+}
+
+static bool check_source(hit_merger* merger, int source) {
+	if (source < 0 || (size_t)source >= merger->source_count()) {
+		PyErr_SetString(PyExc_IndexError, "source out of range");
+		return false;
+	}
+	return true;
+}
+
+// Buffers of the arrays of a Batch with channels
+struct batch_buffers {
+	Py_buffer values;
+	Py_buffer offsets;
+	Py_buffer meta;
+	Py_buffer channels;
+	size_t packet_count;
+	size_t hit_count;
+};
+
+static void release_batch_buffers(batch_buffers* b) {
+	PyBuffer_Release(&b->values);
+	PyBuffer_Release(&b->offsets);
+	PyBuffer_Release(&b->meta);
+	PyBuffer_Release(&b->channels);
+}
+
+// The offsets run from 0 to hit_count without going back, and every packet
+// holds the hits its meta counts. The consumers index the values through them.
+static bool batch_offsets_valid(const batch_buffers* b) {
+	const int64_t* offsets = (const int64_t*)b->offsets.buf;
+	const batch_meta* meta = (const batch_meta*)b->meta.buf;
+	if (offsets[0] != 0 || offsets[b->packet_count] != (int64_t)b->hit_count)
+		return false;
+	for (size_t i = 0; i < b->packet_count; i++) {
+		if (offsets[i + 1] < offsets[i] || offsets[i + 1] > (int64_t)b->hit_count ||
+			(int64_t)meta[i].hit_count != offsets[i + 1] - offsets[i])
+			return false;
+	}
+	return true;
+}
+
+// Gets the arrays of a Batch from read_batch(OUTPUT_PS), pop() or PacketBuffer.decode()
+// and checks that they fit together. Returns false with an exception set.
+static bool get_ps_batch_buffers(PyObject* batch_obj, batch_buffers* b) {
+	const int flags = PyBUF_C_CONTIGUOUS | PyBUF_FORMAT;
+	if (PyObject_GetBuffer(PyStructSequence_GetItem(batch_obj, 0), &b->values, flags) < 0)
+		return false;
+	if (PyObject_GetBuffer(PyStructSequence_GetItem(batch_obj, 1), &b->offsets, flags) < 0) {
+		PyBuffer_Release(&b->values);
+		return false;
+	}
+	if (PyObject_GetBuffer(PyStructSequence_GetItem(batch_obj, 2), &b->meta, flags) < 0) {
+		PyBuffer_Release(&b->values);
+		PyBuffer_Release(&b->offsets);
+		return false;
+	}
+	PyObject* channels_obj = PyStructSequence_GetItem(batch_obj, 4);
+	if (channels_obj == Py_None || PyObject_GetBuffer(channels_obj, &b->channels, flags) < 0) {
+		PyBuffer_Release(&b->values);
+		PyBuffer_Release(&b->offsets);
+		PyBuffer_Release(&b->meta);
+		if (channels_obj == Py_None)
+			PyErr_SetString(PyExc_ValueError, "batch has no channels");
+		return false;
+	}
+	b->packet_count = (size_t)(b->meta.len / (Py_ssize_t)sizeof(batch_meta));
+	b->hit_count = (size_t)(b->values.len / (Py_ssize_t)sizeof(int64_t));
+	const char* error = NULL;
+	if (!is_int64_buffer(&b->values))
+		error = "batch values must be int64 ps, read with OUTPUT_PS";
+	else if (!is_int64_buffer(&b->offsets) || b->offsets.len != (Py_ssize_t)((b->packet_count + 1) * sizeof(int64_t)))
+		error = "batch offsets do not match its meta";
+	else if (b->meta.itemsize != (Py_ssize_t)sizeof(batch_meta) || b->channels.len != (Py_ssize_t)b->hit_count)
+		error = "batch meta or channels do not match its values";
+	else if (!batch_offsets_valid(b))
+		error = "batch offsets do not match its values";
+	if (error) {
+		release_batch_buffers(b);
+		PyErr_SetString(PyExc_ValueError, error);
+		return false;
+	}
+	return true;
+}
 
+static PyObject* Merger_push(MergerObject* self, PyObject* args) {
+	int source;
+	PyObject* batch_obj;
+	if (!PyArg_ParseTuple(args, "iO!", &source, &BatchType, &batch_obj))
+		return NULL;
+	hit_merger* merger = merger_of(self);
+	if (!merger || !check_source(merger, source))
+		return NULL;
+
+	batch_buffers b;
+	if (!get_ps_batch_buffers(batch_obj, &b))
+		return NULL;
+	bool ok;
+	Py_BEGIN_ALLOW_THREADS
+	ok = merger->push((size_t)source, (const int64_t*)b.values.buf, (const uint8_t*)b.channels.buf,
+		(const int64_t*)b.offsets.buf, (const batch_meta*)b.meta.buf, b.packet_count);
+	Py_END_ALLOW_THREADS
+	release_batch_buffers(&b);
+	if (!ok)
+		return PyErr_NoMemory();
+	Py_RETURN_NONE;
+}
+
+static PyObject* Merger_finish(MergerObject* self, PyObject* args) {
+	int source;
+	if (!PyArg_ParseTuple(args, "i", &source))
+		return NULL;
+	hit_merger* merger = merger_of(self);
+	if (!merger || !check_source(merger, source))
+		return NULL;
+	merger->finish((size_t)source);
+	Py_RETURN_NONE;
+}
+
+static PyObject* Merger_pop(MergerObject* self, PyObject* args) {
+	int flush = 0;
+	if (!PyArg_ParseTuple(args, "|p", &flush))
+		return NULL;
+	hit_merger* merger = merger_of(self);
+	if (!merger)
+		return NULL;
+	merged_hits hits;
+	bool ok;
+	Py_BEGIN_ALLOW_THREADS
+	ok = merger->pop(&hits, flush != 0);
+	Py_END_ALLOW_THREADS
+	if (!ok)
+		return PyErr_NoMemory();
+
+	PyObject* result = PyStructSequence_New(&MergedType);
+	if (!result) {
+		merged_hits_free(&hits);
+		return NULL;
+	}
+	npy_intp count = (npy_intp)hits.count;
+	PyObject* times = array_from_buffer(hits.times, count, PyArray_DescrFromType(NPY_INT64));
+	PyObject* cards = array_from_buffer(hits.cards, count, PyArray_DescrFromType(NPY_UINT8));
+	PyObject* channels = array_from_buffer(hits.channels, count, PyArray_DescrFromType(NPY_UINT8));
+	if (!times || !cards || !channels) {
+		Py_XDECREF(times);
+		Py_XDECREF(cards);
+		Py_XDECREF(channels);
+		Py_DECREF(result);
+		return NULL;
+	}
+	PyStructSequence_SetItem(result, 0, times);
+	PyStructSequence_SetItem(result, 1, cards);
+	PyStructSequence_SetItem(result, 2, channels);
+	return result;
+}
+
+static PyObject* Merger_get_sources(MergerObject* self, void* closure) {
+	hit_merger* merger = merger_of(self);
+	return merger ? PyLong_FromSize_t(merger->source_count()) : NULL;
+}
+
+static PyObject* Merger_get_window(MergerObject* self, void* closure) {
+	hit_merger* merger = merger_of(self);
+	return merger ? PyLong_FromLongLong(merger->reorder_window()) : NULL;
+}
+
+static PyObject* Merger_get_pending(MergerObject* self, void* closure) {
+	hit_merger* merger = merger_of(self);
+	return merger ? PyLong_FromSize_t(merger->pending()) : NULL;
+}
+
+static PyObject* Merger_get_late_hits(MergerObject* self, void* closure) {
+	hit_merger* merger = merger_of(self);
+	return merger ? PyLong_FromUnsignedLongLong(merger->late_hits()) : NULL;
+}
+
+static PyMethodDef Merger_methods[] = {
+	{"push", (PyCFunction)Merger_push, METH_VARARGS, "Add an OUTPUT_PS Batch of the given source"},
+	{"finish", (PyCFunction)Merger_finish, METH_VARARGS, "Mark a source as ended, it no longer holds the merge back"},
+	{"pop", (PyCFunction)Merger_pop, METH_VARARGS, "Take the hits no source can precede any more as a Merged, all pending hits if flush"},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef Merger_getset[] = {
+	{(char*)"sources", (getter)Merger_get_sources, NULL, (char*)"number of sources", NULL},
+	{(char*)"window", (getter)Merger_get_window, NULL, (char*)"reorder window in ps", NULL},
+	{(char*)"pending", (getter)Merger_get_pending, NULL, (char*)"hits pushed and not popped yet", NULL},
+	{(char*)"late_hits", (getter)Merger_get_late_hits, NULL, (char*)"hits dropped because they arrived behind the merged stream", NULL},
+	{NULL, NULL, NULL, NULL, NULL}
+};
+
+static int add_merger_type(PyObject* module) {
+	PyType_Slot slots[] = {
+		{Py_tp_new, (void*)PyType_GenericNew},
+		{Py_tp_init, (void*)Merger_tp_init},
+		{Py_tp_dealloc, (void*)Merger_dealloc},
+		{Py_tp_doc, (void*)"Merger(sources, window=0)\n\n"
+			"Merges the OUTPUT_PS batches of several cards into one time-ordered stream. "
+			"A source may go back in time by up to window ps, hits further back are counted in late_hits and dropped."},
+		{Py_tp_methods, Merger_methods},
+		{Py_tp_getset, Merger_getset},
+		{0, NULL}
+	};
+	PyType_Spec spec = {
+		MODULE_NAME ".Merger",
+		sizeof(MergerObject),
+		0,
+		Py_TPFLAGS_DEFAULT,
+		slots
+	};
+	PyObject* merger_type = PyType_FromSpec(&spec);
+	if (!merger_type)
+		return -1;
+	if (PyModule_AddObject(module, "Merger", merger_type) < 0) {
+		Py_DECREF(merger_type);
+		return -1;
+	}
+	Py_INCREF(&MergedType);
+	if (PyModule_AddObject(module, "Merged", (PyObject*)&MergedType) < 0) {
+		Py_DECREF(&MergedType);
+		return -1;
+	}
+	return 0;
+}
+
+// Clock offset and drift of several cards against a reference card
+struct ClockSyncObject {
+	PyObject_HEAD
+	PyObject* devices;	// tuple, the reference device first
+	clock_sync* sync;	// NULL until __init__ ran
+};
+
+static clock_sync* clock_sync_of(ClockSyncObject* self) {
+	if (!self->sync)
+		PyErr_SetString(PyExc_RuntimeError, "ClockSync is closed or __init__() was not called");
+	return self->sync;
+}
+
+static device_state* clock_device(ClockSyncObject* self, Py_ssize_t index) {
+	return ((DeviceObject*)PyTuple_GET_ITEM(self->devices, index))->state;
+}
+
+// Stops recording reference events on all devices, once, the devices may be
+// in a new ClockSync by the time a closed one goes away
+static void clock_sync_close(ClockSyncObject* self) {
+	if (!self->sync)
+		return;
+	for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(self->devices); i++) {
+		device_state* d = clock_device(self, i);
+		std::lock_guard<std::mutex> lock(d->device_mutex);
+		d->reference_events.source = CLOCK_EVENTS_OFF;
+		d->reference_events.events.clear();
+	}
+	delete self->sync;
+	self->sync = NULL;
+}
+
+static int ClockSync_tp_init(ClockSyncObject* self, PyObject* args, PyObject* kwds) {
+	static const char* keywords[] = { "reference", "devices", "source", "tolerance", "half_life", NULL };
+	PyObject* reference;
+	PyObject* others;
+	int source = CLOCK_EVENTS_GROUP_START;
+	long long tolerance = DEFAULT_CLOCK_TOLERANCE;
+	double half_life = DEFAULT_CLOCK_HALF_LIFE;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|iLd", (char**)keywords,
+		&reference, &others, &source, &tolerance, &half_life))
+		return -1;
+	if (source < CLOCK_EVENTS_GROUP_START || source > 3) {
+		PyErr_SetString(PyExc_ValueError, "source must be CLOCK_GROUP_START or a TDC channel 0..3");
+		return -1;
+	}
+	if (tolerance <= 0) {
+		PyErr_SetString(PyExc_ValueError, "tolerance must be positive");
+		return -1;
+	}
+	if (!(half_life >= 1.0) || !isfinite(half_life)) {
+		PyErr_SetString(PyExc_ValueError, "half_life must be at least 1 pair");
+		return -1;
+	}
+	PyObject* sequence = PySequence_Fast(others, "devices must be a sequence of Device");
+	if (!sequence)
+		return -1;
+	Py_ssize_t count = PySequence_Fast_GET_SIZE(sequence);
+	PyObject* devices = PyTuple_New(count + 1);
+	if (!devices) {
+		Py_DECREF(sequence);
+		return -1;
+	}
+	Py_INCREF(reference);
+	PyTuple_SET_ITEM(devices, 0, reference);
+	for (Py_ssize_t i = 0; i < count; i++) {
+		PyObject* device = PySequence_Fast_GET_ITEM(sequence, i);
+		Py_INCREF(device);
+		PyTuple_SET_ITEM(devices, i + 1, device);
+	}
+	Py_DECREF(sequence);
+	for (Py_ssize_t i = 0; i <= count; i++) {
+		PyObject* device = PyTuple_GET_ITEM(devices, i);
+		if (!PyObject_TypeCheck(device, DeviceType)) {
+			PyErr_SetString(PyExc_TypeError, "reference and devices must be Device objects");
+			Py_DECREF(devices);
+			return -1;
+		}
+		if (!device_of((DeviceObject*)device)) {
+			Py_DECREF(devices);
+			return -1;
+		}
+		for (Py_ssize_t j = 0; j < i; j++) {
+			if (PyTuple_GET_ITEM(devices, j) == device) {
+				PyErr_SetString(PyExc_ValueError, "a device may only be given once");
+				Py_DECREF(devices);
+				return -1;
+			}
+		}
+	}
+	clock_sync* sync = new (std::nothrow) clock_sync((size_t)count + 1, (int64_t)tolerance, half_life);
+	if (!sync) {
+		Py_DECREF(devices);
+		PyErr_NoMemory();
+		return -1;
+	}
+	clock_sync_close(self);
+	Py_XDECREF(self->devices);
+	self->devices = devices;
+	self->sync = sync;
+	for (Py_ssize_t i = 0; i <= count; i++) {
+		device_state* d = clock_device(self, i);
+		std::lock_guard<std::mutex> lock(d->device_mutex);
+		d->reference_events.source = source;
+		d->reference_events.events.clear();
+		d->reference_events.dropped = 0;
+		// the reference card defines the timeline
+		if (i == 0)
+			memset(&d->clock, 0, sizeof(d->clock));
+	}
+	return 0;
+}
+
+static void ClockSync_dealloc(ClockSyncObject* self) {
+	clock_sync_close(self);
+	Py_XDECREF(self->devices);
+	PyTypeObject* type = Py_TYPE(self);
+	type->tp_free((PyObject*)self);
+	Py_DECREF(type);
+}
+
+static PyObject* clock_card_info(clock_sync* sync, size_t card, double binsize, uint64_t dropped) {
+	clock_correction clock = sync->correction(card);
+	double rms = sync->rms(card);
+	uint64_t pairs = sync->pairs(card);
+	// the reference card defines the timeline and is always locked
+	bool locked = card == 0 || (pairs >= 2 && rms < binsize);
+	return Py_BuildValue("{s:d,s:d,s:L,s:d,s:K,s:K,s:K,s:O}",
+		"offset", clock.offset,
+		"drift", clock.drift,
+		"pivot", (long long)clock.pivot,
+		"rms", rms,
+		"pairs", (unsigned long long)pairs,
+		"unmatched", (unsigned long long)sync->unmatched(card),
+		"dropped", (unsigned long long)dropped,
+		"locked", locked ? Py_True : Py_False);
+}
+
+static PyObject* ClockSync_update(ClockSyncObject* self, PyObject* args) {
+	clock_sync* sync = clock_sync_of(self);
+	if (!sync)
+		return NULL;
+	Py_ssize_t count = PyTuple_GET_SIZE(self->devices);
+	std::vector<uint64_t> dropped(count);
+	try {
+		// the reference first so the cards can pair against everything it saw by now
+		for (Py_ssize_t i = 0; i < count; i++) {
+			device_state* d = clock_device(self, i);
+			std::vector<int64_t> events;
+			{
+				std::lock_guard<std::mutex> lock(d->device_mutex);
+				events.swap(d->reference_events.events);
+				dropped[i] = d->reference_events.dropped;
+			}
+			if (i == 0)
+				sync->add_reference(events);
+			else
+				sync->add_local((size_t)i, events);
+		}
+		sync->trim();
+	}
+	catch (const std::bad_alloc&) {
+		return PyErr_NoMemory();
+	}
+	PyObject* result = PyTuple_New(count);
+	if (!result)
+		return NULL;
+	for (Py_ssize_t i = 0; i < count; i++) {
+		device_state* d = clock_device(self, i);
+		double binsize;
+		{
+			std::lock_guard<std::mutex> lock(d->device_mutex);
+			if (i > 0)
+				d->clock = sync->correction((size_t)i);
+			binsize = d->parinfo.binsize;
+		}
+		PyObject* info = clock_card_info(sync, (size_t)i, binsize, dropped[i]);
+		if (!info) {
+			Py_DECREF(result);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(result, i, info);
+	}
+	return result;
+}
+
+static PyObject* ClockSync_set_offset(ClockSyncObject* self, PyObject* args) {
+	Py_ssize_t index;
+	long long offset;
+	if (!PyArg_ParseTuple(args, "nL", &index, &offset))
+		return NULL;
+	clock_sync* sync = clock_sync_of(self);
+	if (!sync)
+		return NULL;
+	if (index < 1 || index >= PyTuple_GET_SIZE(self->devices)) {
+		PyErr_SetString(PyExc_IndexError, "index must select one of devices, 1 is the first");
+		return NULL;
+	}
+	sync->set_initial_offset((size_t)index, (int64_t)offset);
+	Py_RETURN_NONE;
+}
+
+static PyObject* ClockSync_close(ClockSyncObject* self, PyObject* args) {
+	clock_sync_close(self);
+	Py_RETURN_NONE;
+}
+
+static PyObject* ClockSync_get_devices(ClockSyncObject* self, void* closure) {
+	if (!self->devices)
+		return PyTuple_New(0);
+	Py_INCREF(self->devices);
+	return self->devices;
+}
+
+static PyMethodDef ClockSync_methods[] = {
+	{"update", (PyCFunction)ClockSync_update, METH_VARARGS, "Pair the reference events recorded since the last update, refit and set the clock of every device, returns one dict per device"},
+	{"set_offset", (PyCFunction)ClockSync_set_offset, METH_VARARGS, "Set the approximate offset in ps of devices[index - 1] before its first pair"},
+	{"close", (PyCFunction)ClockSync_close, METH_VARARGS, "Stop recording reference events, the clocks of the devices stay as they are"},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef ClockSync_getset[] = {
+	{(char*)"devices", (getter)ClockSync_get_devices, NULL, (char*)"the reference device followed by the others", NULL},
+	{NULL, NULL, NULL, NULL, NULL}
+};
+
+static int add_clock_sync_type(PyObject* module) {
+	PyType_Slot slots[] = {
+		{Py_tp_new, (void*)PyType_GenericNew},
+		{Py_tp_init, (void*)ClockSync_tp_init},
+		{Py_tp_dealloc, (void*)ClockSync_dealloc},
+		{Py_tp_doc, (void*)"ClockSync(reference, devices, source=CLOCK_GROUP_START, tolerance=1000000, half_life=1000.0)\n\n"
+			"Estimates offset and drift of the clock of each device against the reference device from a signal all of them see, "
+			"the group starts or the hits of TDC channel source. update() refits from the events read since the last call "
+			"and sets the clock of each device, so OUTPUT_PS times of all devices share the timeline of the reference. "
+			"tolerance in ps has to be below half the period of the signal, half_life is in pairs."},
+		{Py_tp_methods, ClockSync_methods},
+		{Py_tp_getset, ClockSync_getset},
+		{0, NULL}
+	};
+	PyType_Spec spec = {
+		MODULE_NAME ".ClockSync",
+		sizeof(ClockSyncObject),
+		0,
+		Py_TPFLAGS_DEFAULT,
+		slots
+	};
+	PyObject* clock_sync_type = PyType_FromSpec(&spec);
+	if (!clock_sync_type)
+		return -1;
+	if (PyModule_AddObject(module, "ClockSync", clock_sync_type) < 0) {
+		Py_DECREF(clock_sync_type);
+		return -1;
+	}
+	return 0;
+}
+
+// Offline reader of the files written by record()
+struct RawFileObject {
+	PyObject_HEAD
+	raw_file* file;	// NULL until __init__ ran
+	bool busy;		// a read runs without the GIL
+};
+
+static raw_file* raw_file_of(RawFileObject* self) {
+	if (!self->file)
+		PyErr_SetString(PyExc_RuntimeError, "RawFile.__init__() was not called");
+	else if (self->busy)
+		PyErr_SetString(PyExc_RuntimeError, "another thread is reading the RawFile");
+	else if (!self->file->is_open())
+		PyErr_SetString(PyExc_ValueError, "the RawFile is closed");
+	else
+		return self->file;
+	return NULL;
+}
+
+static int RawFile_tp_init(RawFileObject* self, PyObject* args, PyObject* kwds) {
+	static const char* keywords[] = { "path", NULL };
+	const char* path;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", (char**)keywords, &path))
+		return -1;
+	if (self->busy) {
+		PyErr_SetString(PyExc_RuntimeError, "another thread is reading the RawFile");
+		return -1;
+	}
+	raw_file* file = new (std::nothrow) raw_file();
+	if (!file) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	const char* error = file->open(path);
+	if (error) {
+		delete file;
+		PyErr_Format(PyExc_OSError, "%s: %s", error, path);
+		return -1;
+	}
+	delete self->file;
+	self->file = file;
+	return 0;
+}
+
+static void RawFile_dealloc(RawFileObject* self) {
+	delete self->file;
+	PyTypeObject* type = Py_TYPE(self);
+	type->tp_free((PyObject*)self);
+	Py_DECREF(type);
+}
+
+static PyObject* RawFile_read(RawFileObject* self, PyObject* args) {
+	int mode = OUTPUT_NS;
+	unsigned long long max_bytes = RAWFILE_DEFAULT_CHUNK;
+	int threads = 0;
+	if (!PyArg_ParseTuple(args, "|iKi", &mode, &max_bytes, &threads))
+		return NULL;
+	raw_file* file = raw_file_of(self);
+	if (!file)
+		return NULL;
+	if (mode != OUTPUT_NS && mode != OUTPUT_BINS && mode != OUTPUT_PS) {
+		PyErr_SetString(PyExc_ValueError, "mode must be OUTPUT_NS, OUTPUT_BINS or OUTPUT_PS");
+		return NULL;
+	}
+	if (threads <= 0)
+		threads = (int)std::thread::hardware_concurrency();
+	if (file->position >= file->size)
+		Py_RETURN_NONE;
+	hit_batch batch;
+	batch_init(&batch, mode);
+	bool ok;
+	// the rest of the file at most, which fits in a size_t
+	if (max_bytes > file->size - file->position)
+		max_bytes = file->size - file->position;
+	self->busy = true;
+	Py_BEGIN_ALLOW_THREADS
+	try {
+		ok = file->read(&batch, (size_t)max_bytes, threads);
+	}
+	catch (const std::bad_alloc&) {
+		ok = false;
+	}
+	Py_END_ALLOW_THREADS
+	self->busy = false;
+	if (!ok) {
+		batch_free(&batch);
+		return PyErr_NoMemory();
+	}
+	// only an incomplete packet was left
+	if (batch.packet_count == 0) {
+		batch_free(&batch);
+		Py_RETURN_NONE;
+	}
+	return batch_to_python(&batch, 0.0);
+}
+
+static PyObject* RawFile_rewind(RawFileObject* self, PyObject* args) {
+	raw_file* file = raw_file_of(self);
+	if (!file)
+		return NULL;
+	file->rewind();
+	Py_RETURN_NONE;
+}
+
+static PyObject* RawFile_close(RawFileObject* self, PyObject* args) {
+	if (self->busy) {
+		PyErr_SetString(PyExc_RuntimeError, "another thread is reading the RawFile");
+		return NULL;
+	}
+	if (self->file)
+		self->file->close();
+	Py_RETURN_NONE;
+}
 
+static PyObject* RawFile_get_header(RawFileObject* self, void* closure) {
+	raw_file* file = raw_file_of(self);
+	if (!file)
+		return NULL;
+	const record_header& h = file->header();
+	return Py_BuildValue("{s:I,s:I,s:i,s:i,s:i,s:L,s:d,s:d,s:L}",
+		"version", (unsigned int)h.version,
+		"segment", (unsigned int)h.segment,
+		"tdc_mode", (int)h.tdc_mode,
+		"card_index", (int)h.card_index,
+		"board_serial", (int)h.board_serial,
+		"rollover_period", (long long)h.rollover_period,
+		"binsize", h.binsize,
+		"packet_binsize", h.packet_binsize,
+		"group_period", (long long)h.group_period);
+}
+
+static PyObject* RawFile_get_size(RawFileObject* self, void* closure) {
+	return PyLong_FromUnsignedLongLong(self->file ? self->file->size : 0);
+}
+
+static PyObject* RawFile_get_position(RawFileObject* self, void* closure) {
+	return PyLong_FromUnsignedLongLong(self->file ? self->file->position : 0);
+}
+
+static PyObject* RawFile_get_packets(RawFileObject* self, void* closure) {
+	return PyLong_FromUnsignedLongLong(self->file ? self->file->packets : 0);
+}
+
+static PyObject* RawFile_get_truncated(RawFileObject* self, void* closure) {
+	return PyLong_FromUnsignedLongLong(self->file ? self->file->truncated : 0);
+}
+
+static PyMethodDef RawFile_methods[] = {
+	{"read", (PyCFunction)RawFile_read, METH_VARARGS, "Decode the next chunk of packets into a Batch, None at the end, [mode, max_bytes, threads] with threads 0 for one per core"},
+	{"rewind", (PyCFunction)RawFile_rewind, METH_VARARGS, "Go back to the first packet"},
+	{"close", (PyCFunction)RawFile_close, METH_VARARGS, "Unmap and close the file"},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef RawFile_getset[] = {
+	{(char*)"header", (getter)RawFile_get_header, NULL, (char*)"board and scale factors of the recording", NULL},
+	{(char*)"size", (getter)RawFile_get_size, NULL, (char*)"size of the file in bytes", NULL},
+	{(char*)"position", (getter)RawFile_get_position, NULL, (char*)"byte offset of the next packet", NULL},
+	{(char*)"packets", (getter)RawFile_get_packets, NULL, (char*)"packets read since the start or rewind()", NULL},
+	{(char*)"truncated", (getter)RawFile_get_truncated, NULL, (char*)"bytes at the end that do not hold a whole packet", NULL},
+	{NULL, NULL, NULL, NULL, NULL}
+};
+
+static int add_raw_file_type(PyObject* module) {
+	PyType_Slot slots[] = {
+		{Py_tp_new, (void*)PyType_GenericNew},
+		{Py_tp_init, (void*)RawFile_tp_init},
+		{Py_tp_dealloc, (void*)RawFile_dealloc},
+		{Py_tp_doc, (void*)"RawFile(path)\n\n"
+			"Memory-maps a file written by record() and decodes its packets in chunks, "
+			"split across threads, into the Batch objects read_batch() returns."},
+		{Py_tp_methods, RawFile_methods},
+		{Py_tp_getset, RawFile_getset},
+		{0, NULL}
+	};
+	PyType_Spec spec = {
+		MODULE_NAME ".RawFile",
+		sizeof(RawFileObject),
+		0,
+		Py_TPFLAGS_DEFAULT,
+		slots
+	};
+	PyObject* raw_file_type = PyType_FromSpec(&spec);
+	if (!raw_file_type)
+		return -1;
+	if (PyModule_AddObject(module, "RawFile", raw_file_type) < 0) {
+		Py_DECREF(raw_file_type);
+		return -1;
+	}
+	return 0;
+}
+
+// Writer of the columnar hit files that load() reads
+struct HitWriterObject {
+	PyObject_HEAD
+	hit_writer* writer;	// NULL until __init__ ran
+	bool busy;			// a write runs without the GIL
+};
+
+static hit_writer* hit_writer_of(HitWriterObject* self) {
+	if (!self->writer)
+		PyErr_SetString(PyExc_RuntimeError, "HitWriter.__init__() was not called");
+	else if (self->busy)
+		PyErr_SetString(PyExc_RuntimeError, "another thread is writing to the HitWriter");
+	else if (!self->writer->is_open())
+		PyErr_SetString(PyExc_ValueError, "the HitWriter is closed");
+	else
+		return self->writer;
+	return NULL;
+}
+
+static int HitWriter_tp_init(HitWriterObject* self, PyObject* args, PyObject* kwds) {
+	static const char* keywords[] = { "path", "chunk_hits", "compress", NULL };
+	const char* path;
+	unsigned long long chunk_hits = HITFILE_DEFAULT_CHUNK_HITS;
+	int compress = 1;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|Kp", (char**)keywords, &path, &chunk_hits, &compress))
+		return -1;
+	if (chunk_hits < 1 || chunk_hits > 0x7fffffff / sizeof(int64_t)) {
+		PyErr_SetString(PyExc_ValueError, "chunk_hits must be within 1..268435455");
+		return -1;
+	}
+	if (self->busy) {
+		PyErr_SetString(PyExc_RuntimeError, "another thread is writing to the HitWriter");
+		return -1;
+	}
+	hit_writer* writer = new (std::nothrow) hit_writer();
+	if (!writer) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	const char* error = writer->open(path, (size_t)chunk_hits, compress ? HITFILE_DELTA : HITFILE_PLAIN);
+	if (error) {
+		delete writer;
+		PyErr_Format(PyExc_OSError, "%s: %s", error, path);
+		return -1;
+	}
+	delete self->writer;
+	self->writer = writer;
+	return 0;
+}
+
+static void HitWriter_dealloc(HitWriterObject* self) {
+	// closing writes the index, a writer dropped without close() still leaves a valid file
+	delete self->writer;
+	PyTypeObject* type = Py_TYPE(self);
+	type->tp_free((PyObject*)self);
+	Py_DECREF(type);
+}
+
+static PyObject* HitWriter_write(HitWriterObject* self, PyObject* args) {
+	PyObject* hits_obj;
+	if (!PyArg_ParseTuple(args, "O", &hits_obj))
+		return NULL;
+	hit_writer* writer = hit_writer_of(self);
+	if (!writer)
+		return NULL;
+	const char* error = NULL;
+	bool out_of_memory = false;
+	if (PyObject_TypeCheck(hits_obj, &BatchType)) {
+		batch_buffers b;
+		if (!get_ps_batch_buffers(hits_obj, &b))
+			return NULL;
+		self->busy = true;
+		Py_BEGIN_ALLOW_THREADS
+		try {
+			error = writer->append_batch((const int64_t*)b.values.buf, (const uint8_t*)b.channels.buf,
+				(const int64_t*)b.offsets.buf, (const batch_meta*)b.meta.buf, b.packet_count);
+		}
+		catch (const std::bad_alloc&) {
+			out_of_memory = true;
+		}
+		Py_END_ALLOW_THREADS
+		self->busy = false;
+		release_batch_buffers(&b);
+	}
+	else if (PyObject_TypeCheck(hits_obj, &MergedType)) {
+		// the merged hits carry no packet flags, they are written as 0
+		const int flags = PyBUF_C_CONTIGUOUS | PyBUF_FORMAT;
+		Py_buffer columns[3];
+		int got = 0;
+		for (; got < 3; got++) {
+			if (PyObject_GetBuffer(PyStructSequence_GetItem(hits_obj, got), &columns[got], flags) < 0)
+				break;
+		}
+		if (got == 3) {
+			size_t count = (size_t)(columns[0].len / (Py_ssize_t)sizeof(int64_t));
+			if (!is_int64_buffer(&columns[0]) || columns[1].len != (Py_ssize_t)count || columns[2].len != (Py_ssize_t)count)
+				PyErr_SetString(PyExc_ValueError, "Merged arrays do not match");
+			else {
+				self->busy = true;
+				Py_BEGIN_ALLOW_THREADS
+				try {
+					error = writer->append((const int64_t*)columns[0].buf, (const uint8_t*)columns[2].buf,
+						(const uint8_t*)columns[1].buf, NULL, count);
+				}
+				catch (const std::bad_alloc&) {
+					out_of_memory = true;
+				}
+				Py_END_ALLOW_THREADS
+				self->busy = false;
+			}
+		}
+		for (int i = 0; i < got; i++)
+			PyBuffer_Release(&columns[i]);
+		if (PyErr_Occurred())
+			return NULL;
+	}
+	else {
+		PyErr_SetString(PyExc_TypeError, "expected a Batch read with OUTPUT_PS or a Merged");
+		return NULL;
+	}
+	if (out_of_memory)
+		return PyErr_NoMemory();
+	if (error) {
+		PyErr_SetString(PyExc_OSError, error);
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject* HitWriter_close(HitWriterObject* self, PyObject* args) {
+	if (self->busy) {
+		PyErr_SetString(PyExc_RuntimeError, "another thread is writing to the HitWriter");
+		return NULL;
+	}
+	if (!self->writer)
+		Py_RETURN_NONE;
+	const char* error;
+	bool out_of_memory = false;
+	// write() refuses while the last chunk and the index are written
+	self->busy = true;
+	Py_BEGIN_ALLOW_THREADS
+	try {
+		error = self->writer->close();
+	}
+	catch (const std::bad_alloc&) {
+		out_of_memory = true;
+	}
+	Py_END_ALLOW_THREADS
+	self->busy = false;
+	if (out_of_memory)
+		return PyErr_NoMemory();
+	if (error) {
+		PyErr_SetString(PyExc_OSError, error);
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject* HitWriter_get_hits(HitWriterObject* self, void* closure) {
+	return PyLong_FromUnsignedLongLong(self->writer ? self->writer->hit_count : 0);
+}
+
+static PyObject* HitWriter_get_chunks(HitWriterObject* self, void* closure) {
+	return PyLong_FromSize_t(self->writer ? self->writer->chunks.size() : 0);
+}
+
+static PyMethodDef HitWriter_methods[] = {
+	{"write", (PyCFunction)HitWriter_write, METH_VARARGS, "Append the hits of an OUTPUT_PS Batch or a Merged"},
+	{"close", (PyCFunction)HitWriter_close, METH_VARARGS, "Write the last chunk and the index, and close the file"},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef HitWriter_getset[] = {
+	{(char*)"hits", (getter)HitWriter_get_hits, NULL, (char*)"hits in the chunks written so far", NULL},
+	{(char*)"chunks", (getter)HitWriter_get_chunks, NULL, (char*)"chunks written so far", NULL},
+	{NULL, NULL, NULL, NULL, NULL}
+};
+
+static int add_hit_writer_type(PyObject* module) {
+	PyType_Slot slots[] = {
+		{Py_tp_new, (void*)PyType_GenericNew},
+		{Py_tp_init, (void*)HitWriter_tp_init},
+		{Py_tp_dealloc, (void*)HitWriter_dealloc},
+		{Py_tp_doc, (void*)"HitWriter(path, chunk_hits=1048576, compress=True)\n\n"
+			"Writes decoded hits to a columnar file in chunks of chunk_hits hits, each indexed by its "
+			"time range and hits per channel, so that load() reads only the chunks it needs. "
+			"compress stores the times delta and bit-packed like compress() instead of as int64."},
+		{Py_tp_methods, HitWriter_methods},
+		{Py_tp_getset, HitWriter_getset},
+		{0, NULL}
+	};
+	PyType_Spec spec = {
+		MODULE_NAME ".HitWriter",
+		sizeof(HitWriterObject),
+		0,
+		Py_TPFLAGS_DEFAULT,
+		slots
+	};
+	PyObject* hit_writer_type = PyType_FromSpec(&spec);
+	if (!hit_writer_type)
+		return -1;
+	if (PyModule_AddObject(module, "HitWriter", hit_writer_type) < 0) {
+		Py_DECREF(hit_writer_type);
+		return -1;
+	}
+	Py_INCREF(&HitsType);
+	if (PyModule_AddObject(module, "Hits", (PyObject*)&HitsType) < 0) {
+		Py_DECREF(&HitsType);
+		return -1;
+	}
+	return 0;
+}
+
+// bit mask of the channels in an iterable of channel numbers, all channels for None
+static bool channel_mask_of(PyObject* channels, uint32_t* mask) {
+	if (channels == Py_None) {
+		*mask = (1u << HITFILE_CHANNELS) - 1;
+		return true;
+	}
+	PyObject* iterator = PyObject_GetIter(channels);
+	if (!iterator)
+		return false;
+	*mask = 0;
+	PyObject* item;
+	while ((item = PyIter_Next(iterator))) {
+		long channel = PyLong_AsLong(item);
+		Py_DECREF(item);
+		if (channel == -1 && PyErr_Occurred())
+			break;
+		if (channel < 0 || channel >= HITFILE_CHANNELS) {
+			PyErr_SetString(PyExc_ValueError, "channels must be within 0..15");
+			break;
+		}
+		*mask |= 1u << channel;
+	}
+	Py_DECREF(iterator);
+	return !PyErr_Occurred();
+}
+
+// t0 or t1 of load(), None for no bound
+static bool time_bound_of(PyObject* bound, int64_t none_value, int64_t* out) {
+	if (bound == Py_None) {
+		*out = none_value;
+		return true;
+	}
+	*out = (int64_t)PyLong_AsLongLong(bound);
+	return !(*out == -1 && PyErr_Occurred());
+}
+
+static PyObject* timetagger4vector_load(PyObject* self, PyObject* args, PyObject* kwds) {
+	static const char* keywords[] = { "path", "t0", "t1", "channels", NULL };
+	const char* path;
+	PyObject* t0_obj = Py_None;
+	PyObject* t1_obj = Py_None;
+	PyObject* channels = Py_None;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|OOO", (char**)keywords, &path, &t0_obj, &t1_obj, &channels))
+		return NULL;
+	int64_t t0, t1;
+	uint32_t mask;
+	if (!time_bound_of(t0_obj, INT64_MIN, &t0) || !time_bound_of(t1_obj, INT64_MAX, &t1) || !channel_mask_of(channels, &mask))
+		return NULL;
+
+	hit_reader reader;
+	hitfile_hits hits;
+	memset(&hits, 0, sizeof(hits));
+	const char* error;
+	bool out_of_memory = false;
+	Py_BEGIN_ALLOW_THREADS
+	try {
+		error = reader.open(path);
+		if (!error)
+			error = reader.load(t0, t1, mask, &hits);
+	}
+	catch (const std::bad_alloc&) {
+		out_of_memory = true;
+	}
+	Py_END_ALLOW_THREADS
+	if (out_of_memory) {
+		hitfile_hits_free(&hits);
+		return PyErr_NoMemory();
+	}
+	if (error) {
+		hitfile_hits_free(&hits);
+		PyErr_Format(PyExc_OSError, "%s: %s", error, path);
+		return NULL;
+	}
+
+	PyObject* result = PyStructSequence_New(&HitsType);
+	if (!result) {
+		hitfile_hits_free(&hits);
+		return NULL;
+	}
+	npy_intp count = (npy_intp)hits.count;
+	PyObject* times = array_from_buffer(hits.times, count, PyArray_DescrFromType(NPY_INT64));
+	PyObject* cards = array_from_buffer(hits.cards, count, PyArray_DescrFromType(NPY_UINT8));
+	PyObject* channel_array = array_from_buffer(hits.channels, count, PyArray_DescrFromType(NPY_UINT8));
+	PyObject* flags = array_from_buffer(hits.flags, count, PyArray_DescrFromType(NPY_UINT8));
+	PyObject* chunks_read = PyLong_FromUnsignedLongLong(reader.chunks_read);
+	if (!times || !cards || !channel_array || !flags || !chunks_read) {
+		Py_XDECREF(times);
+		Py_XDECREF(cards);
+		Py_XDECREF(channel_array);
+		Py_XDECREF(flags);
+		Py_XDECREF(chunks_read);
+		Py_DECREF(result);
+		return NULL;
+	}
+	PyStructSequence_SetItem(result, 0, times);
+	PyStructSequence_SetItem(result, 1, cards);
+	PyStructSequence_SetItem(result, 2, channel_array);
+	PyStructSequence_SetItem(result, 3, flags);
+	PyStructSequence_SetItem(result, 4, chunks_read);
+	return result;
+}
+
+static PyObject* timetagger4vector_compress(PyObject* self, PyObject* args) {
+	PyObject* batch_obj;
+	if (!PyArg_ParseTuple(args, "O!", &BatchType, &batch_obj))
+		return NULL;
+	batch_buffers b;
+	if (!get_ps_batch_buffers(batch_obj, &b))
+		return NULL;
+	std::vector<uint8_t>* data = new (std::nothrow) std::vector<uint8_t>();
+	bool ok = data != NULL;
+	if (ok) {
+		Py_BEGIN_ALLOW_THREADS
+		try {
+			codec_compress_batch((const int64_t*)b.values.buf, (const uint8_t*)b.channels.buf,
+				(const int64_t*)b.offsets.buf, (const batch_meta*)b.meta.buf, b.packet_count, data);
+		}
+		catch (const std::bad_alloc&) {
+			ok = false;
+		}
+		Py_END_ALLOW_THREADS
+	}
+	release_batch_buffers(&b);
+	PyObject* result = ok ? PyBytes_FromStringAndSize((const char*)data->data(), (Py_ssize_t)data->size()) : PyErr_NoMemory();
+	delete data;
+	return result;
+}
+
+static PyObject* timetagger4vector_decompress(PyObject* self, PyObject* args) {
+	Py_buffer data;
+	int mode = OUTPUT_PS;
+	if (!PyArg_ParseTuple(args, "y*|i", &data, &mode))
+		return NULL;
+	if (mode != OUTPUT_BINS && mode != OUTPUT_PS) {
+		PyBuffer_Release(&data);
+		PyErr_SetString(PyExc_ValueError, "mode must be OUTPUT_BINS or OUTPUT_PS");
+		return NULL;
+	}
+	hit_batch batch;
+	batch_init(&batch, mode);
+	const char* error;
+	Py_BEGIN_ALLOW_THREADS
+	try {
+		error = codec_decompress_batch((const uint8_t*)data.buf, (size_t)data.len, &batch);
+	}
+	catch (const std::bad_alloc&) {
+		error = "out of memory";
+	}
+	Py_END_ALLOW_THREADS
+	PyBuffer_Release(&data);
+	if (error) {
+		batch_free(&batch);
+		if (strcmp(error, "out of memory") == 0)
+			return PyErr_NoMemory();
+		PyErr_SetString(PyExc_ValueError, error);
+		return NULL;
+	}
+	return batch_to_python(&batch, 0.0);
+}
+#ifdef TIMETAGGER4_SIM
+
+static PyObject* sim_parameters_to_python(const sim_parameters* p) {
+	const double* w = p->channel_weights;
+	return Py_BuildValue("{s:d,s:(dddd),s:i,s:d,s:d,s:I,s:d,s:d,s:K}",
+		"hit_rate", p->hit_rate,
+		"channels", w[0], w[1], w[2], w[3],
+		"statistics", p->statistics,
+		"speed", p->speed,
+		"loss_rate", p->loss_rate,
+		"rollover_period", (unsigned int)p->rollover_period,
+		"binsize", p->binsize,
+		"packet_binsize", p->packet_binsize,
+		"seed", (unsigned long long)p->seed);
+}
+
+static PyObject* timetagger4vector_simulate(PyObject* self, PyObject* args, PyObject* kwds) {
+	static const char* keywords[] = { "hit_rate", "channels", "statistics", "speed", "loss_rate",
+		"rollover_period", "binsize", "packet_binsize", "seed", NULL };
+	sim_parameters p;
+	sim_get_parameters(&p);
+	PyObject* channels = Py_None;
+	unsigned int rollover_period = p.rollover_period;
+	unsigned long long seed = p.seed;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|dOiddIddK", (char**)keywords, &p.hit_rate, &channels,
+		&p.statistics, &p.speed, &p.loss_rate, &rollover_period, &p.binsize, &p.packet_binsize, &seed))
+		return NULL;
+	// None keeps the share of the channels
+	if (channels != Py_None) {
+		PyObject* weights = PySequence_Fast(channels, "channels must be a sequence of 4 weights");
+		if (!weights)
+			return NULL;
+		if (PySequence_Fast_GET_SIZE(weights) != TIMETAGGER4_TDC_CHANNEL_COUNT) {
+			Py_DECREF(weights);
+			PyErr_SetString(PyExc_ValueError, "channels must be a sequence of 4 weights");
+			return NULL;
+		}
+		for (int i = 0; i < TIMETAGGER4_TDC_CHANNEL_COUNT; i++)
+			p.channel_weights[i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(weights, i));
+		Py_DECREF(weights);
+		if (PyErr_Occurred())
+			return NULL;
+	}
+	p.rollover_period = rollover_period;
+	p.seed = seed;
+	const char* error = NULL;
+	bool negative_weight = false;
+	for (int i = 0; i < TIMETAGGER4_TDC_CHANNEL_COUNT; i++)
+		negative_weight |= !(p.channel_weights[i] >= 0);
+	if (!(p.hit_rate >= 0))
+		error = "hit_rate must not be negative";
+	else if (negative_weight)
+		error = "channel weights must not be negative";
+	else if (p.statistics != SIM_POISSON && p.statistics != SIM_PERIODIC)
+		error = "statistics must be SIM_POISSON or SIM_PERIODIC";
+	else if (!(p.speed >= 0))
+		error = "speed must not be negative";
+	else if (!(p.loss_rate >= 0 && p.loss_rate <= 1))
+		error = "loss_rate must be within 0..1";
+	else if (p.rollover_period < 1 || p.rollover_period > (1 << 24))
+		error = "rollover_period must be within 1..2^24";
+	else if (!(p.binsize > 0) || !(p.packet_binsize > 0))
+		error = "binsize and packet_binsize must be positive";
+	if (error) {
+		PyErr_SetString(PyExc_ValueError, error);
+		return NULL;
+	}
+	sim_set_parameters(&p);
+	return sim_parameters_to_python(&p);
+}
+
+static PyObject* timetagger4vector_replay(PyObject* self, PyObject* args, PyObject* kwds) {
+	static const char* keywords[] = { "path", "speed", "loop", NULL };
+	const char* path = NULL;
+	double speed = 1.0;
+	int loop = 0;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "z|dp", (char**)keywords, &path, &speed, &loop))
+		return NULL;
+	if (!(speed >= 0)) {
+		PyErr_SetString(PyExc_ValueError, "speed must not be negative");
+		return NULL;
+	}
+	sim_replay r;
+	r.path = path ? path : "";
+	r.speed = speed;
+	r.loop = loop != 0;
+	const char* error;
+	Py_BEGIN_ALLOW_THREADS
+	error = sim_set_replay(&r);
+	Py_END_ALLOW_THREADS
+	if (error) {
+		PyErr_Format(PyExc_OSError, "%s: %s", error, path);
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
 
+#endif
@@ -0,0 +1,514 @@
+# Checks of the extension against the simulated board, run after installing the package:
+#   python -m unittest discover timetagger4ext/tests
+import os
+import shutil
+import tempfile
+import threading
+import time
+import unittest
+
+import numpy as np
+from crono_exts import timetagger4sim as tt4
+
+
+# A started card, of hits at a fixed seed as fast as they are read unless simulate() says otherwise
+def started_device(card=1, buffer_size=1 << 20, tdc_mode=tt4.TDC_MODE_GROUPED, enabled=None):
+	d = tt4.Device(card, card)
+	d.init(buffer_size)
+	d.config(tdc_mode)
+	if enabled is not None:
+		channels = d.get_config()['channel']
+		for c, on in enumerate(enabled):
+			channels[c]['enabled'] = on
+		d.configure({'channel': channels})
+	d.start()
+	return d
+
+
+def closed(d):
+	d.stop()
+	d.close()
+
+
+def concatenated(batches, field):
+	return np.concatenate([getattr(b, field) for b in batches])
+
+
+class SimTestCase(unittest.TestCase):
+	def setUp(self):
+		self.parameters = tt4.simulate(speed=0.0, seed=7)
+		self.directory = tempfile.mkdtemp()
+
+	def tearDown(self):
+		tt4.simulate(**self.parameters)
+		shutil.rmtree(self.directory)
+
+	def path(self, name):
+		return os.path.join(self.directory, name)
+
+	def read_batches(self, d, count, mode=tt4.OUTPUT_PS):
+		return [d.read_batch(mode) for i in range(count)]
+
+	def assert_batches_equal(self, batches, expected, fields=('values', 'channels', 'meta')):
+		for field in fields:
+			np.testing.assert_array_equal(concatenated(batches, field), concatenated(expected, field))
+
+
+class DecodeKernelTest(SimTestCase):
+	def setUp(self):
+		SimTestCase.setUp(self)
+		self.kernel = tt4.decode_kernel
+
+	def tearDown(self):
+		tt4.set_decode_kernel(self.kernel)
+		SimTestCase.tearDown(self)
+
+	def test_kernels_agree(self):
+		d = started_device()
+		packets = d.read_raw(1.0)
+		decoded = {}
+		for kernel in ('scalar', 'avx2', 'avx512'):
+			try:
+				tt4.set_decode_kernel(kernel)
+			except ValueError:
+				continue
+			decoded[kernel] = [packets.decode(mode) for mode in (tt4.OUTPUT_NS, tt4.OUTPUT_BINS, tt4.OUTPUT_PS)]
+		packets.release()
+		closed(d)
+		self.assertIn('scalar', decoded)
+		for kernel in decoded:
+			for batch, expected in zip(decoded[kernel], decoded['scalar']):
+				self.assert_batches_equal([batch], [expected], ('values', 'channels', 'offsets', 'meta'))
+
+
+class StreamingTest(SimTestCase):
+	def pop_all(self, d, packets):
+		batches = []
+		while sum(len(b.meta) for b in batches) < packets:
+			b = d.pop(1.0)
+			self.assertIsNotNone(b)
+			batches.append(b)
+		return batches
+
+	def test_pop_matches_read_batch(self):
+		d = started_device()
+		expected = self.read_batches(d, 5)
+		closed(d)
+		d = started_device()
+		d.start_streaming(tt4.OUTPUT_PS, 1000)
+		batches = self.pop_all(d, sum(len(b.meta) for b in expected))
+		d.stop_streaming()
+		self.assertEqual(d.streaming_info()['batches_dropped'], 0)
+		closed(d)
+		packets = sum(len(b.meta) for b in expected)
+		hits = sum(len(b.values) for b in expected)
+		np.testing.assert_array_equal(concatenated(batches, 'meta')[:packets], concatenated(expected, 'meta'))
+		np.testing.assert_array_equal(concatenated(batches, 'values')[:hits], concatenated(expected, 'values'))
+
+	def test_restart_while_popping(self):
+		d = started_device()
+		running = [True]
+		def consume():
+			while running[0]:
+				d.pop(0.001)
+		consumer = threading.Thread(target=consume)
+		consumer.start()
+		for i in range(50):
+			d.start_streaming(tt4.OUTPUT_PS, 1 + i % 5)
+		d.stop_streaming()
+		running[0] = False
+		consumer.join()
+		self.assertFalse(d.streaming_info()['running'])
+		closed(d)
+
+
+class ReadIntoTest(SimTestCase):
+	def test_read_into_matches_read_batch(self):
+		d = started_device()
+		batches = self.read_batches(d, 5)
+		closed(d)
+		values = concatenated(batches, 'values')
+		meta = concatenated(batches, 'meta')
+
+		# the same seed gives the same hits on a new card
+		d = started_device()
+		into_values = np.empty(len(values) + 10000, np.int64)
+		into_offsets = np.empty(len(meta) + 1001, np.int64)
+		into_meta = np.empty(len(meta) + 1000, tt4.batch_meta_bins_dtype)
+		got_values = []
+		got_meta = []
+		while sum(len(m) for m in got_meta) < len(meta):
+			hits, packets, more = d.read_into(into_values, into_offsets, into_meta, 1.0, 1, tt4.OUTPUT_PS)
+			self.assertEqual(into_offsets[packets], hits)
+			got_values.append(into_values[:hits].copy())
+			got_meta.append(into_meta[:packets].copy())
+		closed(d)
+		np.testing.assert_array_equal(np.concatenate(got_values)[:len(values)], values)
+		np.testing.assert_array_equal(np.concatenate(got_meta)[:len(meta)], meta)
+
+
+class PoolTest(SimTestCase):
+	def setUp(self):
+		SimTestCase.setUp(self)
+		self.limit = tt4.pool_stats()['limit']
+
+	def tearDown(self):
+		tt4.set_pool_limit(self.limit)
+		SimTestCase.tearDown(self)
+
+	def test_buffers_are_reused(self):
+		d = started_device()
+		self.read_batches(d, 3)
+		before = tt4.pool_stats()
+		# the arrays of every batch go back to the pool before the next read
+		self.read_batches(d, 20)
+		after = tt4.pool_stats()
+		closed(d)
+		self.assertGreater(after['hits'] - before['hits'], after['misses'] - before['misses'])
+		self.assertGreater(after['bytes_held'], 0)
+		tt4.set_pool_limit(0)
+		self.assertEqual(tt4.pool_stats()['bytes_held'], 0)
+		self.assertEqual(tt4.pool_stats()['buffers_held'], 0)
+
+
+class WaitTest(SimTestCase):
+	def test_wait_returns_with_the_data(self):
+		tt4.simulate(speed=1.0, hit_rate=1e5)
+		d = started_device()
+		b = d.read_batch(tt4.OUTPUT_PS, 1.0, 1)
+		self.assertGreater(len(b.meta), 0)
+		self.assertLess(b.wait, 0.5)
+		# without data the read waits out the timeout and returns an empty batch
+		d.stop()
+		b = d.read_batch(tt4.OUTPUT_PS, 0.05, 1)
+		self.assertEqual(len(b.meta), 0)
+		self.assertGreaterEqual(b.wait, 0.05)
+		d.close()
+
+
+class ContinuousTest(SimTestCase):
+	def test_absolute_timeline(self):
+		d = started_device(tdc_mode=tt4.TDC_MODE_CONTINUOUS)
+		self.assertEqual(d.get_config()['tdc_mode'], tt4.TDC_MODE_CONTINUOUS)
+		batches = self.read_batches(d, 3)
+		closed(d)
+		meta = concatenated(batches, 'meta')
+		values = concatenated(batches, 'values')
+		self.assertTrue(np.all(np.diff(meta['timestamp']) > 0))
+		# every hit lies at or after the start of its group on the same ps timeline
+		self.assertTrue(np.all(values >= np.repeat(meta['timestamp'], meta['hit_count'])))
+
+
+class ChannelsTest(SimTestCase):
+	def check_channels(self, enabled):
+		d = started_device(enabled=enabled)
+		batch = d.read_batch(tt4.OUTPUT_PS)
+		closed(d)
+		d = started_device(enabled=enabled)
+		split = d.read_channels(tt4.OUTPUT_PS)
+		closed(d)
+		self.assertEqual(split.channels, tuple(c for c, on in enumerate(enabled) if on))
+		self.assertEqual(split.offsets.shape, (len(split.channels), len(batch.meta) + 1))
+		np.testing.assert_array_equal(split.meta, batch.meta)
+		for row, channel in enumerate(split.channels):
+			np.testing.assert_array_equal(split.values[row], batch.values[batch.channels == channel])
+			per_packet = [np.count_nonzero(batch.channels[batch.offsets[i]:batch.offsets[i + 1]] == channel)
+				for i in range(len(batch.meta))]
+			np.testing.assert_array_equal(np.diff(split.offsets[row]), per_packet)
+
+	def test_all_channels(self):
+		self.check_channels((True, True, True, True))
+
+	def test_enabled_channels_only(self):
+		self.check_channels((True, False, True, False))
+
+
+class StatsTest(SimTestCase):
+	def test_dropped_groups(self):
+		tt4.simulate(loss_rate=0.1, statistics=tt4.SIM_PERIODIC)
+		d = started_device()
+		batches = self.read_batches(d, 5)
+		stats = d.stats()
+		meta = concatenated(batches, 'meta')
+		self.assertEqual(stats['packets'], len(meta))
+		self.assertEqual(stats['hit_words'] >= len(concatenated(batches, 'values')), True)
+		self.assertGreater(stats['groups_dropped'], 0)
+		self.assertEqual(stats['groups_dropped'], int(meta['gap'].sum()))
+		self.assertEqual(stats['gaps'], int(np.count_nonzero(meta['gap'])))
+		d.reset_stats()
+		self.assertEqual(d.stats()['packets'], 0)
+		self.assertEqual(d.stats()['groups_dropped'], 0)
+		closed(d)
+
+	def test_host_buffer_full(self):
+		tt4.simulate(speed=1.0, hit_rate=5e7)
+		d = started_device(buffer_size=65536)
+		for i in range(4):
+			time.sleep(0.05)
+			d.read_batch(tt4.OUTPUT_PS)
+		stats = d.stats()
+		closed(d)
+		self.assertGreater(stats['host_buffer_full'], 0)
+		self.assertEqual(stats['host_buffer_full'], stats['flags'][5])
+
+
+class MergerTest(SimTestCase):
+	def shifted(self, batch, ps):
+		meta = batch.meta.copy()
+		meta['timestamp'] += ps
+		return tt4.Batch((batch.values + ps, batch.offsets, meta, 0.0, batch.channels))
+
+	def test_merged_time_order(self):
+		d = started_device()
+		batch = d.read_batch(tt4.OUTPUT_PS)
+		closed(d)
+		m = tt4.Merger(2, 10**6)
+		m.push(0, batch)
+		# the second source lags by half a group
+		m.push(1, self.shifted(batch, 125000))
+		m.finish(0)
+		m.finish(1)
+		merged = m.pop(True)
+		self.assertEqual(len(merged.time), 2 * len(batch.values))
+		self.assertTrue(np.all(np.diff(merged.time) >= 0))
+		self.assertEqual(m.pending, 0)
+
+	def test_late_hits(self):
+		d = started_device()
+		first = d.read_batch(tt4.OUTPUT_PS)
+		closed(d)
+		m = tt4.Merger(1, 10**6)
+		m.push(0, self.shifted(first, 10**12))
+		m.pop(True)
+		# hits behind what was handed out already are dropped and counted
+		m.push(0, first)
+		m.pop(True)
+		self.assertEqual(m.late_hits, len(first.values))
+
+
+class ClockSyncTest(SimTestCase):
+	def test_pairs_group_starts(self):
+		tt4.simulate(speed=1.0, hit_rate=1e5)
+		devices = [started_device(card) for card in (1, 2)]
+		sync = tt4.ClockSync(devices[0], devices[1:], tolerance=10**9)
+		for i in range(10):
+			for d in devices:
+				d.read_batch(tt4.OUTPUT_PS, 0.1, 2)
+			result = sync.update()
+		sync.close()
+		for d in devices:
+			closed(d)
+		self.assertEqual(len(result), 2)
+		self.assertGreater(result[1]['pairs'], 0)
+		self.assertEqual(result[1]['unmatched'], 0)
+		self.assertTrue(result[1]['locked'])
+		# the simulated cards share one clock
+		self.assertLess(abs(result[1]['offset']), 1e6)
+		self.assertLess(abs(result[1]['drift']), 1e-6)
+
+
+class ConfigureTest(SimTestCase):
+	def test_auto_trigger_period_by_mode(self):
+		d = tt4.Device(1, 1)
+		d.init(65536)
+		d.config()
+		self.assertEqual(d.get_config()['tdc_mode'], tt4.TDC_MODE_GROUPED)
+		# grouped mode takes periods outside the continuous limits
+		self.assertEqual(d.configure({'auto_trigger_period': 10}), 0)
+		self.assertEqual(d.configure({'auto_trigger_period': 2**31 - 1}), 0)
+		self.assertEqual(d.get_config()['auto_trigger_period'], 2**31 - 1)
+		with self.assertRaises(ValueError):
+			d.configure({'tdc_mode': tt4.TDC_MODE_CONTINUOUS, 'auto_trigger_period': 10})
+		d.close()
+
+
+class BackpressureTest(SimTestCase):
+	def test_buffer_watermark_pauses(self):
+		# the queue never fills, so only the host buffer can pause the board
+		tt4.simulate(hit_rate=2e6, speed=1.0)
+		d = started_device(buffer_size=65536)
+		d.set_backpressure(True, 1.0, 0.25, 0.25)
+		d.start_streaming(tt4.OUTPUT_PS, 100000)
+		deadline = time.time() + 0.5
+		while time.time() < deadline:
+			d.pop(0.01)
+		d.stop_streaming()
+		info = d.streaming_info()
+		closed(d)
+		self.assertEqual(info['batches_dropped'], 0)
+		self.assertGreater(info['pauses'], 0)
+
+
+class LoadSheddingTest(SimTestCase):
+	def test_exact_counts(self):
+		tt4.simulate(speed=1.0, hit_rate=2e6)
+		d = started_device(buffer_size=8 << 20)
+		d.set_load_shedding(tt4.SHED_DROP_GROUPS, 0, 0.5, 0.25)
+		d.start_streaming(tt4.OUTPUT_PS, 8)
+		kept = []
+		deadline = time.time() + 0.5
+		# a slow consumer
+		while time.time() < deadline:
+			b = d.pop(0.01)
+			if b is not None:
+				kept.append(b.meta)
+			time.sleep(0.005)
+		d.stop_streaming()
+		b = d.pop()
+		while b is not None:
+			kept.append(b.meta)
+			b = d.pop()
+		info = d.streaming_info()
+		packets = d.stats()['packets']
+		closed(d)
+		meta = np.concatenate(kept)
+		self.assertGreater(info['groups_shed'], 0)
+		self.assertEqual(info['batches_dropped'], 0)
+		# every group read is either kept or counted as shed
+		self.assertEqual(len(meta) + info['groups_shed'], packets)
+		self.assertLessEqual(int(meta['shed_groups'].sum()), info['groups_shed'])
+
+
+class RawFileTest(SimTestCase):
+	def test_record_round_trip(self):
+		d = started_device()
+		d.record(self.path('run.tt4'))
+		batches = self.read_batches(d, 20)
+		d.stop_recording()
+		self.assertFalse(d.recording_info()['recording'])
+		closed(d)
+		f = tt4.RawFile(self.path('run.tt4'))
+		read = []
+		b = f.read(tt4.OUTPUT_PS, 1 << 16, 2)
+		while b is not None:
+			read.append(b)
+			b = f.read(tt4.OUTPUT_PS, 1 << 16, 2)
+		self.assertFalse(f.truncated)
+		f.close()
+		self.assert_batches_equal(read, batches)
+
+
+class HitFileTest(SimTestCase):
+	def test_write_load_round_trip(self):
+		d = started_device()
+		batches = self.read_batches(d, 50)
+		closed(d)
+		times = concatenated(batches, 'values')
+		channels = concatenated(batches, 'channels')
+		for compress in (False, True):
+			w = tt4.HitWriter(self.path('hits.tt4h'), chunk_hits=5000, compress=compress)
+			for b in batches:
+				w.write(b)
+			w.close()
+			hits = tt4.load(self.path('hits.tt4h'))
+			np.testing.assert_array_equal(hits.time, times)
+			np.testing.assert_array_equal(hits.channel, channels)
+			# a window reads only the chunks that hold some of it
+			t0 = int(times[len(times) // 2])
+			t1 = t0 + 10**10
+			part = tt4.load(self.path('hits.tt4h'), t0, t1, channels=[1, 3])
+			selected = (times >= t0) & (times < t1) & np.isin(channels, [1, 3])
+			np.testing.assert_array_equal(part.time, times[selected])
+			self.assertLess(part.chunks_read, w.chunks)
+
+
+class CompressTest(SimTestCase):
+	def test_round_trip(self):
+		d = started_device()
+		for mode in (tt4.OUTPUT_PS, tt4.OUTPUT_BINS):
+			b = d.read_batch(mode)
+			r = tt4.decompress(tt4.compress(b), mode)
+			self.assert_batches_equal([r], [b], ('values', 'channels', 'offsets', 'meta'))
+		closed(d)
+
+
+class ErrorTest(SimTestCase):
+	def test_closed_objects(self):
+		d = started_device()
+		batch = d.read_batch(tt4.OUTPUT_PS)
+		packets = d.read_raw(1.0)
+		# the views of a packet buffer point into the DMA buffer
+		with self.assertRaises(RuntimeError):
+			d.close()
+		packets.release()
+		closed(d)
+		with self.assertRaises(RuntimeError):
+			d.read_batch(tt4.OUTPUT_PS)
+
+		w = tt4.HitWriter(self.path('hits.tt4h'))
+		w.write(batch)
+		w.close()
+		with self.assertRaises(ValueError):
+			w.write(batch)
+
+		d = started_device()
+		d.record(self.path('run.tt4'))
+		d.read_batch(tt4.OUTPUT_PS)
+		d.stop_recording()
+		closed(d)
+		f = tt4.RawFile(self.path('run.tt4'))
+		f.close()
+		with self.assertRaises(ValueError):
+			f.read()
+
+	def test_invalid_input(self):
+		d = started_device()
+		batch = d.read_batch(tt4.OUTPUT_PS)
+		with self.assertRaises(ValueError):
+			d.read_into(np.empty(100, np.int32), np.empty(10, np.int64), np.empty(9, tt4.batch_meta_bins_dtype))
+		with self.assertRaises(ValueError):
+			d.configure({'tdc_mode': 7})
+		closed(d)
+
+		data = tt4.compress(batch)
+		for bad in (data[:10], data[:-1], b'XXXX' + data[4:]):
+			with self.assertRaises(ValueError):
+				tt4.decompress(bad)
+
+		with open(self.path('text.txt'), 'w') as text:
+			text.write('not a recording\n' * 100)
+		with self.assertRaises(OSError):
+			tt4.RawFile(self.path('text.txt'))
+		with self.assertRaises(OSError):
+			tt4.load(self.path('text.txt'))
+		w = tt4.HitWriter(self.path('hits.tt4h'))
+		w.write(batch)
+		w.close()
+		with self.assertRaises(ValueError):
+			tt4.load(self.path('hits.tt4h'), channels=[16])
+
+
+class ReplayTest(SimTestCase):
+	def tearDown(self):
+		tt4.replay(None)
+		SimTestCase.tearDown(self)
+
+	def test_replay_matches_raw_file(self):
+		tt4.simulate(loss_rate=0.05)
+		d = started_device()
+		d.record(self.path('run.tt4'))
+		self.read_batches(d, 10, tt4.OUTPUT_BINS)
+		d.stop_recording()
+		closed(d)
+		f = tt4.RawFile(self.path('run.tt4'))
+		expected = []
+		b = f.read(tt4.OUTPUT_BINS)
+		while b is not None:
+			expected.append(b)
+			b = f.read(tt4.OUTPUT_BINS)
+		f.close()
+
+		# as fast as read, the packets of the file and then nothing
+		tt4.replay(self.path('run.tt4'), 0.0)
+		d = started_device()
+		replayed = []
+		b = d.read_batch(tt4.OUTPUT_BINS, 0.05)
+		while len(b.meta) > 0:
+			replayed.append(b)
+			b = d.read_batch(tt4.OUTPUT_BINS, 0.05)
+		closed(d)
+		self.assert_batches_equal(replayed, expected)
+
+
+if __name__ == '__main__':
+	unittest.main()
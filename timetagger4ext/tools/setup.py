@@ -9,12 +9,16 @@ class BuildExt(build_ext_orig):
     def build_extensions(self):
         compiler_type = self.compiler.compiler_type
         opts = []
+        link_opts = []
         if compiler_type == 'msvc':
             opts.append('/EHsc')
         else:
             opts.append('-std=c++11')
+            opts.append('-pthread')
+            link_opts.append('-pthread')
         for ext in self.extensions:
             ext.extra_compile_args = opts
+            ext.extra_link_args = link_opts
         build_ext_orig.build_extensions(self)
 
 class CustomInstallCommand(install_orig):
@@ -26,6 +30,8 @@ class CustomInstallCommand(install_orig):
         self._copy_dll()
 
     def _copy_dll(self):
+        if not BUILD_DRIVER:
+            return
         dll_src = os.path.abspath('../lib/xtdc4_driver_64.dll')
         dll_dst = os.path.join(self.install_lib, 'crono_exts', 'xtdc4_driver_64.dll')
         self.copy_file(dll_src, dll_dst)
@@ -39,23 +45,53 @@ class CustomDevelopCommand(develop_orig):
         self._copy_dll()
 
     def _copy_dll(self):
+        if not BUILD_DRIVER:
+            return
         dll_src = os.path.abspath('../lib/xtdc4_driver_64.dll')
         dll_dst = os.path.join(self.install_lib, 'crono_exts', 'xtdc4_driver_64.dll')
         self.copy_file(dll_src, dll_dst)
 
+# The driver is only available for Windows, the simulated board builds everywhere
+BUILD_DRIVER = os.name == 'nt'
+
+sources = [
+    '../src/crono_exts/timetagger4ext.cpp',
+    '../src/crono_exts/timetagger4_batch.cpp',
+    '../src/crono_exts/timetagger4_clock.cpp',
+    '../src/crono_exts/timetagger4_codec.cpp',
+    '../src/crono_exts/timetagger4_config.cpp',
+    '../src/crono_exts/timetagger4_decode.cpp',
+    '../src/crono_exts/timetagger4_hitfile.cpp',
+    '../src/crono_exts/timetagger4_merge.cpp',
+    '../src/crono_exts/timetagger4_pool.cpp',
+    '../src/crono_exts/timetagger4_rawfile.cpp',
+    '../src/crono_exts/timetagger4_record.cpp',
+    '../src/crono_exts/timetagger4_stream.cpp',
+]
+include_dirs = [
+    numpy.get_include(),     # Include the NumPy headers
+    os.path.abspath('../include'),  # Include the additional ../include directory
+]
+
 # Define the extension module
 extension_mod = Extension(
     'crono_exts.timetagger4vector',     # From "PyMODINIT_FUNC PyInit_timetagger4vector"
-    sources=['../src/crono_exts/timetagger4ext.cpp'], 
-    include_dirs=[
-        numpy.get_include(),     # Include the NumPy headers
-        os.path.abspath('../include'),  # Include the additional ../include directory
-    ],
+    sources=sources,
+    include_dirs=include_dirs,
     language='c++',                  # Language of the source file(s)
     libraries=['xtdc4_driver_64'],      # Add your external libraries here, no extension
     library_dirs=[os.path.abspath('../lib')], # Directory of the external libraries
 )
 
+# The same module on the simulated board instead of the driver
+sim_extension_mod = Extension(
+    'crono_exts.timetagger4sim',     # From "PyMODINIT_FUNC PyInit_timetagger4sim"
+    sources=sources + ['../src/crono_exts/timetagger4_sim.cpp'],
+    include_dirs=include_dirs,
+    define_macros=[('TIMETAGGER4_SIM', '1'), ('TIMETAGGER4_DRIVER_EXPORTS', '1')],
+    language='c++',
+)
+
 # Setup function
 setup(
     name='crono_exts',             # Name of the package
@@ -63,14 +99,14 @@ setup(
     description='A sample C++ extension using CPython',
     package_dir={'': '../src'},         # Root directory for the package
     packages=['crono_exts'],       # List of packages to include
-    ext_modules=[extension_mod],     # List of extension modules
+    ext_modules=[extension_mod, sim_extension_mod] if BUILD_DRIVER else [sim_extension_mod],     # List of extension modules
     cmdclass={
         'build_ext': BuildExt,
         'install': CustomInstallCommand,
         'develop': CustomDevelopCommand,
     },
     package_data={
-        'crono_exts': ['xtdc4_driver_64.dll'],
+        'crono_exts': ['xtdc4_driver_64.dll'] if BUILD_DRIVER else [],
     },
     include_package_data=True,
     install_requires=[